@@ -0,0 +1,20 @@
+#ifndef ALLOC_STATS_H_SENTRY
+#define ALLOC_STATS_H_SENTRY
+
+#include "u.h"
+
+/* Counters every allocator keeps, a few adds per call. Bytes committed
+ * and not in use are what fragmentation and free space cost.
+ */
+typedef struct alloc_stats_t {
+	uint64 allocs;
+	uint64 frees;
+	uint64 fails;				/* allocations refused */
+	uint64 in_use;				/* bytes handed out */
+	uint64 high;				/* high-water mark of in_use */
+	uint64 committed;			/* bytes backed by memory */
+	uint64 grows;				/* mappings and commits */
+	uint64 shrinks;				/* unmappings */
+} alloc_stats;
+
+#endif
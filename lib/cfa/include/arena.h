@@ -1,13 +1,27 @@
 #ifndef ARENA_H_SENTRY
 #define ARENA_H_SENTRY
 
+#include "alloc_stats.h"
+
+/* A reserved arena maps buf_len bytes of address space with no access and
+ * commits them as it grows, so what it returns never moves.
+ */
 typedef struct arena_t {
 	byte *buf;
 	uint64 buf_len;
+	uint64 commit_len;			/* bytes usable from buf */
 	uint64 prev_off;
 	uint64 curr_off;
+	alloc_stats st;				/* frees count resets to an earlier offset */
 } arena;
 
+/* How arena_create_flags backs an arena. Huge pages come from the
+ * hugetlb pool when it has any, else transparent huge pages are asked
+ * for. Prefaulted arenas take no page faults later, locked ones are
+ * never swapped out.
+ */
+enum { arena_huge = 1, arena_prefault = 2, arena_lock = 4 };
+
 typedef struct temp_arena_t {
 	arena *arena;
 	uint64 prev_off;
@@ -24,5 +38,7 @@ void *arena_resize(arena * a, void *old_mem, uint64 old_size, uint64 new_size);
 void arena_init(arena * a, void *buf, uint64 buf_len);
 void arena_free_all(arena * a);
 void arena_create(arena * a, uint64 size);
+void arena_create_flags(arena * a, uint64 size, int flags);
+void arena_reserve(arena * a, uint64 size);
 
 #endif
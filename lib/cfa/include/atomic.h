@@ -0,0 +1,28 @@
+#ifndef ATOMIC_H_SENTRY
+#define ATOMIC_H_SENTRY
+
+/* C11 style atomics on the compiler builtins, for any integer or pointer
+ * object. Loads acquire, stores release and read-modify-writes do both
+ * unless the name says relaxed.
+ */
+#define atomic_load(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define atomic_load_relaxed(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define atomic_store(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define atomic_store_relaxed(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#define atomic_exchange(p, v) __atomic_exchange_n((p), (v), __ATOMIC_ACQ_REL)
+#define atomic_fetch_add(p, v) __atomic_fetch_add((p), (v), __ATOMIC_ACQ_REL)
+#define atomic_fetch_add_relaxed(p, v) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+#define atomic_fetch_sub(p, v) __atomic_fetch_sub((p), (v), __ATOMIC_ACQ_REL)
+
+/* On failure *expected gets the value found. */
+#define atomic_cas(p, expected, v) \
+	__atomic_compare_exchange_n((p), (expected), (v), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+
+#define atomic_fence() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+/* In spin loops, lets the sibling hyperthread run. */
+#define cpu_relax() __builtin_ia32_pause()
+
+enum { cache_line = 64 };
+
+#endif
@@ -73,6 +73,7 @@ uint64 int_in_slice(slice s, int64 x);
 
 void *memcpy(void *dst, const void *src, uint64 length);
 void *memmove(void *dst, const void *src, uint64 length);
+void *memset(void *dst, int c, uint64 length);
 int memequal(const void *dst, const void *src, uint64 length);
 
 void panic(const char *msg);
@@ -0,0 +1,63 @@
+#ifndef EXECUTOR_H_SENTRY
+#define EXECUTOR_H_SENTRY
+
+#include "u.h"
+#include "errno.h"
+#include "atomic.h"
+#include "thread.h"
+
+/* Work-stealing executor. Each worker runs tasks from its own Chase-Lev
+ * deque and steals from the others when it runs dry, then sleeps on a
+ * futex. One outside thread, an event loop, submits into a deque of its
+ * own that the workers steal from. Finished tasks are handed back to it
+ * through an eventfd, it calls executor_complete to run their done
+ * callbacks on its own thread.
+ */
+enum { exec_max_workers = 8, deque_len = 1024 };
+
+struct exec_worker_t;
+
+typedef struct task_t {
+	void (*run)(struct task_t * t, struct exec_worker_t * w);	/* w - nil when run inline */
+	void (*done)(struct task_t * t);	/* by executor_complete, may be nil */
+	struct task_t *next;
+} task;
+
+/* The owner pushes and takes at the bottom, thieves take at the top. */
+typedef struct deque_t {
+	int64 top __attribute__ ((aligned(cache_line)));
+	int64 bottom __attribute__ ((aligned(cache_line)));
+	task *buf[deque_len];
+} deque;
+
+typedef struct exec_worker_t {
+	deque d;
+	thread t;
+	struct executor_t *ex;
+	int id;
+	uint64 seed;				/* of the victim order */
+	uint64 runs;
+	uint64 steals;
+	uint64 parks;
+} exec_worker;
+
+typedef struct executor_t {
+	deque submit;
+	exec_worker w[exec_max_workers];
+	int n;
+	int efd;					/* readable when tasks are done */
+	task *done __attribute__ ((aligned(cache_line)));
+	uint32 wake_seq __attribute__ ((aligned(cache_line)));
+	uint32 sleepers;
+	uint32 stop;
+	uint64 submitted;
+	uint64 inline_runs;			/* deque full, ran on the submitter */
+} executor;
+
+const error *executor_start(executor * ex, int workers);
+void executor_submit(executor * ex, task * t);
+void executor_spawn(executor * ex, exec_worker * w, task * t);
+int executor_complete(executor * ex);
+void executor_stop(executor * ex);
+
+#endif
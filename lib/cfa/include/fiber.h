@@ -0,0 +1,70 @@
+#ifndef FIBER_H_SENTRY
+#define FIBER_H_SENTRY
+
+#include "u.h"
+#include "errno.h"
+
+/* Stackful coroutines on one thread. A fiber runs until it yields, waits
+ * for a descriptor or returns. The scheduler then runs the next ready
+ * fiber, and when there is none it sleeps in epoll_wait until a
+ * descriptor some fiber waits for is ready. To the fiber, fiber_read and
+ * fiber_write look blocking: on EAGAIN it parks and the scheduler resumes
+ * it from epoll. Descriptors must be non-blocking, and only one fiber at a
+ * time may wait for a given descriptor.
+ *
+ * A fiber is a single mapping: a guard page, the stack, and the fiber
+ * struct at the top. An idle fiber costs only the stack pages it has
+ * touched.
+ */
+enum {
+	fiber_stack_size = 16 * 1024,
+	fiber_keep_free = 64,		/* finished fibers kept for reuse */
+	fiber_max_events = 64
+};
+
+struct fiber_sched_t;
+
+typedef struct fiber_t {
+	void *sp;					/* saved while switched out */
+	struct fiber_sched_t *s;
+	struct fiber_t *next;		/* ready queue or free list */
+	void (*fn)(void *);			/* nil - finished */
+	void *arg;
+	byte *map;					/* the mapping, the guard page first */
+	uint64 map_len;
+	int wait_fd;				/* registered in epoll, -1 - none */
+	uint32 events;				/* what woke it from epoll */
+} fiber;
+
+typedef struct fiber_sched_t {
+	void *sp;					/* the scheduler's own while a fiber runs */
+	fiber *current;
+	fiber *ready;
+	fiber *ready_tail;
+	fiber *free;
+	uint32 n_free;
+	uint64 stack_size;
+	uint64 live;
+	uint64 switches;
+	uint64 parks;
+	int epfd;
+} fiber_sched;
+
+const error *fiber_sched_init(fiber_sched * s, uint64 stack_size);
+void fiber_sched_close(fiber_sched * s);
+fiber *fiber_spawn(fiber_sched * s, void (*fn)(void *), void *arg, const error ** err);
+void fiber_run(fiber_sched * s);
+
+/* From inside a fiber. */
+void fiber_yield(fiber_sched * s);
+const error *fiber_wait(fiber_sched * s, int fd, uint32 events);
+int64 fiber_read(fiber_sched * s, int fd, char *buf, uint64 len, const error ** err);
+int64 fiber_write(fiber_sched * s, int fd, const char *buf, uint64 len, const error ** err);
+int fiber_accept(fiber_sched * s, int fd, const error ** err);
+
+/* Saves the callee-saved registers on the current stack, stores the stack
+ * pointer in *save_sp and resumes the context saved at sp.
+ */
+void fiber_switch(void **save_sp, void *sp);
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef LZ_H_SENTRY
+#define LZ_H_SENTRY
+
+#include "u.h"
+
+/* LZ77 compression in the LZ4 block format: sequences of a token, literals
+ * and a match of at least four bytes at most 64 KiB back. Blocks are
+ * independent, any LZ4 block decoder can read them.
+ */
+enum {
+	lz_hash_log = 12,
+	lz_min_match = 4,
+	lz_max_offset = 65535,
+	/* Inputs shorter than that are stored as literals only. */
+	lz_min_input = 13
+};
+
+/* Positions of recently seen four byte sequences. Positions are offset by
+ * base, which moves past each input, so the table never needs clearing
+ * between blocks.
+ */
+typedef struct lz_table_t {
+	uint32 base;
+	uint32 pos[1 << lz_hash_log];
+} lz_table;
+
+void lz_init(lz_table * t);
+uint64 lz_bound(uint64 n);
+uint64 lz_compress(lz_table * t, const byte * src, uint64 n, byte * dst);
+int64 lz_decompress(const byte * src, uint64 n, byte * dst, uint64 cap);
+
+#endif
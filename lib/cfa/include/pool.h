@@ -2,6 +2,7 @@
 #define POOL_H_SENTRY 1
 
 #include "u.h"
+#include "alloc_stats.h"
 
 typedef struct free_node_t {
 	struct free_node_t *next;
@@ -12,6 +13,7 @@ typedef struct pool_t {
 	uint64 buf_len;
 	uint64 chunk_size;
 	free_node *head;
+	alloc_stats st;
 } pool;
 
 void pool_init(pool * p, void *buf, uint64 buf_len, uint64 chunk_size, uint64 chunk_align);
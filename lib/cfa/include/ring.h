@@ -0,0 +1,47 @@
+#ifndef RING_H_SENTRY
+#define RING_H_SENTRY
+
+#include "u.h"
+#include "atomic.h"
+
+/* Bounded lock-free queues of pointers, the capacity a power of two and
+ * the storage the caller's. Producer and consumer indexes live on cache
+ * lines of their own so the two sides don't bounce one line.
+ */
+
+/* One producer, one consumer. Each side keeps a copy of the other's
+ * index and reads the shared one only when the copy says full or empty.
+ */
+typedef struct spsc_ring_t {
+	void **slots;
+	uint64 mask;
+	uint64 head __attribute__ ((aligned(cache_line)));	/* consumer */
+	uint64 tail_seen;
+	uint64 tail __attribute__ ((aligned(cache_line)));	/* producer */
+	uint64 head_seen;
+} spsc_ring;
+
+/* Any number of producers, one consumer. Producers claim a cell by moving
+ * tail, the sequence number of a cell says whose turn it is (Vyukov).
+ */
+typedef struct mpsc_cell_t {
+	uint64 seq;
+	void *v;
+} mpsc_cell;
+
+typedef struct mpsc_ring_t {
+	mpsc_cell *cells;
+	uint64 mask;
+	uint64 tail __attribute__ ((aligned(cache_line)));	/* producers */
+	uint64 head __attribute__ ((aligned(cache_line)));	/* consumer */
+} mpsc_ring;
+
+void spsc_init(spsc_ring * r, void **slots, uint64 cap);
+bool spsc_push(spsc_ring * r, void *v);
+bool spsc_pop(spsc_ring * r, void **v);
+
+void mpsc_init(mpsc_ring * r, mpsc_cell * cells, uint64 cap);
+bool mpsc_push(mpsc_ring * r, void *v);
+bool mpsc_pop(mpsc_ring * r, void **v);
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef SLAB_H_SENTRY
+#define SLAB_H_SENTRY
+
+#include "u.h"
+#include "alloc_stats.h"
+
+/* Size-class allocator. Objects of up to slab_max_size bytes are carved
+ * from slabs of slab_size bytes, one size class per slab. Slabs are
+ * aligned to their size, so free finds the slab header from the pointer
+ * alone. Bigger objects get pages of their own. Empty slabs go back to
+ * the OS, except slab_keep_empty per class kept against thrashing, which
+ * go on slab_trim.
+ */
+enum {
+	slab_size = 64 * 1024,
+	slab_classes = 16,			/* 16, 32, 48, 64, 96, 128 ... 3072, 4096 */
+	slab_max_size = 4096,
+	slab_align = 16,
+	slab_keep_empty = 4,
+	/* Objects a cache holds per class. */
+	slab_cache_len = 32
+};
+
+struct slab_t;
+
+typedef struct slab_page_t {
+	struct slab_page_t *next;	/* slabs of the class with free objects */
+	struct slab_page_t *prev;
+	struct slab_t *owner;
+	void *free;					/* freed objects */
+	uint32 cls;					/* slab_classes - a big object */
+	uint32 used;
+	uint32 cap;
+	uint32 fresh;				/* objects never handed out start here */
+	uint64 len;					/* bytes mapped */
+	uint64 pad;
+} slab_page;
+
+typedef struct slab_t {
+	slab_page *partial[slab_classes];
+	slab_page *empty[slab_classes];
+	uint32 empties[slab_classes];
+	alloc_stats st;				/* committed - bytes taken from the OS */
+	uint32 lock;
+	int shared;					/* several threads use it, take the lock */
+} slab;
+
+/* Per-thread cache of objects, it takes the lock of a shared slab once
+ * per slab_cache_len / 2 objects.
+ */
+typedef struct slab_cache_t {
+	slab *s;
+	uint32 n[slab_classes];
+	void *obj[slab_classes][slab_cache_len];
+} slab_cache;
+
+void slab_init(slab * s, int shared);
+void *slab_alloc(slab * s, uint64 size);
+void slab_free(slab * s, void *ptr);
+uint64 slab_usable_size(const void *ptr);
+void slab_trim(slab * s);
+
+void slab_cache_init(slab_cache * c, slab * s);
+void *slab_cache_alloc(slab_cache * c, uint64 size);
+void slab_cache_free(slab_cache * c, void *ptr);
+void slab_cache_flush(slab_cache * c);
+
+#endif
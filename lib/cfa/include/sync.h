@@ -0,0 +1,36 @@
+#ifndef SYNC_H_SENTRY
+#define SYNC_H_SENTRY
+
+#include "u.h"
+
+/* Blocks while *addr holds val, wakes up to n waiters on addr. Only for
+ * threads of one process.
+ */
+void futex_wait(uint32 * addr, uint32 val);
+void futex_wake(uint32 * addr, int n);
+
+/* Unlocked, locked and locked with waiters, unlock makes a system call
+ * only in the last state.
+ */
+typedef struct mutex_t {
+	uint32 state;
+} mutex;
+
+/* Every signal bumps seq, a waiter sleeps unless it has changed since it
+ * let the mutex go.
+ */
+typedef struct cond_t {
+	uint32 seq;
+} cond;
+
+void mutex_init(mutex * m);
+void mutex_lock(mutex * m);
+bool mutex_trylock(mutex * m);
+void mutex_unlock(mutex * m);
+
+void cond_init(cond * c);
+void cond_wait(cond * c, mutex * m);
+void cond_signal(cond * c);
+void cond_broadcast(cond * c);
+
+#endif
@@ -3,17 +3,115 @@
 
 #include "errno.h"
 
+struct iovec_t;
+
 /* Flags for mmap */
-enum { map_private = 0x2, map_anonymous = 0x20, map_fixed = 0x10,
-	prot_read = 0x1, prot_write = 0x2, s_setcockopt = 0x36
+enum { map_shared = 0x1, map_private = 0x2, map_anonymous = 0x20, map_fixed = 0x10, map_noreserve = 0x4000,
+	map_populate = 0x8000, map_hugetlb = 0x40000,
+	prot_none = 0x0, prot_read = 0x1, prot_write = 0x2, s_setcockopt = 0x36
 };
 
+/* Advice for madvise */
+enum { madv_hugepage = 14, madv_populate_write = 23 };
+
 /* Flags for time */
-enum { clock_realtime = 0x0 };
+enum { clock_realtime = 0x0, clock_monotonic = 0x1, clock_process_cputime_id = 0x2, clock_thread_cputime_id = 0x3 };
+
+/* Flags for open */
+enum {
+	o_rdonly = 00,
+	o_wronly = 01,
+	o_rdwr = 02,
+	o_creat = 0100,
+	o_trunc = 01000,
+	o_append = 02000,
+	o_directory = 0200000,
+	o_cloexec = 02000000
+};
+
+/* Commands for fcntl. */
+enum { f_dupfd = 0, f_getfd = 1, f_setfd = 2, f_getfl = 3, f_setfl = 4, f_dupfd_cloexec = 1030 };
+
+/* Flags for memfd_create. */
+enum { mfd_cloexec = 1 };
+
+/* Flags for lseek */
+enum { seek_set = 0, seek_cur = 1, seek_end = 2 };
+
+/* Directory entry returned by getdents64. */
+struct dirent64 {
+	uint64 d_ino;
+	int64 d_off;
+	uint16 d_reclen;
+	uint8 d_type;
+	char d_name[];
+};
 
 /* Flags for read and write */
 enum { stdin = 0, stdout = 1, stderr = 2 };
 
+/* Signals. */
+enum { sighup = 1, sigint = 2, sigkill = 9, sigusr1 = 10, sigusr2 = 12, sigpipe = 13, sigterm = 15,
+	sigchld = 17
+};
+
+/* Flags for rt_sigprocmask. */
+enum { sig_block = 0, sig_unblock = 1, sig_setmask = 2 };
+
+/* Kernel signal set, bit (signo - 1) for each signal. */
+typedef uint64 sigset;
+
+/* Flags for signalfd. */
+enum { sfd_nonblock = 00004000, sfd_cloexec = 02000000 };
+
+/* Record read from a signalfd. */
+struct signalfd_siginfo {
+	uint32 ssi_signo;
+	int32 ssi_errno;
+	int32 ssi_code;
+	uint32 ssi_pid;
+	uint32 ssi_uid;
+	int32 ssi_fd;
+	uint32 ssi_tid;
+	uint32 ssi_band;
+	uint32 ssi_overrun;
+	uint32 ssi_trapno;
+	int32 ssi_status;
+	int32 ssi_int;
+	uint64 ssi_ptr;
+	uint64 ssi_utime;
+	uint64 ssi_stime;
+	uint64 ssi_addr;
+	uint16 ssi_addr_lsb;
+	uint8 pad[46];
+};
+
+/* Flags for wait4. */
+enum { wnohang = 1 };
+
+/* Operations and flags for futex. */
+enum { futex_wait_op = 0, futex_wake_op = 1, futex_private = 128 };
+
+/* Flags for clone, a thread shares everything and is waited for
+ * through child_tid.
+ */
+enum {
+	clone_vm = 0x100,
+	clone_fs = 0x200,
+	clone_files = 0x400,
+	clone_sighand = 0x800,
+	clone_thread = 0x10000,
+	clone_sysvsem = 0x40000,
+	clone_parent_settid = 0x100000,
+	clone_child_cleartid = 0x200000
+};
+
+/* Flags for eventfd. */
+enum { efd_nonblock = 00004000, efd_cloexec = 02000000 };
+
+/* Options for prctl. */
+enum { pr_set_pdeathsig = 1 };
+
 /* Flags and data types for network routines */
 typedef uint32 in_addr_t;
 typedef uint16 sa_family_t;
@@ -25,15 +123,23 @@ enum {
 	sock_stream = 1,
 	/* Datagram socket. */
 	sock_dgram = 2,
+	/* Sequenced, reliable, connection-based, datagrams of fixed maximum length. */
+	sock_seqpacket = 5,
 	/* Automatically mark descriptor(s) as non-blocking. */
-	sock_nonblock = 00004000
+	sock_nonblock = 00004000,
+	/* Automatically close descriptor(s) on exec. */
+	sock_cloexec = 02000000
 };
 
 /* Option flags per-socket. */
 enum {
 	/* Allow local address & port reuse. */
 	so_reuseport = 15,
-	so_reuseaddr = 2
+	so_reuseaddr = 2,
+	so_rcvtimeo = 20,
+	so_sndtimeo = 21,
+	/* Microseconds to busy poll the device queue on blocking reads. */
+	so_busy_poll = 46
 };
 
 /* Address families. */
@@ -49,6 +155,38 @@ enum {
 /* Level number for (get/set)sockopt() to apply to socket itself. */
 enum { sol_socket = 1 };
 
+/* Ancillary data types at sol_socket level. */
+enum { scm_rights = 1 };
+
+/* Flags for sendmsg and recvmsg. */
+enum { msg_ctrunc = 0x8, msg_trunc = 0x20, msg_cmsg_cloexec = 0x40000000 };
+
+/* Message header for sendmsg and recvmsg. */
+struct msghdr {
+	void *msg_name;
+	int msg_namelen;
+	struct iovec_t *msg_iov;
+	uint64 msg_iovlen;
+	void *msg_control;
+	uint64 msg_controllen;
+	int msg_flags;
+};
+
+/* Ancillary data header, the data follows aligned to 8 bytes. */
+struct cmsghdr {
+	uint64 cmsg_len;
+	int cmsg_level;
+	int cmsg_type;
+};
+
+/* Space and length of ancillary data with n bytes of payload. */
+#define CMSG_SPACE(n) (sizeof(struct cmsghdr) + (((n) + 7) & ~7))
+#define CMSG_LEN(n) (sizeof(struct cmsghdr) + (n))
+#define CMSG_DATA(c) ((uint8 *) ((struct cmsghdr *) (c) + 1))
+
+/* Flags for shutdown. */
+enum { shut_rd = 0, shut_wr = 1, shut_rdwr = 2 };
+
 #define INADDR_ANY ((in_addr_t)0x00000000)
 
 /* Internet address (a structure for historical reasons). */
@@ -64,6 +202,12 @@ struct sockaddr_in {
 	char sin_zero[8];
 };
 
+/* Socket address, UNIX domain style. */
+struct sockaddr_un {
+	sa_family_t sun_family;
+	char sun_path[108];
+};
+
 /* Structure used by kernel to store most addresses. */
 struct sockaddr {
 	sa_family_t sa_family;
@@ -87,6 +231,9 @@ struct epoll_event {
 	epoll_data_t data;			/* User data variable. */
 } __attribute__ ((packed));
 
+/* Flags for epoll_create1. */
+enum { epoll_cloexec = 02000000 };
+
 enum {
 	/* Add a file descriptor to the interface. */
 	epoll_ctl_add = 1,
@@ -98,6 +245,9 @@ enum {
 
 #define EPOLLIN 1
 #define EPOLLOUT 4
+#define EPOLLERR 8
+#define EPOLLHUP 16
+#define EPOLLONESHOT 1u << 30
 #define EPOLLET 1u << 31
 
 struct timespec {
@@ -105,19 +255,79 @@ struct timespec {
 	int64 tv_nsec;				/* and nanoseconds */
 };
 
+struct timeval {
+	int64 tv_sec;				/* seconds */
+	int64 tv_usec;				/* and microseconds */
+};
+
+/* Flags for getrusage. */
+enum { rusage_self = 0, rusage_children = -1 };
+
+struct rusage {
+	struct timeval ru_utime;	/* user time used */
+	struct timeval ru_stime;	/* system time used */
+	int64 ru_maxrss;
+	int64 ru_ixrss;
+	int64 ru_idrss;
+	int64 ru_isrss;
+	int64 ru_minflt;
+	int64 ru_majflt;
+	int64 ru_nswap;
+	int64 ru_inblock;
+	int64 ru_oublock;
+	int64 ru_msgsnd;
+	int64 ru_msgrcv;
+	int64 ru_nsignals;
+	int64 ru_nvcsw;				/* voluntary context switches */
+	int64 ru_nivcsw;			/* involuntary context switches */
+};
+
 int64 sys_read(uint32 fd, char *buf, uint64 count, const error ** err);
 int64 sys_write(uint32 fd, const char *buf, uint64 count, const error ** err);
+int64 sys_pread(uint32 fd, char *buf, uint64 count, int64 offset, const error ** err);
+int64 sys_sendfile(int out_fd, int in_fd, int64 * offset, uint64 count, const error ** err);
+int64 sys_writev(uint32 fd, const struct iovec_t *iov, int iovcnt, const error ** err);
 const error *sys_close(uint32 fd);
+int sys_open(const char *path, int flags, int mode, const error ** err);
+const error *sys_mkdir(const char *path, int mode);
+int64 sys_lseek(uint32 fd, int64 offset, int whence, const error ** err);
+int sys_fcntl(int fd, int cmd, uint64 arg, const error ** err);
+int sys_memfd_create(const char *name, uint32 flags, const error ** err);
+const error *sys_unlink(const char *path);
+const error *sys_fsync(uint32 fd);
+const error *sys_ftruncate(uint32 fd, uint64 length);
+int64 sys_getdents64(uint32 fd, void *dirp, uint64 count, const error ** err);
 void *sys_mmap(uintptr addr, uint64 len, uintptr prot, uintptr flags, uintptr fd, uintptr offset, const error ** err);
 const error *sys_munmap(uintptr addr, uint64 len);
+const error *sys_mprotect(uintptr addr, uint64 len, uintptr prot);
+const error *sys_madvise(uintptr addr, uint64 len, int advice);
+const error *sys_mlock(uintptr addr, uint64 len);
 void sys_exit(int error_code);
+void sys_exit_group(int error_code);
 const error *sys_clock_gettime(int which_clock, struct timespec *tp);
+const error *sys_getrusage(int who, struct rusage *ru);
+const error *sys_rt_sigprocmask(int how, const sigset * set, sigset * oldset);
 int sys_socket(int family, int type, int protocol, const error ** err);
 const error *sys_bind(int sockfd, struct sockaddr *addr, int addrlen);
 const error *sys_setsockopt(int sockfd, int level, int optname, const void *optval, int optlen);
 const error *sys_listen(int sockfd, int qlen);
 int sys_accept(int sockfd, struct sockaddr *addr, int *addrlen, const error ** err);
 int sys_accept4(int sockfd, struct sockaddr *addr, int *addrlen, int flags, const error ** err);
+const error *sys_shutdown(int sockfd, int how);
+const error *sys_socketpair(int family, int type, int protocol, int sv[2]);
+int64 sys_sendmsg(int sockfd, const struct msghdr *msg, int flags, const error ** err);
+int64 sys_recvmsg(int sockfd, struct msghdr *msg, int flags, const error ** err);
+int sys_dup(int fd, const error ** err);
+const error *sys_execve(const char *path, char *const argv[], char *const envp[]);
+int sys_wait4(int pid, int *status, int options, const error ** err);
+const error *sys_kill(int pid, int sig);
+int sys_signalfd(int fd, const sigset * mask, int flags, const error ** err);
+int sys_eventfd(uint32 initval, int flags, const error ** err);
+const error *sys_prctl(int option, uint64 arg2);
+void sys_sched_yield(void);
+int sys_futex(uint32 * uaddr, int op, uint32 val, const struct timespec *timeout, const error ** err);
+int sys_clone_thread(uint64 flags, void *stack, int *ptid, int *ctid, void (*fn)(void *), void *arg,
+					 const error ** err);
 int sys_fork(const error ** err);
 int sys_epoll_create(int size, const error ** err);
 int sys_epoll_create1(int flags, const error ** err);
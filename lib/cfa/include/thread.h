@@ -0,0 +1,23 @@
+#ifndef THREAD_H_SENTRY
+#define THREAD_H_SENTRY
+
+#include "u.h"
+#include "errno.h"
+
+/* Kernel threads made with clone, sharing memory, files and signal
+ * handlers. The stack is mapped with a guard page below it. The kernel
+ * zeroes tid and wakes its futex when the thread exits, so the thread
+ * struct must stay where it is until thread_join.
+ */
+enum { thread_stack_size = 256 * 1024 };
+
+typedef struct thread_t {
+	int tid;
+	byte *stack;				/* mapping, the guard page first */
+	uint64 stack_len;
+} thread;
+
+const error *thread_create(thread * t, void (*fn)(void *), void *arg, uint64 stack_size);
+void thread_join(thread * t);
+
+#endif
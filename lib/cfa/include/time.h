@@ -15,8 +15,25 @@ struct tm {
 	char *tm_zone;				/* timezone abbreviation */
 };
 
+/* Fixed offsets from UTC, without daylight saving time. */
+typedef struct time_zone_t {
+	const char *name;
+	int32 offset;				/* seconds east of UTC */
+} time_zone;
+
+/* Times from March 1 of the year -32800 to June 5 of 2907005 convert. */
+enum {
+	time_min_days = -12699422,	/* days since 1970-01-01 */
+	time_max_days = 1061042401
+};
+
+const time_zone *time_zone_find(const char *name, uint64 len);
+struct tm time_to_tm_zone(int64 t, const time_zone * z);
 struct tm time_to_tm(int64 t);
+
 uint64 tm_rfc822_in_slice(slice s, const struct tm *t);
+uint64 tm_iso8601_in_slice(slice s, const struct tm *tm);
+uint64 tm_rfc3339_in_slice(slice s, const struct tm *tm, int usec);
 uint64 tm_in_slice(slice s, struct tm *tm);
 uint64 tm_in_slice2(slice s, struct tm *tm);
 
@@ -5,7 +5,12 @@
 #include "fmt.h"
 #include "arena.h"
 
-enum { page_size = 4096, default_alignment = sizeof(void *) };
+enum {
+	page_size = 4096,
+	huge_page_size = 2 * 1024 * 1024,
+	default_alignment = sizeof(void *),
+	min_commit = 1024 * 1024
+};
 
 temp_arena temp_arena_create(arena * a)
 {
@@ -21,6 +26,15 @@ void temp_arena_recover(temp_arena * temp)
 {
 	temp->arena->prev_off = temp->prev_off;
 	temp->arena->curr_off = temp->curr_off;
+	temp->arena->st.frees++;
+	temp->arena->st.in_use = temp->curr_off;
+}
+
+static void arena_used(arena * a)
+{
+	a->st.in_use = a->curr_off;
+	if (a->st.in_use > a->st.high)
+		a->st.high = a->st.in_use;
 }
 
 bool is_power_of_two(uintptr x)
@@ -48,6 +62,38 @@ uintptr align_forward(uintptr ptr, uint64 align)
 	return p;
 }
 
+/* Makes the first end bytes of a reserved arena usable. Commits at least
+ * double of what there is, so growth takes O(log n) system calls.
+ */
+static bool arena_commit(arena * a, uint64 end)
+{
+	const error *err;
+	uint64 len;
+
+	if (end <= a->commit_len)
+		return true;
+	if (end > a->buf_len)
+		return false;
+
+	len = a->commit_len * 2;
+	if (len < min_commit)
+		len = min_commit;
+	if (len < end)
+		len = align_forward(end, page_size);
+	if (len > a->buf_len)
+		len = a->buf_len;
+
+	err = sys_mprotect((uintptr) a->buf + a->commit_len, len - a->commit_len, prot_read | prot_write);
+	if (err != nil) {
+		fmt_fprintf(stderr, "arena_commit: sys_mprotect failed: %s\n", err->msg);
+		return false;
+	}
+	a->commit_len = len;
+	a->st.committed = len;
+	a->st.grows++;
+	return true;
+}
+
 void *arena_alloc_align(arena * a, uint64 size, uint64 align)
 {
 	/* Align 'curr_off' forward to the specified alignment. */
@@ -56,12 +102,15 @@ void *arena_alloc_align(arena * a, uint64 size, uint64 align)
 	offset -= (uintptr) a->buf;	/* Change to relative offset. */
 
 	/* Check to see if the backing memory has space left. */
-	if (offset + size <= a->buf_len) {
+	if (arena_commit(a, offset + size)) {
 		a->prev_off = offset;
 		a->curr_off = offset + size;
+		a->st.allocs++;
+		arena_used(a);
 		return &a->buf[offset];
 	}
 
+	a->st.fails++;
 	return nil;
 }
 
@@ -81,11 +130,20 @@ void *arena_resize_align(arena * a, void *old_mem, uint64 old_size, uint64 new_s
 
 	if (a->buf <= old_m && old_m < a->buf + a->buf_len) {
 		if (a->buf + a->prev_off == old_m) {
+			/* The last allocation grows in place. */
+			if (!arena_commit(a, a->prev_off + new_size)) {
+				a->st.fails++;
+				return nil;
+			}
 			a->curr_off = a->prev_off + new_size;
+			arena_used(a);
 			return old_mem;
 		} else {
 			void *new_mem = arena_alloc_align(a, new_size, align);
 			uint64 copy_size = old_size < new_size ? old_size : new_size;
+
+			if (new_mem == nil)
+				return nil;
 			memmove(new_mem, old_mem, copy_size);
 			return new_mem;
 		}
@@ -104,29 +162,108 @@ void arena_init(arena * a, void *buf, uint64 buf_len)
 {
 	a->buf = (byte *) buf;
 	a->buf_len = buf_len;
+	a->commit_len = buf_len;
 	a->curr_off = 0;
 	a->prev_off = 0;
+	memset(&a->st, 0, sizeof(a->st));
+	a->st.committed = buf_len;
 }
 
 void arena_free_all(arena * a)
 {
 	a->curr_off = 0;
 	a->prev_off = 0;
+	a->st.frees++;
+	a->st.in_use = 0;
+}
+
+/* Maps len bytes, a multiple of huge_page_size, backed by huge pages. */
+static char *arena_map_huge(uint64 len, const error ** err)
+{
+	uintptr p, start;
+
+	p = (uintptr) sys_mmap((uintptr) nil, len, prot_read | prot_write, map_private | map_anonymous | map_hugetlb, -1,
+						   0, err);
+	if (*err == nil)
+		return (char *) p;
+
+	/* No hugetlb pages reserved. Transparent huge pages need the range
+	 * aligned to huge_page_size, so map more and trim.
+	 */
+	p = (uintptr) sys_mmap((uintptr) nil, len + huge_page_size, prot_read | prot_write, map_private | map_anonymous,
+						   -1, 0, err);
+	if (*err != nil)
+		return nil;
+	start = align_forward(p, huge_page_size);
+	if (start > p)
+		sys_munmap(p, start - p);
+	sys_munmap(start + len, p + huge_page_size - start);
+
+	/* Without THP in the kernel it is plain pages. */
+	sys_madvise(start, len, madv_hugepage);
+	return (char *) start;
+}
+
+static void arena_prefault_pages(char *buf, uint64 len)
+{
+	uint64 i;
+
+	/* Older kernels have no MADV_POPULATE_WRITE, touch every page. */
+	if (sys_madvise((uintptr) buf, len, madv_populate_write) != nil)
+		for (i = 0; i < len; i += page_size)
+			((volatile char *) buf)[i] = 0;
+}
+
+void arena_create_flags(arena * a, uint64 size, int flags)
+{
+	const error *err;
+	char *buf;
+
+	if (flags & arena_huge) {
+		size = align_forward(size, huge_page_size);
+		buf = arena_map_huge(size, &err);
+	} else {
+		/* Align to page size. */
+		size = ((size - 1) / page_size + 1) * page_size;
+		buf = sys_mmap((uintptr) nil, size, prot_read | prot_write, map_private | map_anonymous, -1, 0, &err);
+	}
+	if (err != nil) {
+		fmt_fprintf(stderr, "sys_mmap failed (arena_create): %s\n", err->msg);
+		sys_exit(1);
+	}
+
+	if (flags & arena_prefault)
+		arena_prefault_pages(buf, size);
+	if (flags & arena_lock) {
+		/* Without CAP_IPC_LOCK RLIMIT_MEMLOCK may forbid it, we go on. */
+		err = sys_mlock((uintptr) buf, size);
+		if (err != nil)
+			fmt_fprintf(stderr, "arena_create: sys_mlock failed: %s\n", err->msg);
+	}
+
+	arena_init(a, buf, size);
 }
 
 void arena_create(arena * a, uint64 size)
+{
+	arena_create_flags(a, size, 0);
+}
+
+void arena_reserve(arena * a, uint64 size)
 {
 	const error *err;
 	char *buf;
 
-	/* Align to page size. */
-	size = ((size - 1) / page_size + 1) * page_size;
+	size = align_forward(size, page_size);
 
-	buf = sys_mmap((uintptr) nil, size, prot_read | prot_write, map_private | map_anonymous, -1, 0, &err);
+	/* No access and no swap accounted until committed. */
+	buf = sys_mmap((uintptr) nil, size, prot_none, map_private | map_anonymous | map_noreserve, -1, 0, &err);
 	if (err != nil) {
-		fmt_fprintf(stderr, "sys_mmap failed (arena_create): %s\n", err->msg);
+		fmt_fprintf(stderr, "sys_mmap failed (arena_reserve): %s\n", err->msg);
 		sys_exit(1);
 	}
 
 	arena_init(a, buf, size);
+	a->commit_len = 0;
+	a->st.committed = 0;
 }
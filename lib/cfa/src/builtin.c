@@ -11,6 +11,11 @@ typedef long word;
 
 static const uint64 max_alloc = 1 << 31;
 
+/* Address space of the global arena, pages are committed as it grows so
+ * slices never move unless grown.
+ */
+static const uint64 global_reserve = 1UL << 36;
+
 enum { page_size = 4096, wsize = sizeof(word), wmask = wsize - 1 };
 
 void *memcpy(void *dst0, const void *src0, uint64 length)
@@ -302,6 +307,17 @@ void *memmove(void *dst, const void *src, uint64 length)
 	return memcpy(dst, src, length);
 }
 
+/* rep stosb, a loop would be turned back into a call to memset. */
+void *memset(void *dst, int c, uint64 length)
+{
+	void *d = dst;
+
+	__asm__ __volatile__("rep stosb":"+D"(d), "+c"(length)
+						 :"a"(c)
+						 :"memory");
+	return dst;
+}
+
 int memequal(const void *dst, const void *src, uint64 length)
 {
 	const char *d = dst, *s = src;
@@ -323,6 +339,13 @@ void panic(const char *msg)
 	__asm__ __volatile__("int3");
 }
 
+static arena *global(void)
+{
+	if (global_arena.buf == nil)
+		arena_reserve(&global_arena, global_reserve);
+	return &global_arena;
+}
+
 slice make_slice(uint64 type_size, uint64 len, uint64 cap)
 {
 	uint64 mem = type_size * cap;
@@ -335,27 +358,9 @@ slice make_slice(uint64 type_size, uint64 len, uint64 cap)
 		panic("builtin.c (make_slice): cap out of range\n");
 	}
 
-	if (global_arena.buf == nil) {
-		arena_create(&global_arena, mem * 2);
-	}
-
-	ret.base = arena_alloc(&global_arena, mem);
-	if (ret.base == nil) {
-		arena new_arena;
-		const error *err;
-
-		arena_create(&new_arena, global_arena.buf_len * 2);
-		memcpy(new_arena.buf, global_arena.buf, global_arena.buf_len);
-
-		err = sys_munmap((uintptr) global_arena.buf, global_arena.buf_len);
-		if (err != nil)
-			fmt_fprintf(stderr, "sys_munmap failed (builtin.c): %s\n", err->msg);
-
-		global_arena.buf = new_arena.buf;
-		global_arena.buf_len = new_arena.buf_len;
-		arena_free_all(&global_arena);
-		ret.base = arena_alloc(&global_arena, mem);
-	}
+	ret.base = arena_alloc(global(), mem);
+	if (ret.base == nil)
+		panic("builtin.c (make_slice): out of memory\n");
 
 	ret.len = len;
 	ret.cap = cap;
@@ -405,8 +410,10 @@ slice grow_slice(slice old_s, uint64 new_len, uint64 type_size)
 	if (new_cap_mem > max_alloc)
 		panic("builtin.c (grow_slice): len out of range\n");
 
-	p = arena_resize(&global_arena, old_s.base, old_s.cap, new_cap_mem);
-	memmove(p, old_s.base, old_s.len * type_size);
+	/* In place if it was the last one, else copied. */
+	p = arena_resize(global(), old_s.base, old_s.cap * type_size, new_cap_mem);
+	if (p == nil)
+		panic("builtin.c (grow_slice): out of memory\n");
 
 	ret.base = p;
 	ret.len = new_len;
@@ -420,7 +427,7 @@ string sl_to_str_new_base(slice s)
 	byte *mem;
 	string ret;
 
-	mem = arena_alloc(&global_arena, s.len);
+	mem = arena_alloc(global(), s.len);
 	assert(mem != nil);
 
 	ret.base = (char *) mem;
@@ -0,0 +1,288 @@
+#include "u.h"
+#include "builtin.h"
+#include "syscall.h"
+#include "atomic.h"
+#include "sync.h"
+#include "thread.h"
+#include "executor.h"
+
+enum { spins = 64 };
+
+/* ============================== deque ============================== */
+
+/* Chase and Lev, "Dynamic Circular Work-Stealing Deque", with the fences
+ * of Le et al. for weak memory models. The deque doesn't grow, a full
+ * one makes the owner run the task itself.
+ */
+static void deque_init(deque * d)
+{
+	d->top = 0;
+	d->bottom = 0;
+}
+
+static bool deque_push(deque * d, task * t)
+{
+	int64 b = atomic_load_relaxed(&d->bottom);
+	int64 top = atomic_load(&d->top);
+
+	if (b - top >= deque_len)
+		return false;
+	atomic_store_relaxed(&d->buf[b & (deque_len - 1)], t);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	atomic_store_relaxed(&d->bottom, b + 1);
+	return true;
+}
+
+static task *deque_take(deque * d)
+{
+	int64 b = atomic_load_relaxed(&d->bottom) - 1;
+	int64 top;
+	task *t = nil;
+
+	atomic_store_relaxed(&d->bottom, b);
+	atomic_fence();
+	top = atomic_load_relaxed(&d->top);
+	if (top <= b) {
+		t = atomic_load_relaxed(&d->buf[b & (deque_len - 1)]);
+		if (top == b) {
+			/* The last one, a thief may be after it too. */
+			if (!atomic_cas(&d->top, &top, top + 1))
+				t = nil;
+			atomic_store_relaxed(&d->bottom, b + 1);
+		}
+	} else
+		atomic_store_relaxed(&d->bottom, b + 1);
+	return t;
+}
+
+static task *deque_steal(deque * d)
+{
+	int64 top = atomic_load(&d->top);
+	int64 b;
+	task *t;
+
+	atomic_fence();
+	b = atomic_load(&d->bottom);
+	if (top >= b)
+		return nil;
+	t = atomic_load_relaxed(&d->buf[top & (deque_len - 1)]);
+	if (!atomic_cas(&d->top, &top, top + 1))
+		return nil;
+	return t;
+}
+
+static bool deque_empty(deque * d)
+{
+	return atomic_load(&d->top) >= atomic_load(&d->bottom);
+}
+
+/* ============================== workers ============================== */
+
+/* Finished tasks go on a stack, the eventfd is written only when it was
+ * empty: the submitter takes the whole stack at once anyway.
+ */
+static void exec_finish(executor * ex, task * t)
+{
+	task *old = atomic_load(&ex->done);
+	uint64 one = 1;
+
+	do
+		t->next = old;
+	while (!atomic_cas(&ex->done, &old, t));
+	if (old == nil)
+		sys_write(ex->efd, (char *) &one, sizeof(one), nil);
+}
+
+static void exec_wake(executor * ex, int n)
+{
+	atomic_fence();
+	if (atomic_load(&ex->sleepers) == 0)
+		return;
+	atomic_fetch_add(&ex->wake_seq, 1);
+	futex_wake(&ex->wake_seq, n);
+}
+
+static bool exec_has_work(executor * ex)
+{
+	int i;
+
+	if (!deque_empty(&ex->submit))
+		return true;
+	for (i = 0; i < ex->n; i++)
+		if (!deque_empty(&ex->w[i].d))
+			return true;
+	return false;
+}
+
+/* The submit deque is victim number n. */
+static task *exec_steal(exec_worker * w)
+{
+	executor *ex = w->ex;
+	int i, v, victims = ex->n + 1;
+	task *t;
+
+	w->seed = w->seed * 6364136223846793005UL + 1442695040888963407UL;
+	v = (w->seed >> 33) % victims;
+	for (i = 0; i < victims; i++, v = (v + 1) % victims) {
+		if (v == w->id)
+			continue;
+		t = deque_steal(v == ex->n ? &ex->submit : &ex->w[v].d);
+		if (t != nil) {
+			w->steals++;
+			return t;
+		}
+	}
+	return nil;
+}
+
+/* Sleepers is raised before the last look for work and the submitter
+ * looks at it after its push, so one of the two sees the other.
+ */
+static void exec_park(exec_worker * w)
+{
+	executor *ex = w->ex;
+	uint32 seq = atomic_load(&ex->wake_seq);
+
+	atomic_fetch_add(&ex->sleepers, 1);
+	atomic_fence();
+	if (!exec_has_work(ex) && !atomic_load(&ex->stop)) {
+		w->parks++;
+		futex_wait(&ex->wake_seq, seq);
+	}
+	atomic_fetch_sub(&ex->sleepers, 1);
+}
+
+static void exec_worker_main(void *arg)
+{
+	exec_worker *w = arg;
+	task *t;
+	int idle = 0;
+
+	for (;;) {
+		t = deque_take(&w->d);
+		if (t == nil)
+			t = exec_steal(w);
+		if (t != nil) {
+			idle = 0;
+			t->run(t, w);
+			w->runs++;
+			exec_finish(w->ex, t);
+			continue;
+		}
+		if (atomic_load(&w->ex->stop))
+			return;
+		if (++idle < spins)
+			cpu_relax();
+		else
+			exec_park(w);
+	}
+}
+
+/* ============================== public ============================== */
+
+const error *executor_start(executor * ex, int workers)
+{
+	const error *err;
+	int i;
+
+	if (workers < 1 || workers > exec_max_workers)
+		return &syscall_errors[EINVAL];
+
+	deque_init(&ex->submit);
+	ex->n = 0;
+	ex->done = nil;
+	ex->wake_seq = 0;
+	ex->sleepers = 0;
+	ex->stop = false;
+	ex->submitted = 0;
+	ex->inline_runs = 0;
+	ex->efd = sys_eventfd(0, efd_nonblock | efd_cloexec, &err);
+	if (err != nil)
+		return err;
+
+	for (i = 0; i < workers; i++) {
+		exec_worker *w = &ex->w[i];
+
+		deque_init(&w->d);
+		w->ex = ex;
+		w->id = i;
+		w->seed = i + 1;
+		w->runs = 0;
+		w->steals = 0;
+		w->parks = 0;
+		/* Counted before it starts, it looks at the others. */
+		ex->n = i + 1;
+		err = thread_create(&w->t, exec_worker_main, w, 0);
+		if (err != nil) {
+			ex->n = i;
+			executor_stop(ex);
+			return err;
+		}
+	}
+	return nil;
+}
+
+/* From the one submitting thread. */
+void executor_submit(executor * ex, task * t)
+{
+	ex->submitted++;
+	if (!deque_push(&ex->submit, t)) {
+		ex->inline_runs++;
+		t->run(t, nil);
+		exec_finish(ex, t);
+		return;
+	}
+	exec_wake(ex, 1);
+}
+
+/* From a task, onto the deque of the worker running it. */
+void executor_spawn(executor * ex, exec_worker * w, task * t)
+{
+	if (w == nil || !deque_push(&w->d, t)) {
+		t->run(t, w);
+		exec_finish(ex, t);
+		return;
+	}
+	exec_wake(ex, 1);
+}
+
+/* Runs the done callbacks of finished tasks in the order they finished,
+ * returns how many there were.
+ */
+int executor_complete(executor * ex)
+{
+	task *t, *next, *list = nil;
+	uint64 v;
+	int n = 0;
+
+	sys_read(ex->efd, (char *) &v, sizeof(v), nil);
+	t = atomic_exchange(&ex->done, (task *) nil);
+	for (; t != nil; t = next) {
+		next = t->next;
+		t->next = list;
+		list = t;
+	}
+	for (t = list; t != nil; t = next) {
+		next = t->next;
+		if (t->done != nil)
+			t->done(t);
+		n++;
+	}
+	return n;
+}
+
+/* Workers finish what is queued, then exit. Done callbacks of the last
+ * tasks are still run by executor_complete.
+ */
+void executor_stop(executor * ex)
+{
+	int i;
+
+	atomic_store(&ex->stop, true);
+	atomic_fetch_add(&ex->wake_seq, 1);
+	futex_wake(&ex->wake_seq, 0x7fffffff);
+	for (i = 0; i < ex->n; i++)
+		thread_join(&ex->w[i].t);
+	executor_complete(ex);
+	sys_close(ex->efd);
+}
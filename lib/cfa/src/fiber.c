@@ -0,0 +1,295 @@
+#include "u.h"
+#include "builtin.h"
+#include "syscall.h"
+#include "fmt.h"
+#include "arena.h"
+#include "fiber.h"
+
+enum { page_size = 4096 };
+
+/* The SysV ABI leaves rbx, rbp and r12-r15 to the callee, everything else
+ * is already saved by the caller of fiber_switch. Fibers don't change the
+ * x87 control word or mxcsr, so those are not switched.
+ */
+__asm__(".text\n"
+		".globl fiber_switch\n"
+		".type fiber_switch, @function\n"
+		"fiber_switch:\n"
+		"\tpush %rbp\n"
+		"\tpush %rbx\n"
+		"\tpush %r12\n"
+		"\tpush %r13\n"
+		"\tpush %r14\n"
+		"\tpush %r15\n"
+		"\tmov %rsp, (%rdi)\n"
+		"\tmov %rsi, %rsp\n"
+		"\tpop %r15\n"
+		"\tpop %r14\n"
+		"\tpop %r13\n"
+		"\tpop %r12\n"
+		"\tpop %rbx\n"
+		"\tpop %rbp\n"
+		"\tret\n");
+
+/* A new fiber is first switched to here, with the fiber in r12 and the
+ * function to call in r13. The stack is 16 byte aligned for the call.
+ */
+void fiber_start(void);
+
+__asm__(".text\n"
+		".type fiber_start, @function\n"
+		"fiber_start:\n"
+		"\txor %ebp, %ebp\n"
+		"\tmov %r12, %rdi\n"
+		"\tcall *%r13\n"
+		"\tud2\n");
+
+static void fiber_ready(fiber_sched * s, fiber * f)
+{
+	f->next = nil;
+	if (s->ready_tail)
+		s->ready_tail->next = f;
+	else
+		s->ready = f;
+	s->ready_tail = f;
+}
+
+/* Runs the fiber function and goes back to the scheduler for good. */
+static void fiber_main(fiber * f)
+{
+	fiber_sched *s = f->s;
+
+	f->fn(f->arg);
+	f->fn = nil;
+	s->live--;
+	fiber_switch(&f->sp, s->sp);
+}
+
+/* Lays out the stack fiber_switch pops: r15, r14, r13, r12, rbx, rbp and
+ * the return address.
+ */
+static void fiber_prepare(fiber * f)
+{
+	uint64 *sp = (uint64 *) ((uintptr) f & ~(uintptr) 15) - 7;
+
+	sp[0] = 0;
+	sp[1] = 0;
+	sp[2] = (uint64) fiber_main;
+	sp[3] = (uint64) f;
+	sp[4] = 0;
+	sp[5] = 0;
+	sp[6] = (uint64) fiber_start;
+	f->sp = sp;
+}
+
+static fiber *fiber_map(fiber_sched * s, const error ** err)
+{
+	uint64 len = align_forward(s->stack_size + sizeof(fiber), page_size) + page_size;
+	byte *map;
+	fiber *f;
+
+	map = sys_mmap((uintptr) nil, len, prot_read | prot_write, map_private | map_anonymous, -1, 0, err);
+	if (*err != nil)
+		return nil;
+	/* Stacks grow down, an overflow hits the guard page. */
+	*err = sys_mprotect((uintptr) map, page_size, prot_none);
+	if (*err != nil) {
+		sys_munmap((uintptr) map, len);
+		return nil;
+	}
+	f = (fiber *) (map + len - sizeof(fiber));
+	f->map = map;
+	f->map_len = len;
+	return f;
+}
+
+static void fiber_release(fiber_sched * s, fiber * f)
+{
+	if (s->n_free == fiber_keep_free) {
+		sys_munmap((uintptr) f->map, f->map_len);
+		return;
+	}
+	f->next = s->free;
+	s->free = f;
+	s->n_free++;
+}
+
+/* ============================== scheduler ============================== */
+
+const error *fiber_sched_init(fiber_sched * s, uint64 stack_size)
+{
+	const error *err;
+
+	memset(s, 0, sizeof(*s));
+	s->stack_size = stack_size == 0 ? fiber_stack_size : stack_size;
+	s->epfd = sys_epoll_create1(epoll_cloexec, &err);
+	return err;
+}
+
+void fiber_sched_close(fiber_sched * s)
+{
+	fiber *f;
+
+	while (s->free) {
+		f = s->free;
+		s->free = f->next;
+		sys_munmap((uintptr) f->map, f->map_len);
+	}
+	s->n_free = 0;
+	sys_close(s->epfd);
+}
+
+fiber *fiber_spawn(fiber_sched * s, void (*fn)(void *), void *arg, const error ** err)
+{
+	fiber *f;
+
+	if (s->free) {
+		f = s->free;
+		s->free = f->next;
+		s->n_free--;
+		*err = nil;
+	} else {
+		f = fiber_map(s, err);
+		if (f == nil)
+			return nil;
+	}
+	f->s = s;
+	f->fn = fn;
+	f->arg = arg;
+	f->wait_fd = -1;
+	f->events = 0;
+	fiber_prepare(f);
+	s->live++;
+	fiber_ready(s, f);
+	return f;
+}
+
+/* Runs fibers until all have returned. */
+void fiber_run(fiber_sched * s)
+{
+	struct epoll_event evt[fiber_max_events];
+	const error *err;
+	fiber *f;
+	int n, i;
+
+	while (s->live > 0) {
+		while (s->ready) {
+			f = s->ready;
+			s->ready = f->next;
+			if (s->ready == nil)
+				s->ready_tail = nil;
+			s->current = f;
+			s->switches++;
+			fiber_switch(&s->sp, f->sp);
+			s->current = nil;
+			if (f->fn == nil)
+				fiber_release(s, f);
+		}
+		if (s->live == 0)
+			break;
+
+		n = sys_epoll_wait(s->epfd, evt, fiber_max_events, -1, &err);
+		if (err != nil) {
+			if (err->code == EINTR)
+				continue;
+			fmt_fprintf(stderr, "fiber_run: sys_epoll_wait failed: %s\n", err->msg);
+			return;
+		}
+		for (i = 0; i < n; i++) {
+			f = evt[i].data.ptr;
+			f->events = evt[i].events;
+			fiber_ready(s, f);
+		}
+	}
+}
+
+/* ============================== in fibers ============================== */
+
+void fiber_yield(fiber_sched * s)
+{
+	fiber *f = s->current;
+
+	fiber_ready(s, f);
+	fiber_switch(&f->sp, s->sp);
+}
+
+/* Parks the fiber until fd has one of events. The registration is one
+ * shot, it goes quiet once it fires, so it is the waiting fiber's alone
+ * and stays in epoll for the next wait on the same descriptor.
+ */
+const error *fiber_wait(fiber_sched * s, int fd, uint32 events)
+{
+	fiber *f = s->current;
+	struct epoll_event ev;
+	const error *err;
+
+	ev.events = events | EPOLLONESHOT;
+	ev.data.ptr = f;
+	if (f->wait_fd == fd) {
+		err = sys_epoll_ctl(s->epfd, epoll_ctl_mod, fd, &ev);
+		/* Closed and opened again under the same number. */
+		if (err != nil && err->code == ENOENT)
+			err = sys_epoll_ctl(s->epfd, epoll_ctl_add, fd, &ev);
+	} else {
+		err = sys_epoll_ctl(s->epfd, epoll_ctl_add, fd, &ev);
+		/* Left there by an earlier fiber. */
+		if (err != nil && err->code == EEXIST)
+			err = sys_epoll_ctl(s->epfd, epoll_ctl_mod, fd, &ev);
+	}
+	if (err != nil)
+		return err;
+	f->wait_fd = fd;
+	s->parks++;
+	fiber_switch(&f->sp, s->sp);
+	return nil;
+}
+
+int64 fiber_read(fiber_sched * s, int fd, char *buf, uint64 len, const error ** err)
+{
+	int64 n;
+
+	for (;;) {
+		n = sys_read(fd, buf, len, err);
+		if (*err == nil || (*err)->code != EAGAIN)
+			return n;
+		*err = fiber_wait(s, fd, EPOLLIN);
+		if (*err != nil)
+			return -1;
+	}
+}
+
+/* Writes all of buf, parking while the socket is full. */
+int64 fiber_write(fiber_sched * s, int fd, const char *buf, uint64 len, const error ** err)
+{
+	uint64 done = 0;
+	int64 n;
+
+	while (done < len) {
+		n = sys_write(fd, buf + done, len - done, err);
+		if (*err == nil) {
+			done += n;
+			continue;
+		}
+		if ((*err)->code != EAGAIN)
+			return -1;
+		*err = fiber_wait(s, fd, EPOLLOUT);
+		if (*err != nil)
+			return -1;
+	}
+	*err = nil;
+	return done;
+}
+
+int fiber_accept(fiber_sched * s, int fd, const error ** err)
+{
+	int conn;
+
+	for (;;) {
+		conn = sys_accept4(fd, nil, nil, sock_nonblock | sock_cloexec, err);
+		if (*err == nil || (*err)->code != EAGAIN)
+			return conn;
+		*err = fiber_wait(s, fd, EPOLLIN);
+		if (*err != nil)
+			return -1;
+	}
+}
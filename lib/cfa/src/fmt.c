@@ -47,6 +47,7 @@ int fmt_fprintf(int stream, const char *fmt, ...)
 {
 	va_list args;
 	int num, j = 0;
+	int64 lnum;
 	char buf[max_buf];
 	char *s;
 	uintptr p;
@@ -68,6 +69,10 @@ int fmt_fprintf(int stream, const char *fmt, ...)
 				num = va_arg(args, int);
 				j += int_in_slice(unsafe_slice(buf + j, max_buf - j), num);
 				break;
+			case 'l':
+				lnum = va_arg(args, int64);
+				j += int_in_slice(unsafe_slice(buf + j, max_buf - j), lnum);
+				break;
 			case 'p':
 				p = va_arg(args, uintptr);
 				j += print_hex(unsafe_slice(buf + j, max_buf - j), p);
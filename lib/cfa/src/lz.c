@@ -0,0 +1,192 @@
+#include "u.h"
+#include "builtin.h"
+#include "lz.h"
+
+enum {
+	/* The last five bytes are always literals and the last match starts
+	 * at least twelve bytes before the end, as LZ4 decoders expect.
+	 */
+	last_literals = 5,
+	match_limit = 12,
+	max_base = 0x7fffffff
+};
+
+static uint32 read32(const byte * p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32) p[3] << 24;
+}
+
+static uint32 lz_hash(uint32 v)
+{
+	/* Knuth's multiplicative hash. */
+	return (v * 2654435761U) >> (32 - lz_hash_log);
+}
+
+/* Lengths of 15 and more continue in bytes of 255 and a remainder. */
+static byte *put_length(byte * op, uint64 len)
+{
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = len;
+	return op;
+}
+
+static byte *put_sequence(byte * op, const byte * lit, uint64 lit_len, uint64 offset, uint64 match_len)
+{
+	byte *token = op++;
+	uint64 ml = match_len - lz_min_match;
+
+	*token = (lit_len < 15 ? lit_len : 15) << 4;
+	if (lit_len >= 15)
+		op = put_length(op, lit_len - 15);
+	memcpy(op, lit, lit_len);
+	op += lit_len;
+
+	if (match_len == 0)
+		return op;
+
+	*op++ = offset & 0xff;
+	*op++ = offset >> 8;
+	*token |= ml < 15 ? ml : 15;
+	if (ml >= 15)
+		op = put_length(op, ml - 15);
+	return op;
+}
+
+void lz_init(lz_table * t)
+{
+	uint64 i;
+
+	for (i = 0; i < sizeof(t->pos) / sizeof(t->pos[0]); i++)
+		t->pos[i] = 0;
+	t->base = 1;
+}
+
+/* Worst case: incompressible input grows by a byte per 255 plus a token. */
+uint64 lz_bound(uint64 n)
+{
+	return n + n / 255 + 16;
+}
+
+/* Compresses n bytes of src into dst, which has lz_bound(n) bytes, and
+ * returns the compressed length. n must be below 2 GiB.
+ */
+uint64 lz_compress(lz_table * t, const byte * src, uint64 n, byte * dst)
+{
+	const byte *ip = src, *anchor = src, *end = src + n, *ref;
+	byte *op = dst;
+	uint64 match_len, misses = 0;
+	uint32 h, e;
+
+	if (t->base + n >= max_base)
+		lz_init(t);
+
+	if (n >= lz_min_input) {
+		while (ip < end - match_limit) {
+			h = lz_hash(read32(ip));
+			e = t->pos[h];
+			t->pos[h] = t->base + (ip - src);
+
+			/* Entries below base are from earlier blocks. */
+			if (e < t->base || ip - (src + (e - t->base)) > lz_max_offset
+				|| read32(src + (e - t->base)) != read32(ip)) {
+				/* Skip faster through data that doesn't compress. */
+				ip += 1 + (misses++ >> 6);
+				continue;
+			}
+			misses = 0;
+			ref = src + (e - t->base);
+
+			match_len = lz_min_match;
+			while (ip + match_len < end - last_literals && ref[match_len] == ip[match_len])
+				match_len++;
+			while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+				ip--;
+				ref--;
+				match_len++;
+			}
+
+			op = put_sequence(op, anchor, ip - anchor, ip - ref, match_len);
+			ip += match_len;
+			anchor = ip;
+		}
+	}
+
+	op = put_sequence(op, anchor, end - anchor, 0, 0);
+	t->base += n + 1;
+	return op - dst;
+}
+
+/* Reads a length continued in bytes of 255, returns -1 past the end. */
+static int64 get_length(const byte ** ip, const byte * end)
+{
+	int64 len = 0;
+	byte b;
+
+	do {
+		if (*ip >= end)
+			return -1;
+		b = *(*ip)++;
+		len += b;
+	} while (b == 255);
+	return len;
+}
+
+/* Decompresses n bytes of src into at most cap bytes of dst. Returns the
+ * decompressed length or -1 if the block is malformed or doesn't fit.
+ */
+int64 lz_decompress(const byte * src, uint64 n, byte * dst, uint64 cap)
+{
+	const byte *ip = src, *end = src + n, *ref;
+	byte *op = dst, *op_end = dst + cap;
+	int64 lit_len, match_len, ext;
+	uint64 offset;
+	byte token;
+
+	while (ip < end) {
+		token = *ip++;
+
+		lit_len = token >> 4;
+		if (lit_len == 15) {
+			ext = get_length(&ip, end);
+			if (ext < 0)
+				return -1;
+			lit_len += ext;
+		}
+		if (lit_len > end - ip || lit_len > op_end - op)
+			return -1;
+		memcpy(op, ip, lit_len);
+		ip += lit_len;
+		op += lit_len;
+
+		/* The last sequence has literals only. */
+		if (ip == end)
+			break;
+
+		if (end - ip < 2)
+			return -1;
+		offset = ip[0] | ip[1] << 8;
+		ip += 2;
+		if (offset == 0 || offset > (uint64) (op - dst))
+			return -1;
+
+		match_len = token & 15;
+		if (match_len == 15) {
+			ext = get_length(&ip, end);
+			if (ext < 0)
+				return -1;
+			match_len += ext;
+		}
+		match_len += lz_min_match;
+		if (match_len > op_end - op)
+			return -1;
+
+		/* Byte by byte, the match may overlap what it produces. */
+		ref = op - offset;
+		while (match_len-- > 0)
+			*op++ = *ref++;
+	}
+	return op - dst;
+}
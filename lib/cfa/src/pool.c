@@ -61,6 +61,8 @@ void pool_init(pool * p, void *buf, uint64 buf_len, uint64 chunk_size, uint64 ch
 	p->buf_len = buf_len;
 	p->chunk_size = chunk_size;
 	p->head = nil;
+	memset(&p->st, 0, sizeof(p->st));
+	p->st.committed = buf_len;
 
 	/* Set up the free list for free chunks. */
 	pool_free_all(p);
@@ -72,6 +74,7 @@ void *pool_get(pool * p)
 	free_node *n = p->head;
 
 	if (n == nil) {
+		p->st.fails++;
 		fmt_fprintf(stderr, "Pool allocator has no free memory\n");
 		return nil;
 	}
@@ -79,6 +82,11 @@ void *pool_get(pool * p)
 	/* Pop free node. */
 	p->head = p->head->next;
 
+	p->st.allocs++;
+	p->st.in_use += p->chunk_size;
+	if (p->st.in_use > p->st.high)
+		p->st.high = p->st.in_use;
+
 	/* return memset(n, 0, p->chunk_size); */
 	return n;
 }
@@ -99,4 +107,7 @@ void pool_put(pool * p, void *ptr)
 	n = (free_node *) ptr;
 	n->next = p->head;
 	p->head = n;
+
+	p->st.frees++;
+	p->st.in_use -= p->chunk_size;
 }
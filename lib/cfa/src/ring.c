@@ -0,0 +1,101 @@
+#include "u.h"
+#include "assert.h"
+#include "atomic.h"
+#include "ring.h"
+
+/* ============================== spsc ============================== */
+
+void spsc_init(spsc_ring * r, void **slots, uint64 cap)
+{
+	assert((cap & (cap - 1)) == 0 && "Ring capacity is not a power of two");
+
+	r->slots = slots;
+	r->mask = cap - 1;
+	r->head = 0;
+	r->tail_seen = 0;
+	r->tail = 0;
+	r->head_seen = 0;
+}
+
+bool spsc_push(spsc_ring * r, void *v)
+{
+	uint64 tail = atomic_load_relaxed(&r->tail);
+
+	if (tail - r->head_seen > r->mask) {
+		r->head_seen = atomic_load(&r->head);
+		if (tail - r->head_seen > r->mask)
+			return false;
+	}
+	r->slots[tail & r->mask] = v;
+	atomic_store(&r->tail, tail + 1);
+	return true;
+}
+
+bool spsc_pop(spsc_ring * r, void **v)
+{
+	uint64 head = atomic_load_relaxed(&r->head);
+
+	if (head == r->tail_seen) {
+		r->tail_seen = atomic_load(&r->tail);
+		if (head == r->tail_seen)
+			return false;
+	}
+	*v = r->slots[head & r->mask];
+	atomic_store(&r->head, head + 1);
+	return true;
+}
+
+/* ============================== mpsc ============================== */
+
+void mpsc_init(mpsc_ring * r, mpsc_cell * cells, uint64 cap)
+{
+	uint64 i;
+
+	assert((cap & (cap - 1)) == 0 && "Ring capacity is not a power of two");
+
+	for (i = 0; i < cap; i++)
+		cells[i].seq = i;
+	r->cells = cells;
+	r->mask = cap - 1;
+	r->tail = 0;
+	r->head = 0;
+}
+
+/* A cell is free for position pos when its seq is pos, it holds a value
+ * for the consumer when seq is pos + 1.
+ */
+bool mpsc_push(mpsc_ring * r, void *v)
+{
+	uint64 pos = atomic_load_relaxed(&r->tail);
+	mpsc_cell *c;
+	int64 d;
+
+	for (;;) {
+		c = &r->cells[pos & r->mask];
+		d = (int64) (atomic_load(&c->seq) - pos);
+		if (d == 0) {
+			if (atomic_cas(&r->tail, &pos, pos + 1))
+				break;
+		} else if (d < 0)
+			return false;
+		else
+			pos = atomic_load_relaxed(&r->tail);
+	}
+	c->v = v;
+	atomic_store(&c->seq, pos + 1);
+	return true;
+}
+
+bool mpsc_pop(mpsc_ring * r, void **v)
+{
+	uint64 pos = r->head;
+	mpsc_cell *c = &r->cells[pos & r->mask];
+
+	if ((int64) (atomic_load(&c->seq) - (pos + 1)) < 0)
+		return false;
+	*v = c->v;
+	/* Free for the producer a lap later. */
+	atomic_store(&c->seq, pos + r->mask + 1);
+	r->head = pos + 1;
+	return true;
+}
@@ -0,0 +1,336 @@
+#include "u.h"
+#include "builtin.h"
+#include "syscall.h"
+#include "assert.h"
+#include "fmt.h"
+#include "arena.h"
+#include "atomic.h"
+#include "slab.h"
+
+enum {
+	page_size = 4096,
+	/* Objects start after the header, aligned for every class. */
+	slab_hdr_size = (sizeof(slab_page) + slab_align - 1) & ~(slab_align - 1)
+};
+
+static const uint32 class_size[slab_classes] = {
+	16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096
+};
+
+/* Classes go in steps of a power of two and one and a half of it, so no
+ * more than a third of an object is wasted above 32 bytes.
+ */
+static uint32 slab_class(uint64 size)
+{
+	uint32 b;
+
+	if (size <= 16)
+		return 0;
+	if (size <= 32)
+		return 1;
+	/* Smallest b with size <= 1 << b. */
+	b = 64 - __builtin_clzl(size - 1);
+	if (size <= (3UL << (b - 2)))
+		return 2 * (b - 5);
+	return 2 * (b - 5) + 1;
+}
+
+static slab_page *slab_page_of(const void *ptr)
+{
+	return (slab_page *) ((uintptr) ptr & ~((uintptr) slab_size - 1));
+}
+
+static void slab_lock(slab * s)
+{
+	if (!s->shared)
+		return;
+	while (atomic_exchange(&s->lock, 1))
+		while (atomic_load_relaxed(&s->lock))
+			cpu_relax();
+}
+
+static void slab_unlock(slab * s)
+{
+	if (s->shared)
+		atomic_store(&s->lock, 0);
+}
+
+static void slab_count_alloc(slab * s, uint64 size)
+{
+	s->st.allocs++;
+	s->st.in_use += size;
+	if (s->st.in_use > s->st.high)
+		s->st.high = s->st.in_use;
+}
+
+/* ============================== slabs ============================== */
+
+/* Maps len bytes aligned to slab_size: maps a slab more and trims. */
+static slab_page *slab_map(slab * s, uint64 len)
+{
+	const error *err;
+	uintptr p, start;
+
+	p = (uintptr) sys_mmap((uintptr) nil, len + slab_size, prot_read | prot_write, map_private | map_anonymous, -1, 0,
+						   &err);
+	if (err) {
+		fmt_fprintf(stderr, "slab_map: sys_mmap failed: %s\n", err->msg);
+		return nil;
+	}
+	start = align_forward(p, slab_size);
+	if (start > p)
+		sys_munmap(p, start - p);
+	if (p + slab_size > start)
+		sys_munmap(start + len, p + slab_size - start);
+	s->st.committed += len;
+	s->st.grows++;
+	return (slab_page *) start;
+}
+
+static void slab_unmap(slab * s, slab_page * pg)
+{
+	s->st.committed -= pg->len;
+	s->st.shrinks++;
+	sys_munmap((uintptr) pg, pg->len);
+}
+
+static void slab_link(slab * s, slab_page * pg)
+{
+	pg->prev = nil;
+	pg->next = s->partial[pg->cls];
+	if (pg->next)
+		pg->next->prev = pg;
+	s->partial[pg->cls] = pg;
+}
+
+static void slab_unlink(slab * s, slab_page * pg)
+{
+	if (pg->prev)
+		pg->prev->next = pg->next;
+	else
+		s->partial[pg->cls] = pg->next;
+	if (pg->next)
+		pg->next->prev = pg->prev;
+	pg->next = pg->prev = nil;
+}
+
+/* Empty slabs start over. Objects come from the part never handed out
+ * until the free list has some, so a new slab costs no more than its
+ * mapping.
+ */
+static slab_page *slab_grow(slab * s, uint32 cls)
+{
+	slab_page *pg = s->empty[cls];
+
+	if (pg) {
+		s->empty[cls] = pg->next;
+		s->empties[cls]--;
+	} else {
+		pg = slab_map(s, slab_size);
+		if (pg == nil)
+			return nil;
+		pg->owner = s;
+		pg->cls = cls;
+		pg->cap = (slab_size - slab_hdr_size) / class_size[cls];
+		pg->len = slab_size;
+	}
+	pg->free = nil;
+	pg->used = 0;
+	pg->fresh = 0;
+	slab_link(s, pg);
+	return pg;
+}
+
+static void *slab_take(slab * s, uint32 cls)
+{
+	slab_page *pg = s->partial[cls];
+	void *p;
+
+	if (pg == nil) {
+		pg = slab_grow(s, cls);
+		if (pg == nil) {
+			s->st.fails++;
+			return nil;
+		}
+	}
+	if (pg->free) {
+		p = pg->free;
+		pg->free = *(void **)p;
+	} else {
+		p = (byte *) pg + slab_hdr_size + (uint64) pg->fresh * class_size[cls];
+		pg->fresh++;
+	}
+	if (++pg->used == pg->cap)
+		slab_unlink(s, pg);
+	slab_count_alloc(s, class_size[cls]);
+	return p;
+}
+
+static void slab_put(slab * s, void *ptr)
+{
+	slab_page *pg = slab_page_of(ptr);
+
+	assert(pg->owner == s && "Object is not from this slab allocator");
+
+	s->st.frees++;
+	if (pg->cls == slab_classes) {
+		s->st.in_use -= pg->len - slab_hdr_size;
+		slab_unmap(s, pg);
+		return;
+	}
+	s->st.in_use -= class_size[pg->cls];
+	if (pg->used-- == pg->cap)
+		slab_link(s, pg);
+	if (pg->used > 0) {
+		*(void **)ptr = pg->free;
+		pg->free = ptr;
+		return;
+	}
+	slab_unlink(s, pg);
+	if (s->empties[pg->cls] == slab_keep_empty) {
+		slab_unmap(s, pg);
+		return;
+	}
+	pg->next = s->empty[pg->cls];
+	s->empty[pg->cls] = pg;
+	s->empties[pg->cls]++;
+}
+
+static void *slab_take_big(slab * s, uint64 size)
+{
+	uint64 len = align_forward(slab_hdr_size + size, page_size);
+	slab_page *pg = slab_map(s, len);
+
+	if (pg == nil) {
+		s->st.fails++;
+		return nil;
+	}
+	pg->owner = s;
+	pg->cls = slab_classes;
+	pg->len = len;
+	slab_count_alloc(s, len - slab_hdr_size);
+	return (byte *) pg + slab_hdr_size;
+}
+
+/* ============================== public ============================== */
+
+void slab_init(slab * s, int shared)
+{
+	memset(s, 0, sizeof(*s));
+	s->shared = shared;
+}
+
+void *slab_alloc(slab * s, uint64 size)
+{
+	void *p;
+
+	slab_lock(s);
+	if (size > slab_max_size)
+		p = slab_take_big(s, size);
+	else
+		p = slab_take(s, slab_class(size));
+	slab_unlock(s);
+	return p;
+}
+
+void slab_free(slab * s, void *ptr)
+{
+	if (ptr == nil)
+		return;
+	slab_lock(s);
+	slab_put(s, ptr);
+	slab_unlock(s);
+}
+
+uint64 slab_usable_size(const void *ptr)
+{
+	slab_page *pg = slab_page_of(ptr);
+
+	if (pg->cls == slab_classes)
+		return pg->len - slab_hdr_size;
+	return class_size[pg->cls];
+}
+
+/* Returns the empty slabs kept for reuse to the OS. */
+void slab_trim(slab * s)
+{
+	slab_page *pg;
+	uint32 cls;
+
+	slab_lock(s);
+	for (cls = 0; cls < slab_classes; cls++) {
+		while (s->empty[cls]) {
+			pg = s->empty[cls];
+			s->empty[cls] = pg->next;
+			slab_unmap(s, pg);
+		}
+		s->empties[cls] = 0;
+	}
+	slab_unlock(s);
+}
+
+/* ============================== caches ============================== */
+
+void slab_cache_init(slab_cache * c, slab * s)
+{
+	memset(c, 0, sizeof(*c));
+	c->s = s;
+}
+
+void *slab_cache_alloc(slab_cache * c, uint64 size)
+{
+	uint32 cls, i;
+	void *p;
+
+	if (size > slab_max_size)
+		return slab_alloc(c->s, size);
+	cls = slab_class(size);
+	if (c->n[cls] == 0) {
+		/* Refill half the cache, the other half absorbs frees. */
+		slab_lock(c->s);
+		for (i = 0; i < slab_cache_len / 2; i++) {
+			p = slab_take(c->s, cls);
+			if (p == nil)
+				break;
+			c->obj[cls][c->n[cls]++] = p;
+		}
+		slab_unlock(c->s);
+		if (c->n[cls] == 0)
+			return nil;
+	}
+	return c->obj[cls][--c->n[cls]];
+}
+
+void slab_cache_free(slab_cache * c, void *ptr)
+{
+	slab_page *pg;
+	uint32 cls, i;
+
+	if (ptr == nil)
+		return;
+	pg = slab_page_of(ptr);
+	if (pg->cls == slab_classes) {
+		slab_free(c->s, ptr);
+		return;
+	}
+	cls = pg->cls;
+	if (c->n[cls] == slab_cache_len) {
+		slab_lock(c->s);
+		for (i = 0; i < slab_cache_len / 2; i++)
+			slab_put(c->s, c->obj[cls][--c->n[cls]]);
+		slab_unlock(c->s);
+	}
+	c->obj[cls][c->n[cls]++] = ptr;
+}
+
+/* Gives everything back to the slab allocator, before a thread exits. */
+void slab_cache_flush(slab_cache * c)
+{
+	uint32 cls;
+
+	slab_lock(c->s);
+	for (cls = 0; cls < slab_classes; cls++)
+		while (c->n[cls] > 0)
+			slab_put(c->s, c->obj[cls][--c->n[cls]]);
+	slab_unlock(c->s);
+}
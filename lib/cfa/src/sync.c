@@ -0,0 +1,82 @@
+#include "u.h"
+#include "syscall.h"
+#include "atomic.h"
+#include "sync.h"
+
+enum { unlocked = 0, locked = 1, contended = 2 };
+
+void futex_wait(uint32 * addr, uint32 val)
+{
+	sys_futex(addr, futex_wait_op | futex_private, val, nil, nil);
+}
+
+void futex_wake(uint32 * addr, int n)
+{
+	sys_futex(addr, futex_wake_op | futex_private, n, nil, nil);
+}
+
+/* ============================== mutex ============================== */
+
+void mutex_init(mutex * m)
+{
+	m->state = unlocked;
+}
+
+bool mutex_trylock(mutex * m)
+{
+	uint32 s = unlocked;
+
+	return atomic_cas(&m->state, &s, locked);
+}
+
+/* Drepper's "Futexes Are Tricky" mutex: once it waited, a thread takes
+ * the lock as contended, so unlock wakes whoever may still be waiting.
+ */
+void mutex_lock(mutex * m)
+{
+	uint32 s = unlocked;
+
+	if (atomic_cas(&m->state, &s, locked))
+		return;
+	if (s != contended)
+		s = atomic_exchange(&m->state, contended);
+	while (s != unlocked) {
+		futex_wait(&m->state, contended);
+		s = atomic_exchange(&m->state, contended);
+	}
+}
+
+void mutex_unlock(mutex * m)
+{
+	if (atomic_exchange(&m->state, unlocked) == contended)
+		futex_wake(&m->state, 1);
+}
+
+/* ============================== cond ============================== */
+
+void cond_init(cond * c)
+{
+	c->seq = 0;
+}
+
+/* Wakes up spuriously too, callers check their condition in a loop. */
+void cond_wait(cond * c, mutex * m)
+{
+	uint32 seq = atomic_load(&c->seq);
+
+	mutex_unlock(m);
+	futex_wait(&c->seq, seq);
+	mutex_lock(m);
+}
+
+void cond_signal(cond * c)
+{
+	atomic_fetch_add(&c->seq, 1);
+	futex_wake(&c->seq, 1);
+}
+
+void cond_broadcast(cond * c)
+{
+	atomic_fetch_add(&c->seq, 1);
+	futex_wake(&c->seq, 0x7fffffff);
+}
@@ -6,12 +6,19 @@ typedef struct syscall_error_t {
 	uintptr errno;
 } syscall_result;
 
-enum { s_read = 0x0, s_write = 0x1, s_close = 0x3, s_mmap = 0x9,
+enum { s_read = 0x0, s_write = 0x1, s_close = 0x3, s_mmap = 0x9, s_mprotect = 0xa, s_madvise = 0x1c, s_mlock = 0x95,
 	s_munmap = 0xb, s_exit = 0x3c, s_clock_gettime = 0xe4,
 	s_socket = 0x29, s_bind = 0x31, s_setsockopt = 0x36,
 	s_listen = 0x32, s_accept = 0x2b, s_accept4 = 0x120,
 	s_epoll_create = 0xd5, s_epoll_wait = 0xe8, s_epoll_ctl = 0xe9,
-	s_fork = 0x39, s_epoll_create1 = 0x123
+	s_fork = 0x39, s_epoll_create1 = 0x123, s_shutdown = 0x30,
+	s_rt_sigprocmask = 0xe, s_writev = 0x14, s_open = 0x2, s_mkdir = 0x53,
+	s_lseek = 0x8, s_fsync = 0x4a, s_ftruncate = 0x4d, s_getdents64 = 0xd9,
+	s_socketpair = 0x35, s_sendmsg = 0x2e, s_recvmsg = 0x2f, s_dup = 0x20,
+	s_execve = 0x3b, s_wait4 = 0x3d, s_kill = 0x3e, s_signalfd4 = 0x121,
+	s_eventfd2 = 0x122, s_prctl = 0x9d, s_getrusage = 0x62, s_unlink = 0x57,
+	s_sendfile = 0x28, s_pread64 = 0x11, s_fcntl = 0x48, s_memfd_create = 0x13f,
+	s_futex = 0xca, s_sched_yield = 0x18, s_exit_group = 0xe7
 };
 
 /* In order to preserve the value of the rcx register, we specified rcx 
@@ -98,6 +105,33 @@ int64 sys_write(uint32 fd, const char *buf, uint64 count, const error ** err)
 	return r.r1;
 }
 
+int64 sys_pread(uint32 fd, char *buf, uint64 count, int64 offset, const error ** err)
+{
+	syscall_result r = syscall6(s_pread64, fd, (uintptr) buf, count, offset, 0, 0);
+	if (err != nil) {
+		*err = set_error(r.errno);
+	}
+	return r.r1;
+}
+
+int64 sys_sendfile(int out_fd, int in_fd, int64 * offset, uint64 count, const error ** err)
+{
+	syscall_result r = syscall6(s_sendfile, out_fd, in_fd, (uintptr) offset, count, 0, 0);
+	if (err != nil) {
+		*err = set_error(r.errno);
+	}
+	return r.r1;
+}
+
+int64 sys_writev(uint32 fd, const struct iovec_t *iov, int iovcnt, const error ** err)
+{
+	syscall_result r = syscall3(s_writev, fd, (uintptr) iov, iovcnt);
+	if (err != nil) {
+		*err = set_error(r.errno);
+	}
+	return r.r1;
+}
+
 const error *sys_close(uint32 fd)
 {
 	syscall_result r = syscall3(s_close, fd, 0, 0);
@@ -107,6 +141,87 @@ const error *sys_close(uint32 fd)
 	return nil;
 }
 
+int sys_open(const char *path, int flags, int mode, const error ** err)
+{
+	syscall_result r = syscall3(s_open, (uintptr) path, flags, mode);
+	if (err != nil) {
+		*err = set_error(r.errno);
+	}
+	return r.r1;
+}
+
+const error *sys_mkdir(const char *path, int mode)
+{
+	syscall_result r = syscall3(s_mkdir, (uintptr) path, mode, 0);
+	if (r.errno != 0) {
+		return set_error(r.errno);
+	}
+	return nil;
+}
+
+int64 sys_lseek(uint32 fd, int64 offset, int whence, const error ** err)
+{
+	syscall_result r = syscall3(s_lseek, fd, offset, whence);
+	if (err != nil) {
+		*err = set_error(r.errno);
+	}
+	return r.r1;
+}
+
+int sys_fcntl(int fd, int cmd, uint64 arg, const error ** err)
+{
+	syscall_result r = syscall3(s_fcntl, fd, cmd, arg);
+	if (err != nil) {
+		*err = set_error(r.errno);
+	}
+	return r.r1;
+}
+
+int sys_memfd_create(const char *name, uint32 flags, const error ** err)
+{
+	syscall_result r = syscall3(s_memfd_create, (uintptr) name, flags, 0);
+	if (err != nil) {
+		*err = set_error(r.errno);
+	}
+	return r.r1;
+}
+
+const error *sys_unlink(const char *path)
+{
+	syscall_result r = syscall3(s_unlink, (uintptr) path, 0, 0);
+	if (r.errno != 0) {
+		return set_error(r.errno);
+	}
+	return nil;
+}
+
+const error *sys_fsync(uint32 fd)
+{
+	syscall_result r = syscall3(s_fsync, fd, 0, 0);
+	if (r.errno != 0) {
+		return set_error(r.errno);
+	}
+	return nil;
+}
+
+const error *sys_ftruncate(uint32 fd, uint64 length)
+{
+	syscall_result r = syscall3(s_ftruncate, fd, length, 0);
+	if (r.errno != 0) {
+		return set_error(r.errno);
+	}
+	return nil;
+}
+
+int64 sys_getdents64(uint32 fd, void *dirp, uint64 count, const error ** err)
+{
+	syscall_result r = syscall3(s_getdents64, fd, (uintptr) dirp, count);
+	if (err != nil) {
+		*err = set_error(r.errno);
+	}
+	return r.r1;
+}
+
 void *sys_mmap(uintptr addr, uint64 len, uintptr prot, uintptr flags, uintptr fd, uintptr offset, const error ** err)
 {
 	syscall_result r = syscall6(s_mmap, addr, len, prot, flags, fd, offset);
@@ -125,11 +240,44 @@ const error *sys_munmap(uintptr addr, uint64 len)
 	return nil;
 }
 
+const error *sys_mprotect(uintptr addr, uint64 len, uintptr prot)
+{
+	syscall_result r = syscall3(s_mprotect, addr, len, prot);
+	if (r.errno != 0) {
+		return set_error(r.errno);
+	}
+	return nil;
+}
+
+const error *sys_madvise(uintptr addr, uint64 len, int advice)
+{
+	syscall_result r = syscall3(s_madvise, addr, len, advice);
+	if (r.errno != 0) {
+		return set_error(r.errno);
+	}
+	return nil;
+}
+
+const error *sys_mlock(uintptr addr, uint64 len)
+{
+	syscall_result r = syscall3(s_mlock, addr, len, 0);
+	if (r.errno != 0) {
+		return set_error(r.errno);
+	}
+	return nil;
+}
+
 void sys_exit(int error_code)
 {
 	syscall3(s_exit, error_code, 0, 0);
 }
 
+/* Ends all threads of the process, sys_exit ends only the caller. */
+void sys_exit_group(int error_code)
+{
+	syscall3(s_exit_group, error_code, 0, 0);
+}
+
 const error *sys_clock_gettime(int which_clock, struct timespec *tp)
 {
 	syscall_result r = syscall3(s_clock_gettime, which_clock, (uintptr) tp, 0);
@@ -139,6 +287,24 @@ const error *sys_clock_gettime(int which_clock, struct timespec *tp)
 	return nil;
 }
 
+const error *sys_rt_sigprocmask(int how, const sigset * set, sigset * oldset)
+{
+	syscall_result r = syscall6(s_rt_sigprocmask, how, (uintptr) set, (uintptr) oldset, sizeof(sigset), 0, 0);
+	if (r.errno != 0) {
+		return set_error(r.errno);
+	}
+	return nil;
+}
+
+const error *sys_getrusage(int who, struct rusage *ru)
+{
+	syscall_result r = syscall3(s_getrusage, who, (uintptr) ru, 0);
+	if (r.errno != 0) {
+		return set_error(r.errno);
+	}
+	return nil;
+}
+
 int sys_socket(int family, int type, int protocol, const error ** err)
 {
 	syscall_result r = syscall3(s_socket, family, type, protocol);
@@ -195,6 +361,158 @@ int sys_accept4(int sockfd, struct sockaddr *addr, int *addrlen, int flags, cons
 	return r.r1;
 }
 
+const error *sys_shutdown(int sockfd, int how)
+{
+	syscall_result r = syscall3(s_shutdown, sockfd, how, 0);
+	if (r.errno != 0) {
+		return set_error(r.errno);
+	}
+	return nil;
+}
+
+const error *sys_socketpair(int family, int type, int protocol, int sv[2])
+{
+	syscall_result r = syscall6(s_socketpair, family, type, protocol, (uintptr) sv, 0, 0);
+	if (r.errno != 0) {
+		return set_error(r.errno);
+	}
+	return nil;
+}
+
+int64 sys_sendmsg(int sockfd, const struct msghdr *msg, int flags, const error ** err)
+{
+	syscall_result r = syscall3(s_sendmsg, sockfd, (uintptr) msg, flags);
+	if (err != nil) {
+		*err = set_error(r.errno);
+	}
+	return r.r1;
+}
+
+int64 sys_recvmsg(int sockfd, struct msghdr *msg, int flags, const error ** err)
+{
+	syscall_result r = syscall3(s_recvmsg, sockfd, (uintptr) msg, flags);
+	if (err != nil) {
+		*err = set_error(r.errno);
+	}
+	return r.r1;
+}
+
+int sys_dup(int fd, const error ** err)
+{
+	syscall_result r = syscall3(s_dup, fd, 0, 0);
+	if (err != nil) {
+		*err = set_error(r.errno);
+	}
+	return r.r1;
+}
+
+const error *sys_execve(const char *path, char *const argv[], char *const envp[])
+{
+	syscall_result r = syscall3(s_execve, (uintptr) path, (uintptr) argv, (uintptr) envp);
+	return set_error(r.errno);
+}
+
+int sys_wait4(int pid, int *status, int options, const error ** err)
+{
+	syscall_result r = syscall6(s_wait4, pid, (uintptr) status, options, 0, 0, 0);
+	if (err != nil) {
+		*err = set_error(r.errno);
+	}
+	return r.r1;
+}
+
+const error *sys_kill(int pid, int sig)
+{
+	syscall_result r = syscall3(s_kill, pid, sig, 0);
+	if (r.errno != 0) {
+		return set_error(r.errno);
+	}
+	return nil;
+}
+
+int sys_signalfd(int fd, const sigset * mask, int flags, const error ** err)
+{
+	syscall_result r = syscall6(s_signalfd4, fd, (uintptr) mask, sizeof(sigset), flags, 0, 0);
+	if (err != nil) {
+		*err = set_error(r.errno);
+	}
+	return r.r1;
+}
+
+int sys_eventfd(uint32 initval, int flags, const error ** err)
+{
+	syscall_result r = syscall3(s_eventfd2, initval, flags, 0);
+	if (err != nil) {
+		*err = set_error(r.errno);
+	}
+	return r.r1;
+}
+
+void sys_sched_yield(void)
+{
+	syscall3(s_sched_yield, 0, 0, 0);
+}
+
+int sys_futex(uint32 * uaddr, int op, uint32 val, const struct timespec *timeout, const error ** err)
+{
+	syscall_result r = syscall6(s_futex, (uintptr) uaddr, op, val, (uintptr) timeout, 0, 0);
+	if (err != nil) {
+		*err = set_error(r.errno);
+	}
+	return r.r1;
+}
+
+/* The child comes up on its own stack with nothing but registers, so fn
+ * and arg go on the new stack before the system call and the child pops
+ * them, calls fn and exits the thread. Returns the raw clone result.
+ */
+int64 clone_start(uint64 flags, void *stack, int *ptid, int *ctid, void (*fn)(void *), void *arg);
+
+__asm__(".text\n"
+		".type clone_start, @function\n"
+		"clone_start:\n"
+		"\tsub $16, %rsi\n"
+		"\tmov %r8, (%rsi)\n"
+		"\tmov %r9, 8(%rsi)\n"
+		"\tmov %rcx, %r10\n"
+		"\txor %r8d, %r8d\n"
+		"\tmov $0x38, %eax\n"
+		"\tsyscall\n"
+		"\ttest %rax, %rax\n"
+		"\tjnz 1f\n"
+		"\txor %ebp, %ebp\n"
+		"\tpop %rax\n"
+		"\tpop %rdi\n"
+		"\tcall *%rax\n"
+		"\tmov $0x3c, %eax\n"
+		"\txor %edi, %edi\n"
+		"\tsyscall\n"
+		"\thlt\n"
+		"1:\n"
+		"\tret\n");
+
+int sys_clone_thread(uint64 flags, void *stack, int *ptid, int *ctid, void (*fn)(void *), void *arg,
+					 const error ** err)
+{
+	int64 r = clone_start(flags, stack, ptid, ctid, fn, arg);
+
+	if (r < 0 && r > -4096) {
+		*err = set_error(-r);
+		return -1;
+	}
+	*err = nil;
+	return r;
+}
+
+const error *sys_prctl(int option, uint64 arg2)
+{
+	syscall_result r = syscall6(s_prctl, option, arg2, 0, 0, 0, 0);
+	if (r.errno != 0) {
+		return set_error(r.errno);
+	}
+	return nil;
+}
+
 int sys_fork(const error ** err)
 {
 	syscall_result r = syscall3(s_fork, 0, 0, 0);
@@ -0,0 +1,48 @@
+#include "u.h"
+#include "builtin.h"
+#include "syscall.h"
+#include "atomic.h"
+#include "thread.h"
+
+enum { page_size = 4096 };
+
+const error *thread_create(thread * t, void (*fn)(void *), void *arg, uint64 stack_size)
+{
+	const error *err;
+	byte *stack;
+	uint64 len;
+
+	if (stack_size == 0)
+		stack_size = thread_stack_size;
+	len = ((stack_size - 1) / page_size + 1) * page_size + page_size;
+
+	stack = sys_mmap((uintptr) nil, len, prot_read | prot_write, map_private | map_anonymous, -1, 0, &err);
+	if (err != nil)
+		return err;
+	/* Stacks grow down, an overflow hits the guard page. */
+	err = sys_mprotect((uintptr) stack, page_size, prot_none);
+	if (err != nil) {
+		sys_munmap((uintptr) stack, len);
+		return err;
+	}
+
+	t->stack = stack;
+	t->stack_len = len;
+	sys_clone_thread(clone_vm | clone_fs | clone_files | clone_sighand | clone_thread | clone_sysvsem |
+					 clone_parent_settid | clone_child_cleartid, stack + len, &t->tid, &t->tid, fn, arg, &err);
+	if (err != nil) {
+		sys_munmap((uintptr) stack, len);
+		return err;
+	}
+	return nil;
+}
+
+/* The kernel wakes the shared futex on tid, a private wait would miss it. */
+void thread_join(thread * t)
+{
+	int tid;
+
+	while ((tid = atomic_load(&t->tid)) != 0)
+		sys_futex((uint32 *) & t->tid, futex_wait_op, tid, nil, nil);
+	sys_munmap((uintptr) t->stack, t->stack_len);
+}
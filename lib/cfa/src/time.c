@@ -2,187 +2,175 @@
 #include "builtin.h"			/* c_string_in_slice */
 #include "time.h"
 
-static const int days_since_jan_1st[][13] = {
-	{0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334, 365},	/* non-leap year. */
-	{0, 31, 60, 91, 121, 152, 182, 213, 244, 274, 305, 335, 366},	/* leap year. */
+enum {
+	day_secs = 24 * 60 * 60,
+	/* Days of 400 years, 97 of them leap. */
+	era_days = 146097,
+	/* The computation starts the year on March 1, so that February and
+	 * its leap day come last, and counts from March 1 of the year 0 moved
+	 * back shift_eras eras, so that it is all unsigned. 1970-01-01 is
+	 * day 719468 from March 1 of the year 0.
+	 */
+	shift_eras = 82,
+	shift_days = 719468 + era_days * shift_eras
 };
 
-/* t argc represents the number of seconds that have passed since 1970. */
-struct tm time_to_tm(int64 t)
-{
-	int64 quadricentennials, centennials, quadrennials, annuals;
-	int64 yday, mday, wday;
-	int64 year, month, leap;
-	int64 hour, min, sec;
-	struct tm tm_time;
+static const time_zone zones[] = {
+	{"UTC", 0},
+	{"MSK", 3 * 3600},
+	{"GMT", 0},
+	{"WET", 0},
+	{"CET", 1 * 3600},
+	{"EET", 2 * 3600},
+	{"GST", 4 * 3600},
+	{"PKT", 5 * 3600},
+	{"IST", 5 * 3600 + 1800},
+	{"NPT", 5 * 3600 + 2700},
+	{"ICT", 7 * 3600},
+	{"HKT", 8 * 3600},
+	{"JST", 9 * 3600},
+	{"KST", 9 * 3600},
+	{"AEST", 10 * 3600},
+	{"NZST", 12 * 3600},
+	{"BRT", -3 * 3600},
+	{"AST", -4 * 3600},
+	{"EST", -5 * 3600},
+	{"CST", -6 * 3600},
+	{"MST", -7 * 3600},
+	{"PST", -8 * 3600},
+	{"AKST", -9 * 3600},
+	{"HST", -10 * 3600}
+};
 
-	t += 3 * 60 * 60;			/* MSK timezone. */
+static const time_zone *const msk = &zones[1];
 
-	/* Convert era from 1970 (unix) to 1601 (windows)
-	 * 1601 + 369 = 1970 (369 = 3 * 100 + 17 * 4 + 1 year)
-	 * (incl. 89 leap days (1600-1700 - 24, 1700-1800 - 24, 1800-1900 - 24,
-	 * 1900-1970 - 17 lead days)) = (228 * 365 (non-leap years) + 72 * 366 (leap years)) +
-	 * + 53 * 365 (non-leap years) + 17 * 366 (leap years) = 135 139 days
-	 * 135 139 days * 60 secs * 60 mins * 24 hours
-	 */
-	sec = t + 11644473600;
+const time_zone *time_zone_find(const char *name, uint64 len)
+{
+	uint64 i;
 
-	/* Since January 1, 1601 is Monday, then to get the correct result
-	 * we need to take into account that we are counting not from Sunday,
-	 * but from Monday.
-	 */
-	wday = (sec / 86400 + 1) % 7;	/* day of week. */
+	for (i = 0; i < sizeof(zones) / sizeof(zones[0]); i++)
+		if (c_strlen(zones[i].name) == len && memequal(zones[i].name, name, len))
+			return &zones[i];
+	return nil;
+}
 
-	/* Remove multiples of 400 years (incl. 97 leap days).
-	 * (365 * 303 + 366 * 97) * 60 * 60 * 24 = 146097 days * 60 secs * 60 mins * 24 hours
-	 */
-	quadricentennials = sec / 12622780800;
-	sec %= 12622780800;
+/* Civil date of day n, counted from shift_days before 1970-01-01, after
+ * C. Neri and L. Schneider, "Euclidean affine functions and their
+ * application to calendar algorithms" (2022). Each step divides by a
+ * constant the compiler turns into a multiplication, there is no search
+ * and no branch. n has to be below 2^30.
+ */
+static void days_to_civil(uint32 n, struct tm *tm)
+{
+	uint32 n1, c, nc, n2, z, ny, n3, m, d, j, y, leap;
+	uint64 p2;
 
-	/* Remove multiples of 100 years (incl. 24 leap days), can't be more than 3
-	 * (because multiples of 4*100=400 years (incl. leap days) have been removed).
-	 *  (365 * 76 + 366 * 24) * 60 * 60 * 24 = 36524 days * 60 secs * 60 mins * 24 hours
-	 */
-	centennials = sec / 3155673600;
-	if (centennials > 3) {
-		centennials = 3;
-	}
-	sec -= centennials * 3155673600;
+	/* Century and day of the century. */
+	n1 = 4 * n + 3;
+	c = n1 / era_days;
+	nc = n1 % era_days / 4;
 
-	/* Remove multiples of 4 years (incl. 1 leap day), can't be more than 24 
-	 * (because multiples of 25*4=100 years (incl. leap days) have been removed).
-	 * (365 * 3 + 366) * 60 * 60 * 24 = 1461 days * 60 secs * 60 mins * 24 hours
+	/* Year of the century and day of the year, 2939745 / 2^32 is close
+	 * enough to 4 / 1461 for the whole century.
 	 */
-	quadrennials = sec / 126230400;
-	if (quadrennials > 24) {
-		quadrennials = 24;
-	}
-	sec -= quadrennials * 126230400;
-
-	/* Remove multiples of years (incl. 0 leap days), can't be more than 3
-	 * (because multiples of 4 years (incl. leap days) have been removed).
-	 * 365 days * 60 secs * 60 mins * 24 hours
+	n2 = 4 * nc + 3;
+	p2 = (uint64) 2939745 * n2;
+	z = (uint32) (p2 >> 32);
+	ny = (uint32) p2 / 2939745 / 4;
+	y = 100 * c + z;
+
+	/* Month and day, months of 153 days per 5 in 16.16 fixed point. */
+	n3 = 2141 * ny + 197913;
+	m = n3 >> 16;
+	d = (n3 & 0xffff) / 2141;
+
+	/* January and February belong to the next year. A year divisible by
+	 * 100 is divisible by 400 if it is by 16, and 400 shift_eras keeps
+	 * it that way.
 	 */
-	annuals = sec / 31536000;
-	if (annuals > 3) {
-		annuals = 3;
-	}
-	sec -= annuals * 31536000;
-
-	/* Calculate the year and find out if it's leap. */
-	year = 1601 + quadricentennials * 400 + centennials * 100 + quadrennials * 4 + annuals;
-	leap = (year % 4 == 0) && ((year % 100 != 0) || (year % 400 == 0));
-
-	/* Calculate the day of the year and the time. */
-	yday = sec / 86400;
-	sec %= 86400;
-	hour = sec / 3600;
-	sec %= 3600;
-	min = sec / 60;
-	sec %= 60;
-
-	/* Calculate the month. */
-	for (month = 1, mday = 1; month <= 12; month++) {
-		if (yday < days_since_jan_1st[leap][month]) {
-			mday += yday - days_since_jan_1st[leap][month - 1];
-			break;
-		}
-	}
-
-	tm_time.tm_sec = sec;		/*  [0,59]. */
-	tm_time.tm_min = min;		/*  [0,59]. */
-	tm_time.tm_hour = hour;		/*  [0,23]. */
-	tm_time.tm_mday = mday;		/*  [1,31]  (day of month). */
-	tm_time.tm_mon = month - 1;	/*  [0,11]  (month). */
-	tm_time.tm_year = year - 1900;	/*  70+     (year since 1900). */
-	tm_time.tm_wday = wday;		/*  [0,6]   (day since Sunday AKA day of week). */
-	tm_time.tm_yday = yday;		/*  [0,365] (day since January 1st). */
-	tm_time.tm_isdst = -1;		/*  daylight saving time flag. 
-								 * -1 - unknown, 0 - not set 1 - set
-								 */
-	tm_time.tm_gmtoff = 3 * 60 * 60;	/* MSK timezone. */
-	tm_time.tm_zone = nil;
-
-	return tm_time;
+	j = ny >= 306;
+	leap = (y & (y % 25 == 0 ? 15 : 3)) == 0;
+
+	tm->tm_year = (int) (y + j) - 400 * shift_eras - 1900;
+	tm->tm_mon = m - 12 * j - 1;
+	tm->tm_mday = d + 1;
+	tm->tm_yday = ny + 59 + leap - j * (365 + leap);
+	/* The shifted day 0 is a Wednesday. */
+	tm->tm_wday = (n + 3) % 7;
 }
 
-/*
-struct tm time_to_tm2(int64 t)
+/* t is the number of seconds since 1970-01-01 UTC. Times out of the
+ * range of time.h convert as its first or last second.
+ */
+struct tm time_to_tm_zone(int64 t, const time_zone * z)
 {
-	int64 quadricentennials, centennials, quadrennials, annuals;
-	int64 yday, mday, wday;
-	int64 year, month, leap;
-	int64 hour, min, sec;
+	const int64 first = (int64) time_min_days * day_secs, last = (int64) time_max_days * day_secs + day_secs - 1;
 	struct tm tm_time;
+	uint64 u;
+	uint32 sec;
+
+	if (t < first - z->offset)
+		t = first - z->offset;
+	else if (t > last - z->offset)
+		t = last - z->offset;
+	u = (uint64) (t + z->offset) + (uint64) shift_days * day_secs;
+	days_to_civil(u / day_secs, &tm_time);
+
+	sec = u % day_secs;
+	tm_time.tm_hour = sec / 3600;
+	tm_time.tm_min = sec / 60 % 60;
+	tm_time.tm_sec = sec % 60;
+	tm_time.tm_isdst = -1;		/* unknown */
+	tm_time.tm_gmtoff = z->offset;
+	tm_time.tm_zone = (char *) z->name;
 
-	t += 3 * 60 * 60;
-
-	sec = t;
+	return tm_time;
+}
 
-	wday = (sec / 86400 + 4) % 7;
+/* In MSK, where the chat lives. */
+struct tm time_to_tm(int64 t)
+{
+	return time_to_tm_zone(t, msk);
+}
 
-	quadricentennials = sec / 12622780800;
-	sec %= 12622780800;
+static const char *wdays[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
 
-	centennials = sec / 3155673600;
-	if (centennials > 3) {
-		centennials = 3;
-	}
-	sec -= centennials * 3155673600;
+static const char *months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct",
+	"Nov", "Dec"
+};
 
-	quadrennials = sec / 126230400;
-	if (quadrennials > 24) {
-		quadrennials = 24;
-	}
-	sec -= quadrennials * 126230400;
+static uint64 two_digits_in_slice(slice s, int x)
+{
+	char *buf = s.base;
 
-	annuals = sec / 31536000;
-	if (annuals > 3) {
-		annuals = 3;
-	}
-	sec -= annuals * 31536000;
-
-	year = 1970 + quadricentennials * 400 + centennials * 100 + quadrennials * 4 + annuals;
-	leap = (year % 4 == 0) && ((year % 100 != 0) || (year % 400 == 0));
-
-	yday = sec / 86400;
-	if (sec % 86400 != 0)
-		yday -= 1;
-
-	sec %= 86400;
-	hour = sec / 3600;
-	sec %= 3600;
-	min = sec / 60;
-	sec %= 60;
-
-	for (month = 1, mday = 1; month <= 12; month++) {
-		if (yday < days_since_jan_1st[leap][month]) {
-			mday += yday - days_since_jan_1st[leap][month - 1];
-			break;
-		}
-	}
+	buf[0] = '0' + x / 10;
+	buf[1] = '0' + x % 10;
+	return 2;
+}
 
-	tm_time.tm_sec = sec;
-	tm_time.tm_min = min;
-	tm_time.tm_hour = hour;
-	tm_time.tm_mday = mday;
-	tm_time.tm_mon = month - 1;
-	tm_time.tm_year = year - 1900;
-	tm_time.tm_wday = wday;
-	tm_time.tm_yday = yday;
-	tm_time.tm_isdst = -1;
-	tm_time.tm_gmtoff = 3 * 60 * 60;
-	tm_time.tm_zone = nil;
+/* +0300, or +03:00 with colon. */
+static uint64 offset_in_slice(slice s, long off, int colon)
+{
+	char *buf = s.base;
+	int n = 0;
 
-	return tm_time;
+	buf[n++] = off < 0 ? '-' : '+';
+	if (off < 0)
+		off = -off;
+	n += two_digits_in_slice(slice_left(s, n), off / 3600);
+	if (colon)
+		buf[n++] = ':';
+	n += two_digits_in_slice(slice_left(s, n), off / 60 % 60);
+	return n;
 }
-*/
-
-static const char *wdays[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
 
-static const char *months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct",
-	"Nov", "Dec"
-};
+/* The abbreviation, the offset if there is none. */
+static uint64 zone_in_slice(slice s, const struct tm *tm)
+{
+	if (tm->tm_zone == nil)
+		return offset_in_slice(s, tm->tm_gmtoff, false);
+	return c_string_in_slice(s, tm->tm_zone);
+}
 
 /* Sat, 04 Nov 2023 17:47:03 +0300 */
 uint64 tm_rfc822_in_slice(slice s, const struct tm *tm)
@@ -224,16 +212,77 @@ uint64 tm_rfc822_in_slice(slice s, const struct tm *tm)
 	n += int_in_slice(slice_left(s, n), tm->tm_sec);
 	buf[n++] = ' ';
 
-	buf[n++] = '+';
-	buf[n++] = '0';
-	buf[n++] = '3';
-	buf[n++] = '0';
-	buf[n++] = '0';
+	n += offset_in_slice(slice_left(s, n), tm->tm_gmtoff, false);
+
+	return n;
+}
+
+/* 2023-11-04T17:47:03, years past 9999 or before 0 with a sign. */
+static uint64 tm_date_time_in_slice(slice s, const struct tm *tm)
+{
+	char *buf = s.base;
+	int year = tm->tm_year + 1900, n = 0;
+
+	if (year < 0 || year > 9999) {
+		if (year > 9999)
+			buf[n++] = '+';
+		n += int_in_slice(slice_left(s, n), year);
+	} else {
+		n += two_digits_in_slice(slice_left(s, n), year / 100);
+		n += two_digits_in_slice(slice_left(s, n), year % 100);
+	}
+	buf[n++] = '-';
+	n += two_digits_in_slice(slice_left(s, n), tm->tm_mon + 1);
+	buf[n++] = '-';
+	n += two_digits_in_slice(slice_left(s, n), tm->tm_mday);
+	buf[n++] = 'T';
+	n += two_digits_in_slice(slice_left(s, n), tm->tm_hour);
+	buf[n++] = ':';
+	n += two_digits_in_slice(slice_left(s, n), tm->tm_min);
+	buf[n++] = ':';
+	n += two_digits_in_slice(slice_left(s, n), tm->tm_sec);
+
+	return n;
+}
+
+/* 2023-11-04T17:47:03+03:00 */
+uint64 tm_iso8601_in_slice(slice s, const struct tm *tm)
+{
+	uint64 n;
+
+	n = tm_date_time_in_slice(s, tm);
+	n += offset_in_slice(slice_left(s, n), tm->tm_gmtoff, true);
+
+	return n;
+}
+
+/* 2023-11-04T14:47:03.250000Z, usec < 0 - whole seconds. RFC 3339 has
+ * four digit years only, other years and usec past a second give 0.
+ */
+uint64 tm_rfc3339_in_slice(slice s, const struct tm *tm, int usec)
+{
+	char *buf = s.base;
+	uint64 n;
+	int i;
+
+	if (tm->tm_year < -1900 || tm->tm_year > 9999 - 1900 || usec >= 1000000)
+		return 0;
+	n = tm_date_time_in_slice(s, tm);
+	if (usec >= 0) {
+		buf[n++] = '.';
+		for (i = 5; i >= 0; i--, usec /= 10)
+			buf[n + i] = '0' + usec % 10;
+		n += 6;
+	}
+	if (tm->tm_gmtoff == 0)
+		buf[n++] = 'Z';
+	else
+		n += offset_in_slice(slice_left(s, n), tm->tm_gmtoff, true);
 
 	return n;
 }
 
-/* 08.10.2023 15:13:54 MSK */
+/* 08.10.2023 15:13:54 MSK, the zone or +0300 */
 uint64 tm_in_slice(slice s, struct tm * tm)
 {
 	char *buf = s.base;
@@ -272,9 +321,7 @@ uint64 tm_in_slice(slice s, struct tm * tm)
 	n += int_in_slice(slice_left(s, n), tm->tm_sec);
 	buf[n++] = ' ';
 
-	buf[n++] = 'M';
-	buf[n++] = 'S';
-	buf[n++] = 'K';
+	n += zone_in_slice(slice_left(s, n), tm);
 
 	return n;
 }
@@ -300,9 +347,7 @@ uint64 tm_in_slice2(slice s, struct tm * tm)
 	n += int_in_slice(slice_left(s, n), tm->tm_sec);
 	buf[n++] = ' ';
 
-	buf[n++] = 'M';
-	buf[n++] = 'S';
-	buf[n++] = 'K';
+	n += zone_in_slice(slice_left(s, n), tm);
 
 	return n;
 }
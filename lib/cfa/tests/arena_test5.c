@@ -0,0 +1,41 @@
+#include "u.h"
+#include "builtin.h"
+#include "syscall.h"
+#include "fmt.h"
+#include "arena.h"
+
+/* Arenas backed by huge pages, prefaulted and locked are plain arenas to
+ * their users.
+ */
+static void fill(const char *name, int flags)
+{
+	arena a;
+	byte *p;
+	uint64 i;
+
+	arena_create_flags(&a, 600 * 1024, flags);
+	p = arena_alloc(&a, 600 * 1024);
+	for (i = 0; i < 600 * 1024; i++)
+		p[i] = i;
+	for (i = 0; i < 600 * 1024; i++)
+		if (p[i] != (byte) i) {
+			fmt_fprintf(stdout, "%s: bad byte at %d\n", name, (int) i);
+			sys_exit(1);
+		}
+	fmt_fprintf(stdout, "%s: %d bytes mapped\n", name, (int) a.buf_len);
+	if ((flags & arena_huge) && ((uintptr) a.buf & (2 * 1024 * 1024 - 1)) != 0) {
+		fmt_fprintf(stdout, "%s: not aligned to a huge page\n", name);
+		sys_exit(1);
+	}
+	sys_munmap((uintptr) a.buf, a.buf_len);
+}
+
+void _start(void)
+{
+	fill("plain", 0);
+	fill("prefault", arena_prefault);
+	fill("huge", arena_huge);
+	fill("huge prefault", arena_huge | arena_prefault);
+	fill("locked", arena_lock);
+	sys_exit(0);
+}
@@ -6,9 +6,10 @@
 
 void _start(void)
 {
-	slice s1, s2;
-	uint64 len;
+	slice s1, s2, s3;
+	uint64 len, i;
 	int *buf_s2;
+	void *first, *base_s3;
 
 	s1 = make(char, 16, 16);
 	s2 = make(int, 8, 8);
@@ -30,5 +31,17 @@ void _start(void)
 	len += c_string_in_slice(slice_left(s1, len), "\n");
 
 	print_string(stdout, get_string(slice_right(s1, len)));
+
+	/* Slices stay where they are while the arena grows past the first
+	 * commit, and the last one grows in place.
+	 */
+	first = s1.base;
+	for (i = 0; i < 64; i++)
+		s3 = make(char, 0, 64 * 1024);
+	base_s3 = s3.base;
+	s3 = grow_slice(s3, 1024 * 1024, 1);
+	((char *) s3.base)[1024 * 1024 - 1] = 1;
+	fmt_fprintf(stdout, "stable: %s, in place: %s\n", first == s1.base
+				&& memequal(first, "Hello world!\n", 13) ? "yes" : "no", base_s3 == s3.base ? "yes" : "no");
 	sys_exit(0);
 }
@@ -0,0 +1,103 @@
+#include "u.h"
+#include "builtin.h"
+#include "syscall.h"
+#include "fmt.h"
+#include "atomic.h"
+#include "arena.h"
+#include "executor.h"
+
+/* A tree of tasks: each splits in two until depth is 0, the leaves add
+ * to a sum. Spawned tasks land on the worker's own deque, the idle ones
+ * steal them.
+ */
+enum { depth = 12, batches = 1000, workers = 4 };
+
+typedef struct tree_t {
+	task t;
+	int depth;
+} tree;
+
+static executor *ex;
+static tree nodes[2 << depth];
+static uint64 next_node;
+static uint64 leaves;
+static uint64 done_calls;
+
+static void tree_run(task * t, exec_worker * w)
+{
+	tree *n = (tree *) t, *l, *r;
+	uint64 i;
+
+	if (n->depth == 0) {
+		atomic_fetch_add(&leaves, 1);
+		return;
+	}
+	i = atomic_fetch_add(&next_node, 2);
+	l = &nodes[i];
+	r = &nodes[i + 1];
+	l->t.run = r->t.run = tree_run;
+	l->t.done = r->t.done = nil;
+	l->depth = r->depth = n->depth - 1;
+	executor_spawn(ex, w, &l->t);
+	executor_spawn(ex, w, &r->t);
+}
+
+static void count_done(task * t)
+{
+	(void)t;
+	done_calls++;
+}
+
+static void nop(task * t, exec_worker * w)
+{
+	(void)t;
+	(void)w;
+}
+
+static task small[batches];
+
+void _start(void)
+{
+	const error *err;
+	uint64 steals = 0, runs = 0;
+	arena a;
+	int i;
+
+	/* Workers keep a pointer, the executor must not move. */
+	arena_create(&a, sizeof(executor));
+	ex = arena_alloc(&a, sizeof(executor));
+	err = executor_start(ex, workers);
+	if (err != nil) {
+		fmt_fprintf(stdout, "executor_start failed: %s\n", err->msg);
+		sys_exit(1);
+	}
+
+	nodes[0].t.run = tree_run;
+	nodes[0].t.done = nil;
+	nodes[0].depth = depth;
+	next_node = 1;
+	executor_submit(ex, &nodes[0].t);
+	while (atomic_load(&leaves) < (1 << depth))
+		sys_sched_yield();
+	fmt_fprintf(stdout, "tree: %d leaves\n", (int) atomic_load(&leaves));
+
+	/* More than a deque holds, the rest runs inline. Done callbacks run
+	 * here for every task.
+	 */
+	for (i = 0; i < batches; i++) {
+		small[i].run = nop;
+		small[i].done = count_done;
+		executor_submit(ex, &small[i]);
+	}
+	while (done_calls < batches)
+		executor_complete(ex);
+	fmt_fprintf(stdout, "done callbacks: %d\n", (int) done_calls);
+
+	executor_stop(ex);
+	for (i = 0; i < workers; i++) {
+		steals += ex->w[i].steals;
+		runs += ex->w[i].runs;
+	}
+	fmt_fprintf(stdout, "stopped: %s\n", runs + ex->inline_runs >= (2 << depth) - 1 + batches ? "all ran" : "lost");
+	sys_exit(0);
+}
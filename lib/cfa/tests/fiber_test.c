@@ -0,0 +1,147 @@
+#include "u.h"
+#include "builtin.h"
+#include "syscall.h"
+#include "fmt.h"
+#include "fiber.h"
+
+enum { rounds = 1000000, pairs = 50, stream_len = 512 * 1024, chunk = 4096, idle = 10000 };
+
+static fiber_sched s;
+static int sv[pairs][2];
+static uint64 received[pairs];
+static uint64 bad;
+static int64 rss_idle;
+
+static int64 now_ns(void)
+{
+	struct timespec ts;
+
+	sys_clock_gettime(clock_monotonic, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* Resident pages, the second field of /proc/self/statm. */
+static int64 resident_pages(void)
+{
+	char buf[128];
+	const error *err;
+	int64 n, i, pages = 0;
+	int fd;
+
+	fd = sys_open("/proc/self/statm", o_rdonly, 0, &err);
+	if (err != nil)
+		return 0;
+	n = sys_read(fd, buf, sizeof(buf), &err);
+	sys_close(fd);
+	for (i = 0; i < n && buf[i] != ' '; i++) ;
+	for (i++; i < n && buf[i] >= '0' && buf[i] <= '9'; i++)
+		pages = pages * 10 + buf[i] - '0';
+	return pages;
+}
+
+static void bounce(void *arg)
+{
+	int i;
+
+	(void)arg;
+	for (i = 0; i < rounds; i++)
+		fiber_yield(&s);
+}
+
+/* The writer fills the socket and parks on EPOLLOUT, the reader drains
+ * it and parks on EPOLLIN, both written as plain blocking loops.
+ */
+static void writer(void *arg)
+{
+	int p = (int) (uintptr) arg, i;
+	const error *err;
+	char buf[chunk];
+
+	for (i = 0; i < stream_len / chunk; i++) {
+		memset(buf, (p + i) & 0xff, chunk);
+		fiber_write(&s, sv[p][0], buf, chunk, &err);
+		if (err != nil)
+			bad++;
+	}
+	sys_close(sv[p][0]);
+}
+
+static void reader(void *arg)
+{
+	int p = (int) (uintptr) arg;
+	const error *err;
+	char buf[1000];
+	int64 n, i;
+
+	for (;;) {
+		n = fiber_read(&s, sv[p][1], buf, sizeof(buf), &err);
+		if (err != nil || n == 0)
+			break;
+		for (i = 0; i < n; i++)
+			if ((byte) buf[i] != (byte) ((p + (received[p] + i) / chunk) & 0xff))
+				bad++;
+		received[p] += n;
+	}
+	sys_close(sv[p][1]);
+}
+
+static void sleeper(void *arg)
+{
+	(void)arg;
+	fiber_yield(&s);
+}
+
+/* Runs after every sleeper has parked once. */
+static void measure(void *arg)
+{
+	rss_idle = resident_pages() - (int64) (uintptr) arg;
+}
+
+void _start(void)
+{
+	const error *err;
+	int64 start, base;
+	uint64 total = 0;
+	int i;
+
+	err = fiber_sched_init(&s, 0);
+	if (err != nil) {
+		fmt_fprintf(stdout, "fiber_sched_init failed: %s\n", err->msg);
+		sys_exit(1);
+	}
+
+	fiber_spawn(&s, bounce, nil, &err);
+	fiber_spawn(&s, bounce, nil, &err);
+	start = now_ns();
+	fiber_run(&s);
+	fmt_fprintf(stdout, "switches: %d\n", (int) s.switches);
+	fmt_fprintf(stdout, "yield and resume: %d ns\n", (int) ((now_ns() - start) / (int64) s.switches));
+
+	for (i = 0; i < pairs; i++) {
+		err = sys_socketpair(af_unix, sock_stream | sock_nonblock, 0, sv[i]);
+		if (err != nil) {
+			fmt_fprintf(stdout, "sys_socketpair failed: %s\n", err->msg);
+			sys_exit(1);
+		}
+		fiber_spawn(&s, writer, (void *)(uintptr) i, &err);
+		fiber_spawn(&s, reader, (void *)(uintptr) i, &err);
+	}
+	s.parks = 0;
+	fiber_run(&s);
+	for (i = 0; i < pairs; i++)
+		total += received[i];
+	fmt_fprintf(stdout, "streams: %d bytes, %d bad, parked: %s\n", (int) total, (int) bad,
+				s.parks > 0 ? "yes" : "no");
+
+	fiber_sched_close(&s);
+	fiber_sched_init(&s, 0);
+	base = resident_pages();
+	for (i = 0; i < idle; i++)
+		fiber_spawn(&s, sleeper, nil, &err);
+	fiber_spawn(&s, measure, (void *)(uintptr) base, &err);
+	fiber_run(&s);
+	fmt_fprintf(stdout, "idle fibers: %d, about %d bytes each\n", idle, (int) (rss_idle * 4096 / idle));
+	fiber_sched_close(&s);
+
+	sys_exit(0);
+}
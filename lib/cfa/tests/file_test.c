@@ -0,0 +1,59 @@
+#include "u.h"
+#include "builtin.h"
+#include "fmt.h"
+#include "syscall.h"
+
+static const char dir[] = "file_test.d";
+static const char path[] = "file_test.d/data";
+static const char text[] = "first line\nsecond line\ntorn li";
+
+void _start(void)
+{
+	char dbuf[1024];
+	struct dirent64 *d;
+	const error *err;
+	int64 n, i, size;
+	int fd;
+
+	err = sys_mkdir(dir, 0755);
+	if (err != nil && err->code != EEXIST) {
+		fmt_fprintf(stderr, "sys_mkdir failed: %s\n", err->msg);
+		sys_exit(1);
+	}
+
+	fd = sys_open(path, o_rdwr | o_creat | o_trunc | o_append, 0644, &err);
+	if (err != nil) {
+		fmt_fprintf(stderr, "sys_open failed: %s\n", err->msg);
+		sys_exit(1);
+	}
+
+	sys_write(fd, text, sizeof(text) - 1, nil);
+	err = sys_fsync(fd);
+	if (err != nil)
+		fmt_fprintf(stderr, "sys_fsync failed: %s\n", err->msg);
+
+	size = sys_lseek(fd, 0, seek_end, nil);
+	fmt_fprintf(stdout, "size after write: %d\n", size);
+
+	/* cut the torn line */
+	err = sys_ftruncate(fd, size - 7);
+	if (err != nil)
+		fmt_fprintf(stderr, "sys_ftruncate failed: %s\n", err->msg);
+	fmt_fprintf(stdout, "size after ftruncate: %d\n", sys_lseek(fd, 0, seek_end, nil));
+	sys_close(fd);
+
+	fd = sys_open(dir, o_rdonly | o_directory, 0, &err);
+	if (err != nil) {
+		fmt_fprintf(stderr, "sys_open (dir) failed: %s\n", err->msg);
+		sys_exit(1);
+	}
+
+	n = sys_getdents64(fd, dbuf, sizeof(dbuf), &err);
+	for (i = 0; i < n; i += d->d_reclen) {
+		d = (struct dirent64 *) (dbuf + i);
+		fmt_fprintf(stdout, "entry: %s\n", d->d_name);
+	}
+	sys_close(fd);
+
+	sys_exit(0);
+}
@@ -0,0 +1,79 @@
+#include "u.h"
+#include "builtin.h"
+#include "syscall.h"
+#include "fmt.h"
+#include "lz.h"
+
+enum { max_input = 65536 };
+
+static lz_table table;
+static byte input[max_input];
+static byte packed[max_input + max_input / 255 + 16];
+static byte unpacked[max_input];
+
+/* Compresses and decompresses n bytes of input, prints the sizes. */
+static void round_trip(const char *name, uint64 n)
+{
+	uint64 c;
+	int64 d;
+
+	c = lz_compress(&table, input, n, packed);
+	d = lz_decompress(packed, c, unpacked, n);
+	if (d != (int64) n || !memequal(input, unpacked, n)) {
+		fmt_fprintf(stdout, "%s: round trip of %d bytes failed\n", name, (int) n);
+		sys_exit(1);
+	}
+	fmt_fprintf(stdout, "%s: %d -> %d bytes\n", name, (int) n, (int) c);
+}
+
+void _start(void)
+{
+	const char *line = "alice (12:00:00 MSK): hello everyone in the lobby\n";
+	uint64 i, n, len, seed = 1;
+	int64 d;
+
+	lz_init(&table);
+
+	round_trip("empty", 0);
+
+	memcpy(input, "short", 5);
+	round_trip("short", 5);
+
+	for (i = 0; i < 1000; i++)
+		input[i] = 'a';
+	round_trip("run", 1000);
+
+	len = c_strlen(line);
+	for (n = 0; n + len <= 16384; n += len)
+		memcpy(input + n, line, len);
+	round_trip("chat", n);
+
+	/* Random bytes don't compress, the output grows within lz_bound. */
+	for (i = 0; i < max_input; i++) {
+		seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+		input[i] = seed >> 56;
+	}
+	round_trip("random", max_input);
+	if (lz_compress(&table, input, max_input, packed) > lz_bound(max_input)) {
+		fmt_fprintf(stdout, "random: bound exceeded\n");
+		sys_exit(1);
+	}
+
+	/* Truncated and corrupted blocks are rejected, not overrun. */
+	for (n = 0; n + len <= 4096; n += len)
+		memcpy(input + n, line, len);
+	i = lz_compress(&table, input, n, packed);
+	d = lz_decompress(packed, i - 3, unpacked, n);
+	fmt_fprintf(stdout, "truncated: %d\n", (int) d);
+	d = lz_decompress(packed, i, unpacked, n / 2);
+	fmt_fprintf(stdout, "too small: %d\n", (int) d);
+	/* One literal, then a match 5 bytes back. */
+	packed[0] = 0x10;
+	packed[1] = 'a';
+	packed[2] = 5;
+	packed[3] = 0;
+	d = lz_decompress(packed, 4, unpacked, n);
+	fmt_fprintf(stdout, "bad offset: %d\n", (int) d);
+
+	sys_exit(0);
+}
@@ -38,5 +38,9 @@ void _start(void)
 	pool_put(&p, a);
 	pool_put(&p, b);
 
+	a = pool_get(&p);
+	fmt_fprintf(stdout, "allocs: %d\nfrees: %d\nin use: %d\nhigh: %d\ncommitted: %d\n", (int) p.st.allocs,
+				(int) p.st.frees, (int) p.st.in_use, (int) p.st.high, (int) p.st.committed);
+
 	sys_exit(0);
 }
@@ -0,0 +1,79 @@
+#include "u.h"
+#include "builtin.h"
+#include "syscall.h"
+#include "fmt.h"
+#include "atomic.h"
+#include "thread.h"
+#include "ring.h"
+
+enum { items = 1000000, producers = 4, cap = 1024 };
+
+static void *slots[cap];
+static mpsc_cell cells[cap];
+static spsc_ring sr;
+static mpsc_ring mr;
+
+/* Values are 1 based, so none of them is nil. */
+static void spsc_producer(void *arg)
+{
+	uint64 i;
+
+	(void)arg;
+	for (i = 1; i <= items; i++)
+		while (!spsc_push(&sr, (void *)i))
+			sys_sched_yield();
+}
+
+/* Producer number in the high bits, its own sequence in the low ones. */
+static void mpsc_producer(void *arg)
+{
+	uint64 p = (uint64) arg, i;
+
+	for (i = 1; i <= items / producers; i++)
+		while (!mpsc_push(&mr, (void *)(p << 32 | i)))
+			sys_sched_yield();
+}
+
+void _start(void)
+{
+	uint64 next[producers], i, v, p, bad = 0, sum = 0;
+	thread t[producers];
+	void *x;
+
+	spsc_init(&sr, slots, cap);
+	thread_create(&t[0], spsc_producer, nil, 0);
+	for (i = 1; i <= items; i++) {
+		while (!spsc_pop(&sr, &x))
+			sys_sched_yield();
+		if ((uint64) x != i)
+			bad++;
+	}
+	thread_join(&t[0]);
+	fmt_fprintf(stdout, "spsc: %d items, %d out of order\n", items, (int) bad);
+
+	mpsc_init(&mr, cells, cap);
+	for (p = 0; p < producers; p++) {
+		next[p] = 1;
+		thread_create(&t[p], mpsc_producer, (void *)p, 0);
+	}
+	bad = 0;
+	for (i = 0; i < items; i++) {
+		while (!mpsc_pop(&mr, &x))
+			sys_sched_yield();
+		v = (uint64) x;
+		p = v >> 32;
+		/* Each producer's values come in its own order. */
+		if (p >= producers || (v & 0xffffffff) != next[p])
+			bad++;
+		else
+			next[p]++;
+		sum += v & 0xffffffff;
+	}
+	for (p = 0; p < producers; p++)
+		thread_join(&t[p]);
+	fmt_fprintf(stdout, "mpsc: %d items from %d producers, %d out of order, sum %s\n", items, producers, (int) bad,
+				sum == (uint64) producers * (items / producers) * (items / producers + 1) / 2 ? "ok" : "wrong");
+	fmt_fprintf(stdout, "empty: %s\n", !spsc_pop(&sr, &x) && !mpsc_pop(&mr, &x) ? "yes" : "no");
+
+	sys_exit(0);
+}
@@ -0,0 +1,118 @@
+#include "u.h"
+#include "builtin.h"
+#include "syscall.h"
+#include "fmt.h"
+#include "pool.h"
+#include "arena.h"
+#include "slab.h"
+
+/* Allocation costs of the pool, the arena and the slab allocator, in
+ * nanoseconds per allocation and free.
+ */
+enum { batch = 1000, rounds = 2000, obj_size = 64 };
+
+static byte pool_buf[batch * obj_size + obj_size];
+static void *obj[batch];
+static pool p;
+static arena a;
+static slab s;
+static slab_cache cache;
+
+static int64 now_ns(void)
+{
+	struct timespec ts;
+
+	sys_clock_gettime(clock_monotonic, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void report(const char *name, int64 start)
+{
+	int64 ns = now_ns() - start;
+
+	fmt_fprintf(stdout, "%s: %d.%d ns/op\n", name, (int) (ns / (batch * rounds)),
+				(int) (ns * 10 / (batch * rounds) % 10));
+}
+
+/* Sizes of 16 to 1024 bytes, the same sequence every round. */
+static uint64 mixed_size(uint64 i)
+{
+	return 16 + (i * 2654435761U) % 1009;
+}
+
+void _start(void)
+{
+	int64 start;
+	uint64 r, i;
+
+	pool_init(&p, pool_buf, sizeof(pool_buf), obj_size, 16);
+	start = now_ns();
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < batch; i++)
+			obj[i] = pool_get(&p);
+		for (i = 0; i < batch; i++)
+			pool_put(&p, obj[i]);
+	}
+	report("pool, 64 bytes", start);
+
+	/* The arena frees all at once only. */
+	arena_create(&a, batch * 1024 * 2);
+	start = now_ns();
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < batch; i++)
+			obj[i] = arena_alloc(&a, obj_size);
+		arena_free_all(&a);
+	}
+	report("arena, 64 bytes", start);
+
+	start = now_ns();
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < batch; i++)
+			obj[i] = arena_alloc(&a, mixed_size(i));
+		arena_free_all(&a);
+	}
+	report("arena, mixed", start);
+
+	slab_init(&s, false);
+	start = now_ns();
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < batch; i++)
+			obj[i] = slab_alloc(&s, obj_size);
+		for (i = 0; i < batch; i++)
+			slab_free(&s, obj[i]);
+	}
+	report("slab, 64 bytes", start);
+
+	start = now_ns();
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < batch; i++)
+			obj[i] = slab_alloc(&s, mixed_size(i));
+		for (i = 0; i < batch; i++)
+			slab_free(&s, obj[i]);
+	}
+	report("slab, mixed", start);
+
+	slab_trim(&s);
+	slab_init(&s, true);
+	slab_cache_init(&cache, &s);
+	start = now_ns();
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < batch; i++)
+			obj[i] = slab_cache_alloc(&cache, obj_size);
+		for (i = 0; i < batch; i++)
+			slab_cache_free(&cache, obj[i]);
+	}
+	report("slab cache, 64 bytes", start);
+
+	start = now_ns();
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < batch; i++)
+			obj[i] = slab_cache_alloc(&cache, mixed_size(i));
+		for (i = 0; i < batch; i++)
+			slab_cache_free(&cache, obj[i]);
+	}
+	report("slab cache, mixed", start);
+	slab_cache_flush(&cache);
+
+	sys_exit(0);
+}
@@ -0,0 +1,101 @@
+#include "u.h"
+#include "builtin.h"
+#include "syscall.h"
+#include "fmt.h"
+#include "slab.h"
+
+enum { objc = 5000 };
+
+static slab s;
+static slab_cache cache;
+static byte *obj[objc];
+
+static void fail(const char *what)
+{
+	fmt_fprintf(stdout, "%s failed\n", what);
+	sys_exit(1);
+}
+
+/* Allocates objc objects of size bytes, fills each with its own byte,
+ * checks none got overwritten by a neighbour and frees them.
+ */
+static void fill_check(uint64 size)
+{
+	uint64 i, j;
+
+	for (i = 0; i < objc; i++) {
+		obj[i] = slab_alloc(&s, size);
+		if (obj[i] == nil || ((uintptr) obj[i] & (slab_align - 1)))
+			fail("alloc");
+		if (slab_usable_size(obj[i]) < size)
+			fail("usable size");
+		memset(obj[i], i & 0xff, size);
+	}
+	for (i = 0; i < objc; i++)
+		for (j = 0; j < size; j++)
+			if (obj[i][j] != (byte) (i & 0xff))
+				fail("overlap");
+	/* Every other one first, so slabs go empty in the second pass. */
+	for (i = 0; i < objc; i += 2)
+		slab_free(&s, obj[i]);
+	for (i = 1; i < objc; i += 2)
+		slab_free(&s, obj[i]);
+}
+
+void _start(void)
+{
+	uint64 sizes[] = { 1, 16, 17, 33, 48, 100, 255, 1000, 2049, 4096 };
+	uint64 i, base;
+	byte *big;
+
+	slab_init(&s, false);
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		obj[0] = slab_alloc(&s, sizes[i]);
+		fmt_fprintf(stdout, "size %d: class %d\n", (int) sizes[i], (int) slab_usable_size(obj[0]));
+		slab_free(&s, obj[0]);
+	}
+
+	/* A few empty slabs stay per class, the rest goes back to the OS. */
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+		fill_check(sizes[i]);
+	fmt_fprintf(stdout, "mapped after fill: %d slabs\n", (int) (s.st.committed / slab_size));
+	slab_trim(&s);
+	fmt_fprintf(stdout, "mapped after trim: %d slabs\n", (int) (s.st.committed / slab_size));
+	fmt_fprintf(stdout, "allocs %d, frees %d, in use %d, high %d\n", (int) s.st.allocs, (int) s.st.frees,
+				(int) s.st.in_use, (int) s.st.high);
+
+	/* Freed objects are reused. */
+	obj[0] = slab_alloc(&s, 64);
+	slab_free(&s, obj[0]);
+	obj[1] = slab_alloc(&s, 64);
+	fmt_fprintf(stdout, "reuse: %s\n", obj[0] == obj[1] ? "yes" : "no");
+	slab_free(&s, obj[1]);
+
+	/* Big objects get pages of their own and give them back on free. */
+	base = s.st.committed;
+	big = slab_alloc(&s, 100000);
+	memset(big, 1, 100000);
+	fmt_fprintf(stdout, "big: %d usable, %d mapped\n", (int) slab_usable_size(big), (int) (s.st.committed - base));
+	slab_free(&s, big);
+	fmt_fprintf(stdout, "big freed: %d mapped\n", (int) (s.st.committed - base));
+
+	/* A cache keeps at most slab_cache_len objects a class and gives all
+	 * back on flush.
+	 */
+	slab_init(&s, true);
+	slab_cache_init(&cache, &s);
+	for (i = 0; i < objc; i++) {
+		obj[i] = slab_cache_alloc(&cache, 200);
+		memset(obj[i], 7, 200);
+	}
+	for (i = 0; i < objc; i++)
+		slab_cache_free(&cache, obj[i]);
+	fmt_fprintf(stdout, "cache: %d cached\n", (int) cache.n[7]);
+	slab_cache_flush(&cache);
+	fmt_fprintf(stdout, "cache flushed: %d cached, %d slabs mapped\n", (int) cache.n[7],
+				(int) (s.st.committed / slab_size));
+	slab_trim(&s);
+
+	sys_exit(0);
+}
@@ -0,0 +1,87 @@
+#include "u.h"
+#include "builtin.h"
+#include "syscall.h"
+#include "fmt.h"
+#include "atomic.h"
+#include "sync.h"
+#include "thread.h"
+
+enum { threads = 4, increments = 200000, rounds = 20000 };
+
+static mutex m;
+static cond c;
+static uint64 locked_count;
+static uint64 atomic_count;
+static int turn;
+
+static void count(void *arg)
+{
+	int i;
+
+	(void)arg;
+	for (i = 0; i < increments; i++) {
+		mutex_lock(&m);
+		locked_count++;
+		mutex_unlock(&m);
+		atomic_fetch_add(&atomic_count, 1);
+	}
+}
+
+/* Two threads hand a turn back and forth through one condition. */
+static void ping_pong(void *arg)
+{
+	int me = (int) (uintptr) arg, i;
+
+	for (i = 0; i < rounds; i++) {
+		mutex_lock(&m);
+		while (turn != me)
+			cond_wait(&c, &m);
+		turn = !me;
+		cond_broadcast(&c);
+		mutex_unlock(&m);
+	}
+}
+
+static void overflow(void *arg)
+{
+	byte buf[1024];
+
+	memset(buf, 1, sizeof(buf));
+	(void)arg;
+}
+
+void _start(void)
+{
+	thread t[threads];
+	const error *err;
+	int i;
+
+	mutex_init(&m);
+	cond_init(&c);
+
+	for (i = 0; i < threads; i++) {
+		err = thread_create(&t[i], count, nil, 0);
+		if (err != nil) {
+			fmt_fprintf(stdout, "thread_create failed: %s\n", err->msg);
+			sys_exit(1);
+		}
+	}
+	for (i = 0; i < threads; i++)
+		thread_join(&t[i]);
+	fmt_fprintf(stdout, "mutex: %d of %d\n", (int) locked_count, threads * increments);
+	fmt_fprintf(stdout, "atomic: %d of %d\n", (int) atomic_count, threads * increments);
+
+	turn = 0;
+	thread_create(&t[0], ping_pong, (void *)0, 0);
+	thread_create(&t[1], ping_pong, (void *)1, 0);
+	thread_join(&t[0]);
+	thread_join(&t[1]);
+	fmt_fprintf(stdout, "ping pong: %d rounds\n", rounds);
+
+	/* Small stacks are fine as long as they hold what runs on them. */
+	thread_create(&t[0], overflow, nil, 4096 * 2);
+	thread_join(&t[0]);
+	fmt_fprintf(stdout, "small stack: ok\n");
+
+	sys_exit(0);
+}
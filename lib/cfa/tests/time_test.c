@@ -4,13 +4,151 @@
 #include "fmt.h"
 #include "syscall.h"
 
+enum {
+	day_secs = 86400,
+	/* 1601-01-01 00:00 MSK, the old conversion starts there. */
+	first_day = -134774,
+	/* 9999-12-31, the last day with a four digit year. */
+	last_day = 2932896,
+	random_samples = 10000000,
+	bench_rounds = 10000000
+};
+
+static const int days_since_jan_1st[][13] = {
+	{0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334, 365},	/* non-leap year. */
+	{0, 31, 60, 91, 121, 152, 182, 213, 244, 274, 305, 335, 366},	/* leap year. */
+};
+
+/* The conversion time_to_tm used to do: from 1601 on, by 400, 100, 4
+ * and 1 years, then a search for the month. Not inlined, so that the
+ * benchmark compares two calls.
+ */
+__attribute__ ((noinline))
+static struct tm time_to_tm_divs(int64 t)
+{
+	int64 quadricentennials, centennials, quadrennials, annuals;
+	int64 yday, mday, wday;
+	int64 year, month, leap;
+	int64 sec;
+	struct tm tm_time;
+
+	t += 3 * 60 * 60;
+	sec = t + 11644473600;
+	wday = (sec / 86400 + 1) % 7;
+
+	quadricentennials = sec / 12622780800;
+	sec %= 12622780800;
+	centennials = sec / 3155673600;
+	if (centennials > 3)
+		centennials = 3;
+	sec -= centennials * 3155673600;
+	quadrennials = sec / 126230400;
+	if (quadrennials > 24)
+		quadrennials = 24;
+	sec -= quadrennials * 126230400;
+	annuals = sec / 31536000;
+	if (annuals > 3)
+		annuals = 3;
+	sec -= annuals * 31536000;
+
+	year = 1601 + quadricentennials * 400 + centennials * 100 + quadrennials * 4 + annuals;
+	leap = (year % 4 == 0) && ((year % 100 != 0) || (year % 400 == 0));
+
+	yday = sec / 86400;
+	sec %= 86400;
+	tm_time.tm_hour = sec / 3600;
+	sec %= 3600;
+	tm_time.tm_min = sec / 60;
+	tm_time.tm_sec = sec % 60;
+
+	for (month = 1, mday = 1; month <= 12; month++) {
+		if (yday < days_since_jan_1st[leap][month]) {
+			mday += yday - days_since_jan_1st[leap][month - 1];
+			break;
+		}
+	}
+
+	tm_time.tm_mday = mday;
+	tm_time.tm_mon = month - 1;
+	tm_time.tm_year = year - 1900;
+	tm_time.tm_wday = wday;
+	tm_time.tm_yday = yday;
+	tm_time.tm_isdst = -1;
+	tm_time.tm_gmtoff = 3 * 60 * 60;
+	tm_time.tm_zone = nil;
+
+	return tm_time;
+}
+
+static int tm_differ(const struct tm *a, const struct tm *b)
+{
+	return a->tm_sec != b->tm_sec || a->tm_min != b->tm_min || a->tm_hour != b->tm_hour
+		|| a->tm_mday != b->tm_mday || a->tm_mon != b->tm_mon || a->tm_year != b->tm_year
+		|| a->tm_wday != b->tm_wday || a->tm_yday != b->tm_yday || a->tm_isdst != b->tm_isdst
+		|| a->tm_gmtoff != b->tm_gmtoff;
+}
+
+static uint64 bad;
+
+static void check(int64 t)
+{
+	struct tm want = time_to_tm_divs(t), got = time_to_tm(t);
+	char buf[64];
+	uint64 n;
+
+	if (!tm_differ(&want, &got))
+		return;
+	if (bad++ < 10) {
+		n = tm_iso8601_in_slice(unsafe_slice(buf, sizeof(buf)), &got);
+		buf[n] = '\0';
+		fmt_fprintf(stdout, "mismatch at %l: got %s\n", t, buf);
+	}
+}
+
+static int64 now_ns(void)
+{
+	struct timespec ts;
+
+	sys_clock_gettime(clock_monotonic, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static uint64 rnd_state = 88172645463325252UL;
+
+static uint64 rnd(void)
+{
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 7;
+	rnd_state ^= rnd_state << 17;
+	return rnd_state;
+}
+
+static void print_formats(int64 t, const char *zone)
+{
+	const time_zone *z = time_zone_find(zone, c_strlen(zone));
+	struct tm tm = time_to_tm_zone(t, z);
+	char buf[128];
+	slice s = unsafe_slice(buf, sizeof(buf));
+	uint64 n;
+
+	n = tm_iso8601_in_slice(s, &tm);
+	n += c_string_in_slice(slice_left(s, n), "  ");
+	n += tm_rfc3339_in_slice(slice_left(s, n), &tm, 250000);
+	n += c_string_in_slice(slice_left(s, n), "  ");
+	n += tm_rfc822_in_slice(slice_left(s, n), &tm);
+	buf[n] = '\0';
+	fmt_fprintf(stdout, "%l %s: %s\n", t, zone, buf);
+}
+
 void _start(void)
 {
 	struct timespec tp;
 	struct tm tm_time;
 	slice s;
-	uint64 len;
+	uint64 len, checked = 0, sum = 0;
 	const error *err;
+	int64 day, t, start, old_ns, new_ns, span;
+	int i;
 
 	err = sys_clock_gettime(clock_realtime, &tp);
 	if (err != nil) {
@@ -64,7 +202,47 @@ void _start(void)
 	len += tm_rfc822_in_slice(slice_left(s, len), &tm_time);
 	len += c_string_in_slice(slice_left(s, len), "\n\nTime in tm2 format: ");
 	len += tm_in_slice(slice_left(s, len), &tm_time);
-	len += c_string_in_slice(slice_left(s, len), "\n");
+	len += c_string_in_slice(slice_left(s, len), "\n\nTime in ISO 8601 format: ");
+	len += tm_iso8601_in_slice(slice_left(s, len), &tm_time);
+	len += c_string_in_slice(slice_left(s, len), "\n\n");
 	print_string(stdout, get_string(slice_right(s, len)));
-	sys_exit(0);
+
+	print_formats(0, "UTC");
+	print_formats(951782400, "MSK");
+	print_formats(-11644473600, "UTC");
+	print_formats(253402300799, "UTC");
+	print_formats(1700000000, "PST");
+	print_formats(1700000000, "IST");
+	print_formats((int64) time_min_days * day_secs, "UTC");
+	print_formats((int64) time_max_days * day_secs + day_secs - 1, "UTC");
+	print_formats(-0x7fffffffffffffffL, "MSK");
+	print_formats(0x7fffffffffffffffL, "PST");
+
+	/* Every day the old conversion and four digit years cover, each at
+	 * another time of day, then every second of two days around a leap
+	 * day and random times up to the end of the range.
+	 */
+	for (day = first_day; day <= last_day; day++, checked++)
+		check(day * day_secs + ((day - first_day) * 7919 + 1) % day_secs);
+	for (t = 951696000 - 12 * 3600; t < 951868800 - 12 * 3600; t++, checked++)
+		check(t);
+	span = (time_max_days - first_day) * (uint64) day_secs;
+	for (i = 0; i < random_samples; i++, checked++)
+		check((int64) first_day * day_secs + (int64) (rnd() % span));
+	fmt_fprintf(stdout, "checked against the old conversion: %l times, %l bad\n", checked, bad);
+
+	/* Present-day times, as the chat converts them. */
+	start = now_ns();
+	for (i = 0; i < bench_rounds; i++)
+		sum += time_to_tm_divs(1700000000 + i * 997L).tm_mday;
+	old_ns = now_ns() - start;
+	start = now_ns();
+	for (i = 0; i < bench_rounds; i++)
+		sum -= time_to_tm(1700000000 + i * 997L).tm_mday;
+	new_ns = now_ns() - start;
+	fmt_fprintf(stdout, "divisions and search: %d ns, affine functions: %d ns, %d.%d times faster%s\n",
+				(int) (old_ns / bench_rounds), (int) (new_ns / bench_rounds), (int) (old_ns / new_ns),
+				(int) (old_ns * 10 / new_ns % 10), sum == 0 ? "" : ", results differ");
+
+	sys_exit(bad == 0 ? 0 : 1);
 }
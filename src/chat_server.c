@@ -7,52 +7,539 @@
 #include "time.h"
 #include "pool.h"
 #include "arena.h"
+#include "iovec.h"
+#include "lz.h"
+#include "executor.h"
 
 static const char welcome_msg[] = "Welcome to the chat, you are known as ";
 static const char entered_msg[] = " has entered the chat\n";
 static const char left_msg[] = " has left the chat\n";
+static const char users_joined_msg[] = " users joined, ";
+static const char users_left_msg[] = " left\n";
 static const char too_long_msg[] = "Line too long! Good bye...\n";
 static const char too_long_name[] = "Name too long! Good bye...\n";
 static const char limit_conn_msg[] = "Connection limit reached, rejecting client\n";
+static const char joined_msg[] = " has joined ";
+static const char parted_msg[] = " has left ";
+static const char no_room_msg[] = "You are not in any room, use /join #room\n";
+static const char bad_room_msg[] = "Room names start with '#' and are at most 31 bytes\n";
+static const char not_member_msg[] = "You are not in that room\n";
+static const char too_many_rooms_msg[] = "You are in too many rooms, /part one first\n";
+static const char room_limit_msg[] = "Room limit reached\n";
+static const char unknown_cmd_msg[] = "Unknown command, try /join, /part, /msg, /who, /history or /compress\n";
+static const char name_taken_msg[] = "Name is taken, try another: ";
+static const char no_user_msg[] = "No such user\n";
+static const char msg_usage_msg[] = "Usage: /msg name text\n";
+static const char private_msg[] = "[private] ";
+static const char who_end_msg[] = "End of /who, users: ";
+static const char history_end_msg[] = "End of /history, offset: ";
+static const char history_usage_msg[] = "Usage: /history [lines] or /history since offset\n";
+static const char history_off_msg[] = "History is not available here\n";
+static const char history_busy_msg[] = "Output is pending, try /history later\n";
+static const char compress_msg[] = "Compression on, LZ4 frames follow\n";
+static const char bad_name_msg[] = "Names can't be empty or start with '#', try another: ";
+static const char bad_hello_msg[] = "Names are 1 to 31 bytes without line breaks and can't start with '#'\n";
+static const char hello_first_msg[] = "Send a hello frame with your name first\n";
+static const char named_msg[] = "You have a name already\n";
+static const char bad_frame_msg[] = "Bad frame! Good bye...\n";
+static const char compress_bin_msg[] = "Compression is for the line protocol only\n";
+static const char bye_msg[] = "Server is going down, reconnect in ";
+static const char bin_magic[] = { '\0', 'C', 'B', '1' };
+static const char lobby_name[] = "#lobby";
+static const char log_dir[] = "chat_log";
+static const char log_suffix[] = ".log";
+static const char handoff_arg[] = "--handoff";
+static const char workers_arg[] = "--workers";
+static const char spin_arg[] = "--spin";
+static const char busy_poll_arg[] = "--busy-poll";
+static const char unix_arg[] = "--unix";
+static const char huge_pages_arg[] = "--huge-pages";
+static const char prefault_arg[] = "--prefault";
+static const char mlock_arg[] = "--mlock";
+static const char exec_arg[] = "--exec-threads";
+static const char port_arg[] = "--port";
+static const char backlog_arg[] = "--backlog";
+static const char line_len_arg[] = "--line-len";
+static const char events_arg[] = "--events";
+static const char pool_clients_arg[] = "--pool-clients";
+static const char pools_arg[] = "--pools";
+static const char out_mb_arg[] = "--out-mb";
+static const char mem_mb_arg[] = "--mem-mb";
+static const char self_exe[] = "/proc/self/exe";
 
 enum {
-	backlog = 128,
 	page_size = 4096,
-	max_line_len = 512,
+	/* Limits set at startup, see limits, are this by default. */
+	default_port = 7070,
+	default_backlog = 128,
+	default_line_len = 512,
+	default_events = 16,
+	default_pool_clients = 1023,
+	default_pools = 16,
+	default_out_mb = 64,
+	/* Longest line any configuration takes. Rendered, with the room,
+	 * the name and the time in front, it fits a zblock_size batch.
+	 */
+	max_line_len = 16384 - 128,
+	min_line_len = 64,
 	max_name_len = 32,
-	max_events = 16,
-	max_clients_in_pool = 1023,
-	max_pools = 16
+	/* The events array starts at limits.events and doubles when a batch
+	 * fills it.
+	 */
+	max_events_cap = 4096,
+	max_pool_clients = 65536,
+	max_pools = 4096,
+	/* Clients of all pools and workers, it bounds the name indexes. */
+	max_clients = 1024 * 1024,
+	max_mem_mb = 1024 * 1024,
+	max_rooms = 1024,
+	max_room_name_len = 32,
+	max_joined_rooms = 8,
+	/* The name index of each process and the one the workers share are
+	 * sized at startup, see limits.
+	 */
+	min_name_slots = 1024,
+	out_seg_size = 4096,
+	segs_in_pool = 256,
+	who_chunk = 1024,
+	/* Most buffers session_writev takes for one binary frame. */
+	max_write_iov = 3,
+	/* Lobby lines replayed to new clients and bytes to keep them in. */
+	history_len = 64,
+	history_size = 65536,
+	/* Log segments are named after the log offset of their first byte. */
+	log_segment_size = 64 * 1024 * 1024,
+	log_offset_digits = 20,
+	log_buf_size = 65536,
+	/* Group commit: fsync when this many bytes are written but not
+	 * synced, or log_sync_ms after the first of them, what comes first.
+	 */
+	log_sync_bytes = 1024 * 1024,
+	log_sync_ms = 50,
+	/* Lines of the log whose offsets are kept for /history. */
+	log_index_len = 65536,
+	/* Compressed clients: most data per frame, room for the frame header
+	 * and rooms whose lines are batched in one loop iteration.
+	 */
+	zblock_size = 16384,
+	zframe_header = 8,
+	max_zbatches = 16,
+	/* Joins and leaves go out in digests, the first presence_names of
+	 * them by name, the rest counted. While churn is low a digest goes
+	 * out at the end of the loop iteration, each digest with more events
+	 * doubles the interval between digests up to presence_max_ms, each
+	 * with fewer halves it.
+	 */
+	presence_names = 8,
+	presence_min_ms = 100,
+	presence_max_ms = 5000,
+	/* Lines worth of bytes read from one client per loop iteration. A
+	 * client with more goes on the ready list and gets its next turn
+	 * after everyone else had theirs.
+	 */
+	read_budget_lines = 8,
+	/* Shutdown on SIGTERM or SIGINT: clients get a goodbye with a
+	 * reconnect hint spread over drain_spread_s seconds, those whose
+	 * output went out are closed drain_batch at a time every
+	 * drain_batch_ms, the rest after drain_ms. Workers get drain_kill_ms
+	 * more before the master kills them.
+	 */
+	drain_ms = 5000,
+	drain_batch = 256,
+	drain_batch_ms = 20,
+	drain_retry_s = 1,
+	drain_spread_s = 30,
+	drain_kill_ms = 2000,
+	/* Hot restart: wire format and how long to wait for the successor. */
+	handoff_magic = 0x63686174,
+	handoff_version = 6,
+	max_restart_args = 64,
+	handoff_timeout_s = 5,
+	/* Pre-fork mode: workers and the ring they share their lines over. */
+	max_workers = 64,
+	bus_cells = 8192,
+	bus_cell_size = 1024
 };
 
+struct room_t;
+
+/* Position of the client in the member array of one of its rooms. */
+typedef struct membership_t {
+	struct room_t *r;
+	int idx;
+} membership;
+
+/* Piece of pending output of a client: bytes of data or, when fd isn't
+ * -1, bytes of a log segment from file_off on, which go out with
+ * sendfile and never pass through user space.
+ */
+typedef struct out_seg_t {
+	struct out_seg_t *next;
+	uint64 file_off;
+	uint32 head;
+	uint32 tail;
+	int fd;
+	char data[out_seg_size - sizeof(void *) - sizeof(uint64) - 2 * sizeof(uint32) - sizeof(int)];
+} out_seg;
+
+/* Binary protocol. A client that sends bin_magic instead of its name
+ * gets bin_magic back and talks in frames from then on: a header in the
+ * byte order of the machine, little-endian, and len bytes of payload.
+ * A bin_line of a client carries the text only and goes to its current
+ * room, commands included.
+ */
+enum {
+	bin_hello = 1,				/* client: the name */
+	bin_welcome,				/* server: the name, sender is the id of the client */
+	bin_line,					/* room name, sender name and text of a room line */
+	bin_text,					/* server: notices, replies and history as text */
+	bin_error,					/* server: what went wrong */
+	bin_bye						/* server: going down, sender is seconds to wait before reconnecting */
+};
+
+typedef struct bin_hdr_t {
+	uint32 len;
+	uint16 type;
+	uint8 room_len;				/* bin_line: bytes of the room name */
+	uint8 name_len;				/* bin_line: bytes of the sender name */
+	uint32 sender;				/* client id, 0 - the server */
+	uint32 reserved;
+	int64 time_us;				/* realtime, 0 - not timed */
+} bin_hdr;
+
 typedef struct client_t {
 	int fd;
 	int buf_used;
-	char buf[max_line_len];
+	char *buf;					/* limits.line_len bytes, right after the client */
 	char name[max_name_len];
 	int name_used;
 	int name_ok;
+	uint64 name_hash;
+	int n_rooms;
+	struct room_t *cur_room;	/* where plain lines go */
+	membership rooms[max_joined_rooms];
+	out_seg *out_head;
+	out_seg *out_tail;
+	uint64 out_len;
+	int who_pos;				/* next slot of /who listing, -1 - none */
+	int closing;
+	int compress;				/* output goes in LZ4 frames */
+	int binary;					/* speaks frames, see bin_hdr */
+	uint32 id;
+	int ready;					/* on the ready list */
+	struct client_t *ready_prev;
+	struct client_t *ready_next;
 	struct client_t *next;
 } client;
 
+/* Back reference from the member array into client->rooms, so that
+ * both sides can be swap-removed in O(1).
+ */
+typedef struct room_member_t {
+	client *c;
+	int slot;
+} room_member;
+
+typedef struct room_t {
+	char name[max_room_name_len];
+	int name_len;				/* 0 - free slot */
+	int n_members;
+	uint64 cap;
+	room_member *members;
+} room;
+
 typedef struct client_pool_t {
 	pool p;
 	int free_ch;
 	int used_ch;
 	client *client;
+	uint64 map_len;				/* of the arena the pool starts */
 } client_pool;
 
+typedef struct seg_pool_t {
+	pool p;
+	int free_ch;
+} seg_pool;
+
+/* Open addressing (linear probing) index of named clients. */
+typedef struct name_index_t {
+	client **slots;
+	uint64 mask;
+	int used;
+} name_index;
+
+/* Last lines of the lobby. Lines are stored back to back in buf, byte
+ * offsets grow forever and are taken modulo history_size, so any tail
+ * of the history is at most two contiguous pieces of buf.
+ */
+typedef struct history_t {
+	char *buf;
+	uint64 head;				/* offset of the next byte */
+	uint64 count;				/* lines ever added */
+	uint64 off[history_len];	/* offsets of the last lines */
+} history;
+
+/* Buffers of the line being handled, sized from limits.line_len. */
+typedef struct line_bufs_t {
+	char *frame;				/* the line as a frame */
+	char *msg;					/* the line or a private message as clients read it */
+	uint64 msg_size;
+	char *text;					/* a binary line made text */
+} line_bufs;
+
+/* A group commit fsync running on the executor. It syncs a duplicate of
+ * the segment, which may be closed by then.
+ */
+typedef struct log_syncer_t {
+	task t;
+	struct msg_log_t *l;
+	int fd;
+	const error *err;
+	int busy;
+	int again;					/* asked for while busy */
+} log_syncer;
+
+/* Append-only log of room lines. Lines of one event loop iteration are
+ * collected in buf and written with one syscall. The previous segment
+ * stays open and idx has log offsets of the last lines, for /history.
+ */
+typedef struct msg_log_t {
+	int fd;						/* current segment, -1 - no log */
+	uint64 seg_base;			/* log offset of the first byte of the segment */
+	uint64 seg_len;
+	int prev_fd;				/* previous segment, -1 - none */
+	uint64 prev_base;
+	int in_memory;				/* segments are memfds, no log directory */
+	uint64 *idx;
+	uint64 idx_count;			/* lines ever indexed */
+	char *buf;
+	uint64 buf_used;
+	uint64 unsynced;
+	int64 sync_at;				/* monotonic ms, 0 - nothing to sync */
+	executor *ex;				/* nil - fsync on the event loop */
+	log_syncer syncer;
+} msg_log;
+
+/* Hot restart. The successor gets a header with the listener attached,
+ * the history, then one record per client and its unread input with
+ * its socket attached, each followed by the pending output of the
+ * client. The socket is seqpacket, so a record never gets mixed with
+ * the next one.
+ */
+typedef struct handoff_hdr_t {
+	uint32 magic;
+	uint32 version;
+	uint32 client_size;			/* sizeof(handoff_client) of the sender */
+	uint32 n_clients;
+	uint32 has_unix;			/* the UNIX listener follows the header */
+	uint64 hist_len;
+} handoff_hdr;
+
+typedef struct handoff_client_t {
+	int32 buf_used;
+	int32 name_used;
+	int32 name_ok;
+	int32 n_rooms;
+	int32 cur_room;				/* index in rooms, -1 - none */
+	int32 compress;
+	int32 binary;
+	uint32 id;
+	int32 room_len[max_joined_rooms];
+	uint64 out_len;				/* bytes of data and file messages */
+	char name[max_name_len];
+	char rooms[max_joined_rooms][max_room_name_len];
+} handoff_client;
+
+/* Pending /history replay, sent with the segment file attached. */
+typedef struct handoff_file_t {
+	uint64 off;
+	uint64 len;
+} handoff_file;
+
+/* Kinds of bus records. */
+enum { bus_none, bus_line, bus_notice, bus_all, bus_private };
+
+/* One record of the bus. seq is the record number + 1 once the record
+ * is complete and 0 while it is being written, readers check it before
+ * and after copying, as with a seqlock.
+ */
+typedef struct bus_cell_t {
+	uint64 seq;
+	uint32 len;					/* bytes of data after the key */
+	uint16 origin;				/* worker that wrote it */
+	uint8 type;
+	uint8 key_len;				/* room or user name at the start of data */
+	char data[bus_cell_size - sizeof(uint64) - 2 * sizeof(uint32)];
+} bus_cell;
+
+/* Entry of the name registry shared by the workers. */
+typedef struct bus_name_t {
+	uint32 owner;				/* worker + 1, 0 - free slot */
+	uint32 len;
+	uint64 hash;
+	char name[max_name_len];
+} bus_name;
+
+/* Shared memory of the pre-fork mode. Producers never wait for
+ * readers, a reader that falls more than bus_cells behind loses
+ * records. Consumers 0..n_workers-1 are the workers, n_workers is
+ * the master, which writes the log.
+ */
+typedef struct bus_t {
+	uint64 head;				/* next record number */
+	char pad0[cache_line - sizeof(uint64)];
+	uint32 waiting[max_workers + 1];	/* consumer sleeps, wake it up */
+	uint64 claim[max_workers + 1];	/* record being written + 1 */
+	int efd[max_workers + 1];	/* eventfd of each consumer */
+	int ls[max_workers];		/* listener of each worker */
+	int pid[max_workers];
+	int n_workers;
+	uint32 names_lock;			/* 0 - free, else consumer + 1 */
+	int names_used;
+	uint64 names_mask;			/* slots of names - 1 */
+	char pad1[cache_line];
+	bus_cell cells[bus_cells];
+	bus_name names[];			/* limits.bus_name_slots */
+} bus;
+
+/* Lines for the compressed members of a room, nil - for all clients,
+ * collected during one loop iteration and compressed once.
+ */
+typedef struct zbatch_t {
+	struct room_t *r;
+	uint64 len;
+	char *buf;
+} zbatch;
+
+typedef struct z_stats_t {
+	uint64 frames;
+	uint64 in;					/* bytes before compression */
+	uint64 out;					/* frame bytes */
+	uint64 cpu_ns;				/* thread CPU time spent compressing */
+} z_stats;
+
+/* Joins and leaves since the last digest. */
+typedef struct presence_t {
+	uint64 joined;
+	uint64 left;
+	char buf[presence_names * (max_name_len + sizeof(entered_msg))];
+	uint64 buf_used;			/* notices of the first presence_names events */
+	char first[max_name_len];	/* name of the first event */
+	int first_len;
+	int64 last;					/* monotonic ms of the last digest */
+	int64 interval_ms;			/* between digests */
+	uint64 digests;				/* sent, reported on SIGUSR1 */
+	uint64 events;
+} presence;
+
+/* Client pools mapped and unmapped as clients come and go, reported on
+ * SIGUSR1 along with the counters of each pool.
+ */
+typedef struct mem_stats_t {
+	uint64 clp_maps;
+	uint64 clp_unmaps;
+} mem_stats;
+
+/* Flow control: once queued output takes pause_at segments the server
+ * stops reading from clients and accepting new ones, until it is down
+ * to resume_at. A client that still finds no segment is dropped.
+ */
+typedef struct flow_t {
+	uint64 segs;				/* output segments in use */
+	uint64 high;
+	uint64 pause_at;			/* three quarters of the segments */
+	uint64 resume_at;			/* half of them */
+	uint64 pauses;
+	int paused;					/* clients aren't read, nobody is accepted */
+} flow;
+
+/* Sizes set once at startup from flags, the environment or a memory
+ * budget, so one binary serves a few big rooms as well as many idle
+ * connections.
+ */
+typedef struct limits_t {
+	int port;
+	int backlog;
+	int line_len;				/* bytes of a client's line buffer */
+	int events;					/* the events array starts this big */
+	int pool_clients;			/* clients in one pool */
+	int pools;
+	int seg_pools;				/* output segments, segs_in_pool each */
+	uint64 client_size;			/* pool chunk: the client and its line buffer */
+	uint64 name_slots;			/* of the name index, a power of two */
+	uint64 bus_name_slots;		/* of the names the workers share, 0 - no workers */
+} limits;
+
+typedef struct drain_t {
+	int on;
+	int64 deadline;				/* monotonic ms */
+	int64 next_batch;
+	uint64 closed;
+} drain;
+
+/* Event loop counters, reported on SIGUSR1. */
+typedef struct loop_stats_t {
+	int64 start_ms;
+	uint64 waits;				/* epoll_wait calls */
+	uint64 blocking;			/* of them with a non-zero timeout */
+	uint64 empty;				/* of them that returned nothing */
+	uint64 events;
+	uint64 full;				/* batches that filled the events array */
+	uint64 deferred;			/* reads cut short by the read budget */
+} loop_stats;
+
 typedef struct server_t {
 	int ls;
+	int uls;					/* UNIX listener, -1 - none */
+	int epfd;
+	int sfd;					/* signalfd */
+	char **argv;
+	char **envp;
+	bus *bus;					/* nil - single process */
+	int worker;					/* consumer index in the bus */
+	uint64 bus_pos;				/* next record to read */
+	int bus_dirty;				/* we wrote records this iteration */
+	int spin_us;				/* poll this long after the last event, 0 - never */
+	int busy_poll_us;			/* SO_BUSY_POLL of clients, 0 - off */
+	int map_flags;				/* arena_huge, arena_prefault, arena_lock of pools */
+	limits lim;
+	executor *exec;				/* side work off the event loop, nil - none */
+	struct epoll_event *evt;
+	int n_evt;
+	client *ready_head;			/* clients with unread input, round-robin */
+	client *ready_tail;
+	int n_ready;
+	loop_stats stats;
+	mem_stats mem;
+	flow flow;
+	drain drain;
+	uint32 next_id;				/* of the next client */
+	lz_table *lzt;
+	byte *zframe;				/* frame being built */
+	zbatch zb[max_zbatches];
+	int n_zb;
+	z_stats zstats;
+	presence pres;
 	int n_pls;
 	client_pool **first_clp;
+	int n_rooms;				/* high-water mark of used room slots */
+	room *rooms;				/* rooms[0] is the lobby */
+	name_index names;
+	int n_seg_pls;
+	seg_pool **seg_pls;
+	history hist;
+	line_bufs lines;
+	msg_log log;
 } server;
 
 enum {
-	/* 142 KB is reserved for one pool.
-	 * 520 byte isn't used.
+	rooms_size = sizeof(room) * max_rooms,
+	/* 1 MiB is reserved for one pool. */
+	seg_pool_size = sizeof(out_seg) * segs_in_pool,
+	/* Workers pass lines on in bus cells: the room, the frame header,
+	 * the sender and the line have to fit.
 	 */
-	pool_size = sizeof(client) * max_clients_in_pool,
+	bus_max_line = sizeof(((bus_cell *) 0)->data) - max_room_name_len - sizeof(bin_hdr) - max_name_len,
 	default_alignment = sizeof(void *)
 };
 
@@ -61,292 +548,3361 @@ static uint16 hton(uint16 port)
 	return (port << 8) | (port >> 8);
 }
 
-static void session_send_all(string msg, client * except, server * serv)
+/* =========== output =========== */
+
+static void seg_new_pool(server * serv)
 {
-	int i;
-	client *c;
+	arena a;
+	byte *pbuf;
+	seg_pool *sp;
 
-	for (i = 0; i < serv->n_pls; i++) {
-		c = serv->first_clp[i]->client;
-		while (c != nil) {
-			if (except != c)
-				sys_write(c->fd, (char *) msg.base, msg.len, nil);
-			c = c->next;
-		}
+	arena_create_flags(&a, seg_pool_size + sizeof(seg_pool), serv->map_flags);
+
+	sp = (seg_pool *) arena_alloc(&a, sizeof(seg_pool));
+	pbuf = (byte *) arena_alloc(&a, seg_pool_size);
+	if (sp == nil || pbuf == nil) {
+		fmt_fprintf(stderr, "seg_new_pool: arena_alloc failed\n");
+		sys_exit_group(1);
 	}
+
+	pool_init(&sp->p, pbuf, seg_pool_size, sizeof(out_seg), default_alignment);
+	sp->free_ch = sp->p.buf_len / sp->p.chunk_size;
+
+	serv->seg_pls[serv->n_seg_pls] = sp;
+	serv->n_seg_pls++;
 }
 
-static void check_line_and_send(client * c, server * serv)
+static out_seg *seg_get(server * serv)
 {
-	int i, pos = -1;
-	/* 17 - for time and brackets */
-	char msg[max_line_len + max_name_len + 17];
-	slice s;
-	struct tm t;
-	const error *err;
-	struct timespec tp;
+	seg_pool *sp;
+	out_seg *seg;
+	int i;
 
-	for (i = 0; i < c->buf_used; i++)
-		if (c->buf[i] == '\n') {
-			pos = i;
+	for (i = 0; i < serv->n_seg_pls; i++)
+		if (serv->seg_pls[i]->free_ch > 0)
 			break;
-		}
 
-	if (pos == -1)
-		return;
+	if (i == serv->n_seg_pls) {
+		if (serv->n_seg_pls == serv->lim.seg_pools)
+			return nil;
+		seg_new_pool(serv);
+	}
 
-	i = 0;
-	s = unsafe_slice(msg, sizeof(msg));
-	i = c_string_in_slice(s, c->name);
+	sp = serv->seg_pls[i];
+	seg = pool_get(&sp->p);
+	sp->free_ch--;
 
-	err = sys_clock_gettime(clock_realtime, &tp);
-	if (err != nil) {
-		fmt_fprintf(stderr, "sys_clock_gettime: %s\n", err->msg);
-		i += c_nstring_in_slice(slice_left(s, i), ": ", 2);
-		i += c_nstring_in_slice(slice_left(s, i), c->buf, pos + 1);
-	} else {
-		t = time_to_tm(tp.tv_sec);
-		i += c_nstring_in_slice(slice_left(s, i), " (", 2);
-		i += tm_in_slice2(slice_left(s, i), &t);
-		i += c_nstring_in_slice(slice_left(s, i), "): ", 3);
-		i += c_nstring_in_slice(slice_left(s, i), c->buf, pos + 1);
-	}
+	seg->next = nil;
+	seg->head = 0;
+	seg->tail = 0;
+	seg->fd = -1;
+	if (++serv->flow.segs > serv->flow.high)
+		serv->flow.high = serv->flow.segs;
+	return seg;
+}
 
-	session_send_all(get_string(slice_right(s, i)), c, serv);
+static void seg_put(out_seg * seg, server * serv)
+{
+	seg_pool *sp;
+	int i;
 
-	c->buf_used -= pos + 1;
-	memmove(c->buf, c->buf + pos + 1, c->buf_used);
+	if (seg->fd != -1)
+		sys_close(seg->fd);
+
+	for (i = 0; i < serv->n_seg_pls; i++) {
+		sp = serv->seg_pls[i];
+		if ((byte *) seg >= sp->p.buf && (byte *) seg < sp->p.buf + sp->p.buf_len) {
+			pool_put(&sp->p, seg);
+			sp->free_ch++;
+			serv->flow.segs--;
+			return;
+		}
+	}
+	assert(0 && "segment is out of bounds of all pools");
 }
 
-static void session_close(client * c, server * serv)
+static void session_drop_output(client * c, server * serv)
 {
-	client **pcur;
-	client_pool *clp;
-	client *t;
-	const error *err;
-	int i = 0;
+	out_seg *seg;
 
-	if (c->name_ok == true) {
-		slice s;
-		char msg[max_line_len + sizeof(left_msg)];
-		s = unsafe_slice(msg, sizeof(msg));
-		i = c_nstring_in_slice(s, c->name, c->name_used);
-		i += c_nstring_in_slice(slice_left(s, i), left_msg, sizeof(left_msg) - 1);
-		session_send_all(get_string(slice_right(s, i)), c, serv);
+	while ((seg = c->out_head) != nil) {
+		c->out_head = seg->next;
+		seg_put(seg, serv);
 	}
-	sys_close(c->fd);
+	c->out_tail = nil;
+	c->out_len = 0;
+	c->who_pos = -1;
+}
 
-	for (i = 0; i < serv->n_pls; i++) {
-		clp = serv->first_clp[i];
-		pcur = &(clp->client);
-		while (*pcur != nil) {
-			if (*pcur == c) {
-				t = *pcur;
-				*pcur = (*pcur)->next;
-				clp->free_ch++;
-				clp->used_ch--;
-				if (serv->n_pls > 1 && clp->used_ch == 0) {
-					err = sys_munmap((uintptr) clp, page_size);
-					if (err != nil) {
-						fmt_fprintf(stderr, "session_close: sys_munmap failed: %s\n", err->msg);
-					}
-#ifdef DEBUG_PRINT
-					int n;
-					for (n = 0; n < serv->n_pls; n++)
-						fmt_fprintf(stdout, "before: serv->first_clp[%d]: %p\n", n, serv->first_clp[n]);
-#endif
+/* Drops a client we can't deliver to. Shutdown wakes up the event loop
+ * for it, where the client is closed outside of any fan-out.
+ */
+static void session_kill(client * c, server * serv)
+{
+	if (c->closing == true)
+		return;
 
-					/* shift pools in the left after delete one */
-					serv->n_pls--;
-					while (i < serv->n_pls) {
-						serv->first_clp[i] = serv->first_clp[i + 1];
-						i++;
-					}
-					serv->first_clp[i] = nil;
+	c->closing = true;
+	session_drop_output(c, serv);
+	sys_shutdown(c->fd, shut_rdwr);
+}
 
-#ifdef DEBUG_PRINT
-					for (n = 0; n < serv->n_pls + 1; n++)
-						fmt_fprintf(stdout, "after: serv->first_clp[%d]: %p\n", n, serv->first_clp[n]);
-#endif
-					return;
-				}
-				pool_put(&clp->p, t);
+static int session_queue(client * c, const char *buf, uint64 n, server * serv)
+{
+	out_seg *seg;
+	uint64 l;
 
-#ifdef DEBUG_PRINT
-				fmt_fprintf(stdout, "free client chunk address: %p\n", t);
-#endif
-				return;
-			} else {
-				pcur = &(*pcur)->next;
-			}
+	while (n > 0) {
+		seg = c->out_tail;
+		if (seg == nil || seg->fd != -1 || seg->tail == sizeof(seg->data)) {
+			seg = seg_get(serv);
+			if (seg == nil)
+				return 1;
+
+			if (c->out_tail == nil)
+				c->out_head = seg;
+			else
+				c->out_tail->next = seg;
+			c->out_tail = seg;
 		}
+
+		l = sizeof(seg->data) - seg->tail;
+		if (l > n)
+			l = n;
+
+		memcpy(seg->data + seg->tail, buf, l);
+		seg->tail += l;
+		c->out_len += l;
+		buf += l;
+		n -= l;
 	}
+	return 0;
 }
 
-static void session_name_read(client * c, server * serv)
+/* Puts n bytes in front of the pending output. */
+static int session_push(client * c, const char *buf, uint64 n, server * serv)
 {
-	const error *err;
-	int n, bufn = c->name_used;
-	/* if welcome_msg > entered_msg */
-	char msg[sizeof(welcome_msg) + max_name_len];
-	slice s;
+	out_seg *first = nil, *last = nil, *seg;
+	uint64 l, done = 0;
 
-	for (;;) {
-		n = sys_read(c->fd, c->name + bufn, max_name_len - bufn, &err);
-		if (err != nil) {
-			if (err->code == EAGAIN)
-				break;
-			else if (err->code == EINTR)
-				continue;
-			else {
-				fmt_fprintf(stderr, "session_read: sys_read failed: %s\n", err->msg);
-				session_close(c, serv);
-				return;
+	while (done < n) {
+		seg = seg_get(serv);
+		if (seg == nil) {
+			while ((seg = first) != nil) {
+				first = seg->next;
+				seg_put(seg, serv);
 			}
-		} else if (n == 0) {
-			session_close(c, serv);
-			return;
+			return 1;
 		}
 
-		c->name_used += n;
-		if (c->name_used > max_name_len) {
-			sys_write(c->fd, too_long_name, sizeof(too_long_name) - 1, nil);
-			session_close(c, serv);
-			return;
-		}
-	}
+		l = n - done < sizeof(seg->data) ? n - done : sizeof(seg->data);
+		memcpy(seg->data, buf + done, l);
+		seg->tail = l;
+		done += l;
 
-	for (n = 0; n < c->name_used; n++) {
-		if (c->name[n] == '\n' || c->name[n] == '\r') {
-			c->name[n] = '\0';
-			c->name_ok = true;
-			c->name_used = n;
-		}
+		if (last == nil)
+			first = seg;
+		else
+			last->next = seg;
+		last = seg;
 	}
 
-	if (c->name_ok == true) {
-		n = 0;
-		s = unsafe_slice(msg, sizeof(msg));
+	if (last == nil)
+		return 0;
+	last->next = c->out_head;
+	c->out_head = first;
+	if (c->out_tail == nil)
+		c->out_tail = last;
+	c->out_len += n;
+	return 0;
+}
+
+static uint64 varint_put(byte * p, uint64 v)
+{
+	uint64 n = 0;
 
-		n = c_nstring_in_slice(s, welcome_msg, sizeof(welcome_msg) - 1);
-		n += c_nstring_in_slice(slice_left(s, n), c->name, c->name_used);
-		n += c_nstring_in_slice(slice_left(s, n), "\n", 1);
-		sys_write(c->fd, s.base, n, nil);
+	while (v >= 0x80) {
+		p[n++] = v | 0x80;
+		v >>= 7;
+	}
+	p[n++] = v;
+	return n;
+}
 
-		n = c_nstring_in_slice(s, c->name, c->name_used);
-		n += c_nstring_in_slice(slice_left(s, n), entered_msg, sizeof(entered_msg) - 1);
+/* Frames n <= zblock_size bytes for compressed clients: varint length of
+ * the data, varint length of the payload times two plus one if the
+ * payload is the data as is, then the payload, an LZ4 block otherwise.
+ */
+static string zframe_make(server * serv, const char *buf, uint64 n)
+{
+	z_stats *st = &serv->zstats;
+	struct timespec t0, t1;
+	byte *out = serv->zframe + zframe_header;
+	byte hdr[zframe_header];
+	uint64 c = n, h;
+	int stored = true;
 
-		session_send_all(get_string(slice_right(s, n)), c, serv);
+	if (n >= lz_min_input) {
+		sys_clock_gettime(clock_thread_cputime_id, &t0);
+		c = lz_compress(serv->lzt, (const byte *) buf, n, out);
+		sys_clock_gettime(clock_thread_cputime_id, &t1);
+		st->cpu_ns += (t1.tv_sec - t0.tv_sec) * 1000000000 + t1.tv_nsec - t0.tv_nsec;
+		stored = c >= n;
 	}
+	if (stored) {
+		memcpy(out, buf, n);
+		c = n;
+	}
+
+	h = varint_put(hdr, n);
+	h += varint_put(hdr + h, c * 2 + stored);
+	memcpy(out - h, hdr, h);
+
+	st->frames++;
+	st->in += n;
+	st->out += h + c;
+	return unsafe_string(out - h, h + c);
 }
 
-static void session_line_read(client * c, server * serv)
+/* Writes right away when nothing is pending, the rest waits for EPOLLOUT. */
+static void session_out(client * c, const char *buf, uint64 n, server * serv)
 {
 	const error *err;
-	int n, bufp = c->buf_used;
+	int64 w = 0;
 
-	for (;;) {
-		n = sys_read(c->fd, c->buf + bufp, max_line_len - bufp, &err);
-		if (err != nil) {
-			if (err->code == EAGAIN)
+	if (c->closing == true)
+		return;
+
+	if (c->out_head == nil) {
+		for (;;) {
+			w = sys_write(c->fd, buf, n, &err);
+			if (err == nil)
 				break;
-			else if (err->code == EINTR)
+			if (err->code == EINTR)
 				continue;
-			else {
-				fmt_fprintf(stderr, "session_read: sys_read failed: %s\n", err->msg);
-				session_close(c, serv);
+			if (err->code != EAGAIN)
+				/* The peer is gone, reading side will close it. */
 				return;
-			}
-		} else if (n == 0) {
-			/* Is it necessary? */
-			check_line_and_send(c, serv);
-			session_close(c, serv);
+			w = 0;
+			break;
+		}
+		if (w == n)
 			return;
+	}
+
+	if (session_queue(c, buf + w, n - w, serv) != 0) {
+		fmt_fprintf(stderr, "session_out: out of output segments, dropping client\n");
+		session_kill(c, serv);
+	}
+}
+
+/* Same as session_out but for several buffers at once. */
+static void session_outv(client * c, iovec * iov, int iovcnt, server * serv)
+{
+	const error *err;
+	int64 w = 0;
+	int i;
+
+	if (c->closing == true)
+		return;
+
+	if (c->out_head == nil) {
+		for (;;) {
+			w = sys_writev(c->fd, iov, iovcnt, &err);
+			if (err == nil)
+				break;
+			if (err->code == EINTR)
+				continue;
+			if (err->code != EAGAIN)
+				return;
+			w = 0;
+			break;
 		}
+	}
 
-		c->buf_used += n;
-		if (c->buf_used > max_line_len) {
-			sys_write(c->fd, too_long_msg, sizeof(too_long_msg) - 1, nil);
-			session_close(c, serv);
+	for (i = 0; i < iovcnt; i++) {
+		if ((uint64) w >= iov[i].iov_len) {
+			w -= iov[i].iov_len;
+			continue;
+		}
+
+		if (session_queue(c, (char *) iov[i].iov_base + w, iov[i].iov_len - w, serv) != 0) {
+			fmt_fprintf(stderr, "session_outv: out of output segments, dropping client\n");
+			session_kill(c, serv);
 			return;
 		}
+		w = 0;
 	}
-	check_line_and_send(c, serv);
 }
 
-static void session_new_clp(server * serv)
+/* Header of a frame from the server itself. */
+static void bin_hdr_set(bin_hdr * h, int type, uint64 len)
 {
-	arena a;
-	byte *pbuf;
-	client_pool *clp_new;
+	h->len = len;
+	h->type = type;
+	h->room_len = 0;
+	h->name_len = 0;
+	h->sender = 0;
+	h->reserved = 0;
+	h->time_us = 0;
+}
 
-	arena_create(&a, pool_size + sizeof(client_pool));
+/* Sends the buffers as the payload of one frame. */
+static void session_bin_writev(client * c, int type, iovec * iov, int iovcnt, server * serv)
+{
+	iovec v[1 + max_write_iov];
+	bin_hdr h;
+	uint64 len = 0;
+	int i;
 
-	clp_new = (client_pool *) arena_alloc(&a, sizeof(client_pool));
-	if (clp_new == nil) {
-		fmt_fprintf(stderr, "session_new_clp: arena_alloc (client_pool) failed\n");
-		sys_exit(1);
+	assert(iovcnt <= max_write_iov);
+	for (i = 0; i < iovcnt; i++) {
+		v[1 + i] = iov[i];
+		len += iov[i].iov_len;
 	}
+	bin_hdr_set(&h, type, len);
+	v[0].iov_base = &h;
+	v[0].iov_len = sizeof(h);
+	session_outv(c, v, 1 + iovcnt, serv);
+}
 
-	pbuf = (byte *) arena_alloc(&a, pool_size);
-	if (pbuf == nil) {
-		fmt_fprintf(stderr, "session_new_clp: arena_alloc (pool) failed\n");
-		sys_exit(2);
+static void session_bin_write(client * c, int type, const char *buf, uint64 n, server * serv)
+{
+	iovec iov;
+
+	iov.iov_base = (char *) buf;
+	iov.iov_len = n;
+	session_bin_writev(c, type, &iov, 1, serv);
+}
+
+/* Text for the client: as is, in LZ4 frames or in a bin_text frame. */
+static void session_write(client * c, const char *buf, uint64 n, server * serv)
+{
+	string f;
+	uint64 l;
+
+	if (c->binary) {
+		session_bin_write(c, bin_text, buf, n, serv);
+		return;
 	}
 
-	pool_init(&clp_new->p, pbuf, pool_size, sizeof(client), default_alignment);
-	clp_new->used_ch = 0;
-	clp_new->free_ch = clp_new->p.buf_len / clp_new->p.chunk_size;
-	clp_new->client = nil;
+	if (c->compress == false) {
+		session_out(c, buf, n, serv);
+		return;
+	}
 
-	serv->first_clp[serv->n_pls] = clp_new;
-	serv->n_pls++;
+	while (n > 0) {
+		l = n < zblock_size ? n : zblock_size;
+		f = zframe_make(serv, buf, l);
+		session_out(c, f.base, f.len, serv);
+		buf += l;
+		n -= l;
+	}
 }
 
-static client *session_new(int epfd, server * serv)
+/* Same as session_write but for several buffers at once. */
+static void session_writev(client * c, iovec * iov, int iovcnt, server * serv)
 {
-	client *c = nil;
-	client_pool *clp;
 	int i;
 
-	for (i = 0; i < serv->n_pls; i++) {
-		clp = serv->first_clp[i];
-		if (clp->free_ch > 0) {
-			c = pool_get(&clp->p);
-			clp->free_ch--;
-			clp->used_ch++;
-			c->next = clp->client;
-			clp->client = c;
+	if (c->binary)
+		session_bin_writev(c, bin_text, iov, iovcnt, serv);
+	else if (c->compress)
+		for (i = 0; i < iovcnt; i++)
+			session_write(c, iov[i].iov_base, iov[i].iov_len, serv);
+	else
+		session_outv(c, iov, iovcnt, serv);
+}
 
-#ifdef DEBUG_PRINT
-			fmt_fprintf(stdout, "new client chunk address: %p\n", c);
-#endif
+/* Queues len bytes of the file fd from off on, the file is dup'ed. */
+static int session_queue_file(client * c, int fd, uint64 off, uint64 len, server * serv)
+{
+	const error *err;
+	out_seg *seg;
+
+	seg = seg_get(serv);
+	if (seg == nil)
+		return 1;
+
+	seg->fd = sys_fcntl(fd, f_dupfd_cloexec, 0, &err);
+	if (err != nil) {
+		fmt_fprintf(stderr, "session_queue_file: sys_fcntl failed: %s\n", err->msg);
+		seg->fd = -1;
+		seg_put(seg, serv);
+		return 1;
+	}
+	seg->file_off = off;
+	seg->tail = len;
+
+	if (c->out_tail == nil)
+		c->out_head = seg;
+	else
+		c->out_tail->next = seg;
+	c->out_tail = seg;
+	c->out_len += len;
+	return 0;
+}
+
+/* Compresses the next piece of a /history replay for a compressed client
+ * and puts its frame in front of the pending output.
+ */
+static int session_frame_file(client * c, out_seg * seg, server * serv)
+{
+	char buf[zblock_size];
+	const error *err;
+	string f;
+	int64 n;
+
+	n = seg->tail - seg->head < sizeof(buf) ? seg->tail - seg->head : sizeof(buf);
+	do
+		n = sys_pread(seg->fd, buf, n, seg->file_off + seg->head, &err);
+	while (err != nil && err->code == EINTR);
+	if (err != nil) {
+		fmt_fprintf(stderr, "session_frame_file: sys_pread failed: %s\n", err->msg);
+		return 1;
+	}
+	/* The file is shorter than we thought, skip the rest. */
+	if (n == 0)
+		n = seg->tail - seg->head;
+
+	seg->head += n;
+	c->out_len -= n;
+	if (seg->head == seg->tail) {
+		c->out_head = seg->next;
+		if (c->out_head == nil)
+			c->out_tail = nil;
+		seg_put(seg, serv);
+	}
+
+	f = zframe_make(serv, buf, n);
+	return session_push(c, f.base, f.len, serv);
+}
+
+static void command_who(client * c, server * serv);
+static void zbatch_add(server * serv, struct room_t *r, string msg);
+static void bus_publish(server * serv, int type, const char *key, int key_len, const char *msg, uint64 len);
+static int server_go(server * serv);
+static int is_arg(const char *arg, const char *name, uint64 len);
+
+static void session_flush(client * c, server * serv)
+{
+	const error *err;
+	out_seg *seg;
+	int64 w, off;
+
+	while ((seg = c->out_head) != nil) {
+		if (seg->fd != -1 && c->compress) {
+			if (session_frame_file(c, seg, serv) != 0) {
+				session_kill(c, serv);
+				return;
+			}
+			continue;
+		}
+
+		if (seg->fd != -1) {
+			off = seg->file_off + seg->head;
+			w = sys_sendfile(c->fd, seg->fd, &off, seg->tail - seg->head, &err);
+			/* The file is shorter than we thought, skip the rest. */
+			if (err == nil && w == 0)
+				w = seg->tail - seg->head;
+		} else
+			w = sys_write(c->fd, seg->data + seg->head, seg->tail - seg->head, &err);
+		if (err != nil) {
+			if (err->code == EINTR)
+				continue;
+			if (err->code != EAGAIN)
+				session_kill(c, serv);
+			return;
+		}
+
+		seg->head += w;
+		c->out_len -= w;
+		if (seg->head == seg->tail) {
+			c->out_head = seg->next;
+			if (c->out_head == nil)
+				c->out_tail = nil;
+			seg_put(seg, serv);
+		}
+	}
+
+	if (c->who_pos != -1)
+		command_who(c, serv);
+}
+
+/* Compressed clients get the line in this iteration's batch. */
+static void session_send_all(string msg, client * except, server * serv)
+{
+	int i, batch = false;
+	client *c;
+
+	for (i = 0; i < serv->n_pls; i++) {
+		c = serv->first_clp[i]->client;
+		while (c != nil) {
+			if (c->compress)
+				batch = true;
+			else if (except != c)
+				session_write(c, msg.base, msg.len, serv);
+			c = c->next;
+		}
+	}
+	if (batch)
+		zbatch_add(serv, nil, msg);
+}
+
+/* =========== names =========== */
+
+/* FNV-1a */
+static uint64 name_hash(const char *name, int len)
+{
+	uint64 h = 14695981039346656037UL;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (byte) name[i];
+		h *= 1099511628211UL;
+	}
+	return h;
+}
+
+static client *name_find(name_index * ni, const char *name, int len)
+{
+	uint64 i = name_hash(name, len) & ni->mask;
+	client *c;
+
+	while ((c = ni->slots[i]) != nil) {
+		if (c->name_used == len && memequal(c->name, name, len))
+			return c;
+		i = (i + 1) & ni->mask;
+	}
+	return nil;
+}
+
+/* Returns 1 if the name is taken. A half full index takes no more
+ * names, probes stay short and always end at a free slot.
+ */
+static int name_insert(name_index * ni, client * c)
+{
+	uint64 i;
+	client *t;
+
+	c->name_hash = name_hash(c->name, c->name_used);
+	if ((uint64) ni->used > ni->mask / 2)
+		return 1;
+	i = c->name_hash & ni->mask;
+	while ((t = ni->slots[i]) != nil) {
+		if (t->name_used == c->name_used && memequal(t->name, c->name, c->name_used))
+			return 1;
+		i = (i + 1) & ni->mask;
+	}
+
+	ni->slots[i] = c;
+	ni->used++;
+	return 0;
+}
+
+static void name_remove(name_index * ni, client * c)
+{
+	uint64 i, j, k;
+
+	i = c->name_hash & ni->mask;
+	while (ni->slots[i] != c) {
+		if (ni->slots[i] == nil)
+			return;
+		i = (i + 1) & ni->mask;
+	}
+
+	/* Backward shift deletion: pull the rest of the probe chain into
+	 * the hole, so lookups never have to skip tombstones. An entry may
+	 * move to the hole only if its home slot isn't in (i, j].
+	 */
+	j = i;
+	for (;;) {
+		j = (j + 1) & ni->mask;
+		if (ni->slots[j] == nil)
+			break;
+
+		k = ni->slots[j]->name_hash & ni->mask;
+		if ((i < j) ? (k <= i || k > j) : (k <= i && k > j)) {
+			ni->slots[i] = ni->slots[j];
+			i = j;
+		}
+	}
+	ni->slots[i] = nil;
+	ni->used--;
+}
+
+/* =========== history =========== */
+
+static void history_add(history * h, const char *line, uint64 len)
+{
+	uint64 pos = h->head % history_size;
+	uint64 l = history_size - pos;
+
+	if (len > history_size)
+		return;
+
+	if (l > len)
+		l = len;
+	memcpy(h->buf + pos, line, l);
+	memcpy(h->buf, line + l, len - l);
+
+	h->off[h->count % history_len] = h->head;
+	h->count++;
+	h->head += len;
+}
+
+/* Fills at most two iovecs with the oldest lines still held in buf. */
+static int history_in_iovec(history * h, iovec * iov)
+{
+	uint64 first, start, pos, len;
+	int n = 0;
+
+	first = h->count > history_len ? h->count - history_len : 0;
+	/* Skip lines whose bytes have been overwritten already. */
+	while (first < h->count && h->off[first % history_len] + history_size < h->head)
+		first++;
+
+	if (first == h->count)
+		return 0;
+
+	start = h->off[first % history_len];
+	pos = start % history_size;
+	len = h->head - start;
+
+	if (pos + len > history_size) {
+		iov[n].iov_base = h->buf + pos;
+		iov[n].iov_len = history_size - pos;
+		len -= iov[n].iov_len;
+		pos = 0;
+		n++;
+	}
+	iov[n].iov_base = h->buf + pos;
+	iov[n].iov_len = len;
+	n++;
+
+	return n;
+}
+
+/* =========== log =========== */
+
+static int64 now_ms(void)
+{
+	struct timespec tp;
+
+	if (sys_clock_gettime(clock_monotonic, &tp) != nil)
+		return 0;
+	return tp.tv_sec * 1000 + tp.tv_nsec / 1000000;
+}
+
+static int64 now_us(void)
+{
+	struct timespec ts;
+
+	sys_clock_gettime(clock_monotonic, &ts);
+	return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Wall clock time of lines, 0 if there is none. */
+static int64 unix_us(void)
+{
+	struct timespec ts;
+	const error *err;
+
+	err = sys_clock_gettime(clock_realtime, &ts);
+	if (err != nil) {
+		fmt_fprintf(stderr, "sys_clock_gettime: %s\n", err->msg);
+		return 0;
+	}
+	return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* chat_log/00000000000000000000.log */
+static void log_path(char *path, uint64 base)
+{
+	int i, n;
+
+	n = c_nstring_in_slice(unsafe_slice(path, sizeof(log_dir)), log_dir, sizeof(log_dir) - 1);
+	path[n++] = '/';
+	for (i = log_offset_digits - 1; i >= 0; i--) {
+		path[n + i] = '0' + base % 10;
+		base /= 10;
+	}
+	n += log_offset_digits;
+	n += c_nstring_in_slice(unsafe_slice(path + n, sizeof(log_suffix)), log_suffix, sizeof(log_suffix));
+}
+
+/* Returns 1 if name is a segment name, its base is stored in *base. */
+static int log_parse_name(const char *name, uint64 * base)
+{
+	int i;
+
+	*base = 0;
+	for (i = 0; i < log_offset_digits; i++) {
+		if (name[i] < '0' || name[i] > '9')
+			return 0;
+		*base = *base * 10 + name[i] - '0';
+	}
+	return memequal(name + i, log_suffix, sizeof(log_suffix));
+}
+
+static int is_lobby_line(const char *line)
+{
+	/* Only lines of other rooms start with a room name. */
+	return line[0] != '#';
+}
+
+/* Walks lines of p backwards and returns the offset from which *need
+ * lines start, lobby lines only if lobby is true. *need is decreased
+ * by the number of lines found.
+ */
+static uint64 log_scan_back(const char *p, uint64 len, int *need, int lobby)
+{
+	uint64 end = len, start;
+
+	while (end > 0 && *need > 0) {
+		start = end - 1;
+		while (start > 0 && p[start - 1] != '\n')
+			start--;
+		if (lobby == false || is_lobby_line(p + start))
+			(*need)--;
+		end = start;
+	}
+	return end;
+}
+
+static void log_replay(history * h, const char *p, uint64 from, uint64 len)
+{
+	uint64 end;
+
+	while (from < len) {
+		end = from;
+		while (end < len && p[end] != '\n')
+			end++;
+		end++;
+		if (is_lobby_line(p + from))
+			history_add(h, p + from, end - from);
+		from = end;
+	}
+}
+
+static void log_index_add(msg_log * l, uint64 off)
+{
+	l->idx[l->idx_count % log_index_len] = off;
+	l->idx_count++;
+}
+
+/* Indexes the lines of p from from on, base is the log offset of p. */
+static void log_index_lines(msg_log * l, const char *p, uint64 from, uint64 len, uint64 base)
+{
+	while (from < len) {
+		log_index_add(l, base + from);
+		while (from < len && p[from] != '\n')
+			from++;
+		from++;
+	}
+}
+
+/* Returns the first indexed line at log offset off or later. Lines
+ * before the previous segment don't count, they can't be read anymore.
+ */
+static uint64 log_index_find(msg_log * l, uint64 off)
+{
+	uint64 lo, hi, mid;
+
+	lo = l->idx_count > log_index_len ? l->idx_count - log_index_len : 0;
+	hi = l->idx_count;
+	if (l->prev_fd != -1 && off < l->prev_base)
+		off = l->prev_base;
+	else if (l->prev_fd == -1 && off < l->seg_base)
+		off = l->seg_base;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (l->idx[mid % log_index_len] < off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static const char *log_map(int fd, uint64 len)
+{
+	const error *err;
+	const char *p;
+
+	p = sys_mmap((uintptr) nil, len, prot_read, map_shared, fd, 0, &err);
+	if (err != nil) {
+		fmt_fprintf(stderr, "log_map: sys_mmap failed: %s\n", err->msg);
+		return nil;
+	}
+	return p;
+}
+
+/* Refills the history, unless a hot restart has handed it over, and
+ * the line index from the tail of the log. A segment holds far more
+ * lines than both keep, so at most the two last ones are read.
+ */
+static void log_rebuild(msg_log * l, history * h, const char *last, uint64 last_len)
+{
+	const error *err;
+	const char *prev = nil;
+	uint64 from, hist_from, prev_from = 0, prev_hist_from = 0, prev_len = 0;
+	int need = log_index_len, hist_need = h->count == 0 ? history_len : 0;
+
+	from = log_scan_back(last, last_len, &need, false);
+	hist_from = log_scan_back(last, last_len, &hist_need, true);
+
+	if ((need > 0 || hist_need > 0) && l->prev_fd != -1) {
+		prev_len = sys_lseek(l->prev_fd, 0, seek_end, &err);
+		if (err == nil && prev_len > 0)
+			prev = log_map(l->prev_fd, prev_len);
+		if (prev != nil) {
+			prev_from = log_scan_back(prev, prev_len, &need, false);
+			prev_hist_from = log_scan_back(prev, prev_len, &hist_need, true);
+		}
+	}
+
+	if (prev != nil) {
+		log_replay(h, prev, prev_hist_from, prev_len);
+		log_index_lines(l, prev, prev_from, prev_len, l->prev_base);
+		sys_munmap((uintptr) prev, prev_len);
+	}
+
+	log_replay(h, last, hist_from, last_len);
+	log_index_lines(l, last, from, last_len, l->seg_base);
+}
+
+static int log_open_segment(msg_log * l, uint64 base)
+{
+	char path[sizeof(log_dir) + log_offset_digits + sizeof(log_suffix) + 1];
+	const error *err;
+
+	if (l->in_memory) {
+		l->fd = sys_memfd_create(log_dir, mfd_cloexec, &err);
+		if (err != nil) {
+			fmt_fprintf(stderr, "log_open_segment: sys_memfd_create failed: %s\n", err->msg);
+			l->fd = -1;
+			return 1;
+		}
+	} else {
+		log_path(path, base);
+		l->fd = sys_open(path, o_rdwr | o_creat | o_append | o_cloexec, 0644, &err);
+		if (err != nil) {
+			fmt_fprintf(stderr, "log_open_segment: sys_open %s failed: %s\n", path, err->msg);
+			l->fd = -1;
+			return 1;
+		}
+	}
+	l->seg_base = base;
+	l->seg_len = 0;
+	return 0;
+}
+
+/* Keeps the log in memfd segments, so that /history still works. */
+static void log_init_memory(msg_log * l)
+{
+	l->in_memory = true;
+	log_open_segment(l, 0);
+}
+
+static void log_sync_run(task * t, exec_worker * w);
+static void log_sync_done(task * t);
+
+/* Opens the two newest segments, cuts a torn last line and rebuilds the
+ * history and the line index from them. Without a usable log directory
+ * the log is kept in memory only.
+ */
+static void log_init(msg_log * l, history * h)
+{
+	char path[sizeof(log_dir) + log_offset_digits + sizeof(log_suffix) + 1];
+	char dbuf[4096];
+	struct dirent64 *d;
+	const error *err;
+	const char *p;
+	uint64 base, last = 0, prev = 0, len, map_len;
+	int64 n, i;
+	int dfd, found = 0;
+	arena a;
+
+	l->fd = -1;
+	l->prev_fd = -1;
+	l->in_memory = false;
+	l->buf_used = 0;
+	l->unsynced = 0;
+	l->sync_at = 0;
+	l->idx_count = 0;
+	l->ex = nil;
+	l->syncer.l = l;
+	l->syncer.t.run = log_sync_run;
+	l->syncer.t.done = log_sync_done;
+	l->syncer.busy = false;
+	l->syncer.again = false;
+
+	arena_create(&a, log_buf_size + log_index_len * sizeof(uint64));
+	l->buf = (char *) arena_alloc(&a, log_buf_size);
+	l->idx = (uint64 *) arena_alloc(&a, log_index_len * sizeof(uint64));
+
+	err = sys_mkdir(log_dir, 0755);
+	if (err != nil && err->code != EEXIST) {
+		fmt_fprintf(stderr, "log_init: sys_mkdir failed: %s, keeping log in memory\n", err->msg);
+		log_init_memory(l);
+		return;
+	}
+
+	dfd = sys_open(log_dir, o_rdonly | o_directory | o_cloexec, 0, &err);
+	if (err != nil) {
+		fmt_fprintf(stderr, "log_init: sys_open failed: %s, keeping log in memory\n", err->msg);
+		log_init_memory(l);
+		return;
+	}
+
+	for (;;) {
+		n = sys_getdents64(dfd, dbuf, sizeof(dbuf), &err);
+		if (err != nil || n <= 0)
+			break;
+
+		for (i = 0; i < n; i += d->d_reclen) {
+			d = (struct dirent64 *) (dbuf + i);
+			if (!log_parse_name(d->d_name, &base))
+				continue;
+			if (found == 0 || base > last) {
+				if (found)
+					prev = last;
+				last = base;
+			} else if (found == 1 || base > prev)
+				prev = base;
+			found++;
+		}
+	}
+	sys_close(dfd);
+
+	if (log_open_segment(l, last) != 0) {
+		log_init_memory(l);
+		return;
+	}
+
+	if (found > 1) {
+		log_path(path, prev);
+		l->prev_fd = sys_open(path, o_rdonly | o_cloexec, 0, &err);
+		if (err != nil)
+			l->prev_fd = -1;
+		l->prev_base = prev;
+	}
+
+	map_len = sys_lseek(l->fd, 0, seek_end, &err);
+	if (err != nil)
+		map_len = 0;
+
+	len = map_len;
+	if (map_len > 0) {
+		p = log_map(l->fd, map_len);
+		if (p != nil) {
+			/* A line without its newline was cut by a crash. */
+			while (len > 0 && p[len - 1] != '\n')
+				len--;
+			if (len != map_len) {
+				err = sys_ftruncate(l->fd, len);
+				if (err != nil)
+					fmt_fprintf(stderr, "log_init: sys_ftruncate failed: %s\n", err->msg);
+			}
+			log_rebuild(l, h, p, len);
+			sys_munmap((uintptr) p, map_len);
+		}
+	}
+	l->seg_len = len;
+}
+
+static void log_sync_now(msg_log * l)
+{
+	const error *err;
+
+	err = sys_fsync(l->fd);
+	if (err != nil)
+		fmt_fprintf(stderr, "log_sync: sys_fsync failed: %s\n", err->msg);
+	l->unsynced = 0;
+	l->sync_at = 0;
+}
+
+static void log_sync_run(task * t, exec_worker * w)
+{
+	log_syncer *ls = (log_syncer *) t;
+
+	ls->err = sys_fsync(ls->fd);
+}
+
+static void log_sync_submit(msg_log * l)
+{
+	log_syncer *ls = &l->syncer;
+	const error *err;
+
+	ls->fd = sys_fcntl(l->fd, f_dupfd_cloexec, 0, &err);
+	if (err != nil) {
+		fmt_fprintf(stderr, "log_sync: sys_fcntl failed: %s\n", err->msg);
+		log_sync_now(l);
+		return;
+	}
+	ls->busy = true;
+	executor_submit(l->ex, &ls->t);
+}
+
+/* On the event loop once the fsync is over. Syncs asked for meanwhile
+ * were coalesced into one more.
+ */
+static void log_sync_done(task * t)
+{
+	log_syncer *ls = (log_syncer *) t;
+	msg_log *l = ls->l;
+
+	if (ls->err != nil)
+		fmt_fprintf(stderr, "log_sync: sys_fsync failed: %s\n", ls->err->msg);
+	sys_close(ls->fd);
+	ls->busy = false;
+	if (ls->again && l->fd != -1) {
+		ls->again = false;
+		log_sync_submit(l);
+	}
+}
+
+/* Hands the fsync to the executor if there is one. */
+static void log_sync(msg_log * l)
+{
+	if (l->ex == nil) {
+		log_sync_now(l);
+		return;
+	}
+	l->unsynced = 0;
+	l->sync_at = 0;
+	if (l->syncer.busy)
+		l->syncer.again = true;
+	else
+		log_sync_submit(l);
+}
+
+/* Writes the lines of this iteration and fsyncs if the group is full. */
+static void log_flush(msg_log * l)
+{
+	const error *err;
+	uint64 off = 0, old_base;
+	int64 w;
+	int old_fd;
+
+	if (l->fd == -1 || l->buf_used == 0)
+		return;
+
+	if (l->seg_len > 0 && l->seg_len + l->buf_used > log_segment_size) {
+		/* Rare, and a sync asked for later would be of the next one. */
+		log_sync_now(l);
+		old_fd = l->prev_fd;
+		old_base = l->prev_base;
+		l->prev_fd = l->fd;
+		l->prev_base = l->seg_base;
+		if (log_open_segment(l, l->seg_base + l->seg_len) != 0) {
+			/* The current segment grows on, the next flush tries again. */
+			l->fd = l->prev_fd;
+			l->prev_fd = old_fd;
+			l->prev_base = old_base;
+		} else if (old_fd != -1)
+			sys_close(old_fd);
+	}
+
+	while (off < l->buf_used) {
+		w = sys_write(l->fd, l->buf + off, l->buf_used - off, &err);
+		if (err != nil) {
+			if (err->code == EINTR)
+				continue;
+			fmt_fprintf(stderr, "log_flush: sys_write failed: %s\n", err->msg);
+			break;
+		}
+		off += w;
+	}
+
+	l->seg_len += off;
+	l->unsynced += off;
+	l->buf_used = 0;
+
+	if (l->unsynced >= log_sync_bytes)
+		log_sync(l);
+	else if (l->sync_at == 0)
+		l->sync_at = now_ms() + log_sync_ms;
+}
+
+static void log_append(msg_log * l, const char *line, uint64 len)
+{
+	if (l->fd == -1)
+		return;
+
+	if (l->buf_used + len > log_buf_size)
+		log_flush(l);
+
+	log_index_add(l, l->seg_base + l->seg_len + l->buf_used);
+	memcpy(l->buf + l->buf_used, line, len);
+	l->buf_used += len;
+}
+
+/* Fsyncs the group when its time is up. */
+static void log_tick(msg_log * l, int64 now)
+{
+	if (l->fd != -1 && l->sync_at != 0 && now >= l->sync_at)
+		log_sync(l);
+}
+
+/* =========== lines =========== */
+
+/* name (15:13:54 MSK): */
+static uint64 line_header_in_slice(slice s, const char *name, int len, int64 time_us)
+{
+	uint64 i;
+	struct tm t;
+
+	i = c_nstring_in_slice(s, name, len);
+	if (time_us == 0)
+		i += c_nstring_in_slice(slice_left(s, i), ": ", 2);
+	else {
+		t = time_to_tm(time_us / 1000000);
+		i += c_nstring_in_slice(slice_left(s, i), " (", 2);
+		i += tm_in_slice2(slice_left(s, i), &t);
+		i += c_nstring_in_slice(slice_left(s, i), "): ", 3);
+	}
+	return i;
+}
+
+/* A room line is kept as a frame, which binary clients get as is and
+ * the rest as text. The text has no line ending.
+ */
+static uint64 line_frame(char *buf, room * r, client * c, const char *text, uint64 len)
+{
+	bin_hdr h;
+	char *p = buf + sizeof(h);
+
+	h.len = r->name_len + c->name_used + len;
+	h.type = bin_line;
+	h.room_len = r->name_len;
+	h.name_len = c->name_used;
+	h.sender = c->id;
+	h.reserved = 0;
+	h.time_us = unix_us();
+
+	memcpy(buf, &h, sizeof(h));
+	memcpy(p, r->name, r->name_len);
+	p += r->name_len;
+	memcpy(p, c->name, c->name_used);
+	p += c->name_used;
+	memcpy(p, text, len);
+	return sizeof(h) + h.len;
+}
+
+/* #room name (15:13:54 MSK): text\n, lines of the lobby look as they
+ * did before rooms.
+ */
+static uint64 line_in_slice(slice s, const char *frame, int lobby)
+{
+	const char *p = frame + sizeof(bin_hdr);
+	uint64 i = 0;
+	bin_hdr h;
+
+	memcpy(&h, frame, sizeof(h));
+	if (lobby == false) {
+		i = c_nstring_in_slice(s, p, h.room_len);
+		i += c_nstring_in_slice(slice_left(s, i), " ", 1);
+	}
+	p += h.room_len;
+	i += line_header_in_slice(slice_left(s, i), p, h.name_len, h.time_us);
+	p += h.name_len;
+	i += c_nstring_in_slice(slice_left(s, i), p, h.len - h.room_len - h.name_len);
+	i += c_nstring_in_slice(slice_left(s, i), "\n", 1);
+	return i;
+}
+
+/* =========== rooms =========== */
+
+static room *room_find(server * serv, const char *name, int len)
+{
+	int i;
+	room *r;
+
+	for (i = 0; i < serv->n_rooms; i++) {
+		r = &serv->rooms[i];
+		if (r->name_len == len && memequal(r->name, name, len))
+			return r;
+	}
+	return nil;
+}
+
+static room *room_new(server * serv, const char *name, int len)
+{
+	int i;
+	room *r = nil;
+
+	/* Reuse a slot of a deleted room, clients keep pointers to rooms
+	 * so the table itself is never compacted.
+	 */
+	for (i = 0; i < serv->n_rooms; i++) {
+		if (serv->rooms[i].name_len == 0) {
+			r = &serv->rooms[i];
+			break;
+		}
+	}
+
+	if (r == nil) {
+		if (serv->n_rooms == max_rooms)
+			return nil;
+		r = &serv->rooms[serv->n_rooms++];
+	}
+
+	memcpy(r->name, name, len);
+	r->name_len = len;
+	r->n_members = 0;
+	r->cap = 0;
+	r->members = nil;
+
+	return r;
+}
+
+static void room_free(room * r)
+{
+	const error *err;
+
+	if (r->members != nil) {
+		err = sys_munmap((uintptr) r->members, r->cap * sizeof(room_member));
+		if (err != nil)
+			fmt_fprintf(stderr, "room_free: sys_munmap failed: %s\n", err->msg);
+	}
+	r->name_len = 0;
+	r->n_members = 0;
+	r->cap = 0;
+	r->members = nil;
+}
+
+static int room_grow(room * r)
+{
+	const error *err;
+	room_member *m;
+	uint64 cap;
+
+	cap = r->cap == 0 ? page_size / sizeof(room_member) : r->cap * 2;
+
+	m = sys_mmap((uintptr) nil, cap * sizeof(room_member), prot_read | prot_write, map_private | map_anonymous,
+				 -1, 0, &err);
+	if (err != nil) {
+		fmt_fprintf(stderr, "room_grow: sys_mmap failed: %s\n", err->msg);
+		return 1;
+	}
+
+	if (r->members != nil) {
+		memcpy(m, r->members, r->n_members * sizeof(room_member));
+		err = sys_munmap((uintptr) r->members, r->cap * sizeof(room_member));
+		if (err != nil)
+			fmt_fprintf(stderr, "room_grow: sys_munmap failed: %s\n", err->msg);
+	}
+
+	r->members = m;
+	r->cap = cap;
+	return 0;
+}
+
+/* Returns slot of the room in c->rooms or -1. */
+static int room_slot(client * c, room * r)
+{
+	int i;
+
+	for (i = 0; i < c->n_rooms; i++)
+		if (c->rooms[i].r == r)
+			return i;
+	return -1;
+}
+
+static int room_join(client * c, room * r)
+{
+	int slot;
+
+	if (c->n_rooms == max_joined_rooms)
+		return 1;
+
+	if (r->n_members == r->cap && room_grow(r) != 0)
+		return 2;
+
+	slot = c->n_rooms++;
+	c->rooms[slot].r = r;
+	c->rooms[slot].idx = r->n_members;
+
+	r->members[r->n_members].c = c;
+	r->members[r->n_members].slot = slot;
+	r->n_members++;
+
+	c->cur_room = r;
+	return 0;
+}
+
+static void room_leave(client * c, int slot, server * serv)
+{
+	membership *mb = &c->rooms[slot];
+	room *r = mb->r;
+	room_member *last;
+
+	/* Move the last member into the hole and fix its back reference. */
+	r->n_members--;
+	last = &r->members[r->n_members];
+	r->members[mb->idx] = *last;
+	last->c->rooms[last->slot].idx = mb->idx;
+
+	/* Same for the membership array of the client. */
+	c->n_rooms--;
+	if (slot != c->n_rooms) {
+		c->rooms[slot] = c->rooms[c->n_rooms];
+		mb = &c->rooms[slot];
+		mb->r->members[mb->idx].slot = slot;
+	}
+
+	if (c->cur_room == r)
+		c->cur_room = c->n_rooms > 0 ? c->rooms[c->n_rooms - 1].r : nil;
+
+	if (r->n_members == 0 && r != &serv->rooms[0])
+		room_free(r);
+}
+
+/* Binary members get the frame of a line, if there is one. */
+static void room_send(room * r, string msg, string frame, client * except, server * serv)
+{
+	int i, batch = false;
+	client *c;
+
+	for (i = 0; i < r->n_members; i++) {
+		c = r->members[i].c;
+		if (c->compress)
+			batch = true;
+		else if (except == c)
+			continue;
+		else if (c->binary && frame.len > 0)
+			session_out(c, frame.base, frame.len, serv);
+		else
+			session_write(c, msg.base, msg.len, serv);
+	}
+	if (batch)
+		zbatch_add(serv, r, msg);
+}
+
+/* =========== compression =========== */
+
+/* One frame of the batch goes to every compressed recipient. */
+static void zbatch_send(server * serv, zbatch * b)
+{
+	string f;
+	client *c;
+	int i;
+
+	f = zframe_make(serv, b->buf, b->len);
+	b->len = 0;
+
+	if (b->r != nil) {
+		for (i = 0; i < b->r->n_members; i++) {
+			c = b->r->members[i].c;
+			if (c->compress)
+				session_out(c, f.base, f.len, serv);
+		}
+		return;
+	}
+
+	for (i = 0; i < serv->n_pls; i++)
+		for (c = serv->first_clp[i]->client; c != nil; c = c->next)
+			if (c->compress)
+				session_out(c, f.base, f.len, serv);
+}
+
+/* Sends the batches of this iteration. */
+static void zbatch_flush(server * serv)
+{
+	int i;
+
+	for (i = 0; i < serv->n_zb; i++)
+		if (serv->zb[i].len > 0)
+			zbatch_send(serv, &serv->zb[i]);
+	serv->n_zb = 0;
+}
+
+/* Compressed clients get the lines of their rooms as they are, their own
+ * lines too, which lets all of them share one frame per batch.
+ */
+static void zbatch_add(server * serv, room * r, string msg)
+{
+	zbatch *b = nil;
+	int i;
+
+	for (i = 0; i < serv->n_zb; i++)
+		if (serv->zb[i].r == r) {
+			b = &serv->zb[i];
+			break;
+		}
+
+	if (b == nil) {
+		if (serv->n_zb == max_zbatches)
+			zbatch_flush(serv);
+		b = &serv->zb[serv->n_zb++];
+		b->r = r;
+		b->len = 0;
+	} else if (b->len + msg.len > zblock_size)
+		zbatch_send(serv, b);
+
+	memcpy(b->buf + b->len, msg.base, msg.len);
+	b->len += msg.len;
+}
+
+/* =========== presence =========== */
+
+/* Notes a join or a leave for the next digest. */
+static void presence_add(server * serv, client * c, int joined)
+{
+	presence *p = &serv->pres;
+	uint64 n = p->joined + p->left;
+	slice s;
+
+	if (n == 0) {
+		memcpy(p->first, c->name, c->name_used);
+		p->first_len = c->name_used;
+	}
+
+	if (n < presence_names) {
+		s = unsafe_slice(p->buf + p->buf_used, sizeof(p->buf) - p->buf_used);
+		p->buf_used += c_nstring_in_slice(s, c->name, c->name_used);
+		s = slice_left(s, c->name_used);
+		if (joined)
+			p->buf_used += c_nstring_in_slice(s, entered_msg, sizeof(entered_msg) - 1);
+		else
+			p->buf_used += c_nstring_in_slice(s, left_msg, sizeof(left_msg) - 1);
+	}
+
+	if (joined)
+		p->joined++;
+	else
+		p->left++;
+}
+
+/* Tells everyone who came and went. A few events go by name, as single
+ * notices did, a reconnect storm is told as "42 users joined, 17 left",
+ * so presence costs a write per client per digest whatever the churn.
+ */
+static void presence_flush(server * serv, int64 now)
+{
+	presence *p = &serv->pres;
+	char msg[2 * 20 + sizeof(users_joined_msg) + sizeof(users_left_msg)];
+	uint64 n = p->joined + p->left, i;
+	client *except = nil;
+	string m;
+	slice s;
+
+	if (n == 0)
+		return;
+
+	if (n <= presence_names) {
+		m = unsafe_string(p->buf, p->buf_used);
+		/* The newcomer has had the welcome already. */
+		if (p->joined == 1 && p->left == 0)
+			except = name_find(&serv->names, p->first, p->first_len);
+	} else {
+		s = unsafe_slice(msg, sizeof(msg));
+		i = int_in_slice(s, p->joined);
+		i += c_nstring_in_slice(slice_left(s, i), users_joined_msg, sizeof(users_joined_msg) - 1);
+		i += int_in_slice(slice_left(s, i), p->left);
+		i += c_nstring_in_slice(slice_left(s, i), users_left_msg, sizeof(users_left_msg) - 1);
+		m = unsafe_string(msg, i);
+	}
+
+	session_send_all(m, except, serv);
+	bus_publish(serv, bus_all, nil, 0, m.base, m.len);
+
+	if (n > presence_names)
+		p->interval_ms = p->interval_ms == 0 ? presence_min_ms : p->interval_ms * 2;
+	else
+		p->interval_ms /= 2;
+	if (p->interval_ms > presence_max_ms)
+		p->interval_ms = presence_max_ms;
+	else if (p->interval_ms < presence_min_ms)
+		p->interval_ms = 0;
+
+	p->last = now;
+	p->digests++;
+	p->events += n;
+	p->joined = 0;
+	p->left = 0;
+	p->buf_used = 0;
+}
+
+static void presence_tick(server * serv, int64 now)
+{
+	presence *p = &serv->pres;
+
+	if (p->joined + p->left > 0 && now >= p->last + p->interval_ms)
+		presence_flush(serv, now);
+}
+
+/* name has joined #room\n */
+static void room_notify(room * r, client * c, const char *what, uint64 what_len, server * serv)
+{
+	char msg[max_name_len + sizeof(joined_msg) + max_room_name_len + 1];
+	slice s;
+	int n;
+
+	memcpy(msg, c->name, c->name_used);
+	s = unsafe_slice(msg, sizeof(msg));
+	n = c->name_used;
+	n += c_nstring_in_slice(slice_left(s, n), what, what_len);
+	n += c_nstring_in_slice(slice_left(s, n), r->name, r->name_len);
+	n += c_nstring_in_slice(slice_left(s, n), "\n", 1);
+	room_send(r, get_string(slice_right(s, n)), unsafe_string(nil, 0), c, serv);
+	bus_publish(serv, bus_notice, r->name, r->name_len, msg, n);
+}
+
+/* =========== bus =========== */
+
+static int is_master(server * serv)
+{
+	return serv->bus != nil && serv->worker == serv->bus->n_workers;
+}
+
+static void bus_publish(server * serv, int type, const char *key, int key_len, const char *msg, uint64 len)
+{
+	bus *b = serv->bus;
+	bus_cell *cell;
+	uint64 n;
+
+	if (b == nil || key_len + len > sizeof(cell->data))
+		return;
+
+	n = __atomic_fetch_add(&b->head, 1, __ATOMIC_SEQ_CST);
+	/* If we die before the record is complete, the master completes it. */
+	__atomic_store_n(&b->claim[serv->worker], n + 1, __ATOMIC_RELAXED);
+
+	cell = &b->cells[n % bus_cells];
+	__atomic_store_n(&cell->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	cell->type = type;
+	cell->origin = serv->worker;
+	cell->key_len = key_len;
+	cell->len = len;
+	memcpy(cell->data, key, key_len);
+	memcpy(cell->data + key_len, msg, len);
+
+	__atomic_store_n(&cell->seq, n + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&b->claim[serv->worker], 0, __ATOMIC_RELAXED);
+	serv->bus_dirty = true;
+}
+
+/* Wakes the consumers that went to sleep, once per iteration. */
+static void bus_wake(server * serv)
+{
+	bus *b = serv->bus;
+	uint64 one = 1;
+	int i;
+
+	if (b == nil || serv->bus_dirty == false)
+		return;
+	serv->bus_dirty = false;
+
+	for (i = 0; i <= b->n_workers; i++)
+		if (i != serv->worker && __atomic_load_n(&b->waiting[i], __ATOMIC_SEQ_CST) == 1
+			&& __atomic_exchange_n(&b->waiting[i], 0, __ATOMIC_SEQ_CST) == 1)
+			sys_write(b->efd[i], (char *) &one, sizeof(one), nil);
+}
+
+/* Asks producers to wake us up. Returns false if there is something to
+ * read already, the caller must not block then.
+ */
+static int bus_sleep(server * serv)
+{
+	bus *b = serv->bus;
+
+	__atomic_store_n(&b->waiting[serv->worker], 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&b->head, __ATOMIC_SEQ_CST) == serv->bus_pos)
+		return true;
+	__atomic_store_n(&b->waiting[serv->worker], 0, __ATOMIC_RELAXED);
+	return false;
+}
+
+/* Lines travel as frames, each worker renders them for its clients. */
+static void bus_deliver(bus_cell * rec, server * serv)
+{
+	string msg = unsafe_string(rec->data + rec->key_len, rec->len);
+	char *line = serv->lines.msg;
+	room *r;
+	client *to;
+	uint64 n;
+
+	switch (rec->type) {
+	case bus_line:
+		if (msg.len < sizeof(bin_hdr))
+			break;
+		r = room_find(serv, rec->data, rec->key_len);
+		n = line_in_slice(unsafe_slice(line, serv->lines.msg_size), msg.base, r == &serv->rooms[0]);
+		if (r == &serv->rooms[0])
+			history_add(&serv->hist, line, n);
+		log_append(&serv->log, line, n);
+		if (r != nil)
+			room_send(r, unsafe_string(line, n), msg, nil, serv);
+		break;
+	case bus_notice:
+		r = room_find(serv, rec->data, rec->key_len);
+		if (r != nil)
+			room_send(r, msg, unsafe_string(nil, 0), nil, serv);
+		break;
+	case bus_all:
+		session_send_all(msg, nil, serv);
+		break;
+	case bus_private:
+		to = name_find(&serv->names, rec->data, rec->key_len);
+		if (to != nil)
+			session_write(to, msg.base, msg.len, serv);
+		break;
+	}
+}
+
+/* Reads the records of other workers up to the first incomplete one. */
+static void bus_poll(server * serv)
+{
+	bus *b = serv->bus;
+	bus_cell *cell, rec;
+	uint64 seq, head, lost;
+
+	for (;;) {
+		head = __atomic_load_n(&b->head, __ATOMIC_SEQ_CST);
+		if (head - serv->bus_pos > bus_cells) {
+			lost = head - bus_cells - serv->bus_pos;
+			fmt_fprintf(stderr, "bus_poll: consumer %d lost %d records\n", serv->worker, (int) lost);
+			serv->bus_pos = head - bus_cells;
+		}
+		if (serv->bus_pos == head)
+			return;
+
+		cell = &b->cells[serv->bus_pos % bus_cells];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		if (seq != serv->bus_pos + 1)
+			/* Still being written, or overwritten, what the head tells next time. */
+			return;
+
+		rec.type = cell->type;
+		rec.origin = cell->origin;
+		rec.key_len = cell->key_len;
+		rec.len = cell->len;
+		if (rec.key_len + rec.len > sizeof(rec.data))
+			rec.type = bus_none;
+		else
+			memcpy(rec.data, cell->data, rec.key_len + rec.len);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&cell->seq, __ATOMIC_RELAXED) != seq)
+			continue;
+
+		serv->bus_pos++;
+		if (rec.origin != serv->worker)
+			bus_deliver(&rec, serv);
+	}
+}
+
+static void bus_names_lock(server * serv)
+{
+	uint32 free;
+
+	for (;;) {
+		free = 0;
+		if (__atomic_compare_exchange_n(&serv->bus->names_lock, &free, serv->worker + 1, false,
+										__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return;
+		__builtin_ia32_pause();
+	}
+}
+
+static void bus_names_unlock(server * serv)
+{
+	__atomic_store_n(&serv->bus->names_lock, 0, __ATOMIC_RELEASE);
+}
+
+/* Slot of the name or of the free slot ending its probe chain. */
+static uint64 bus_name_slot(bus * b, const char *name, int len, uint64 h)
+{
+	uint64 i = h & b->names_mask;
+	bus_name *e;
+
+	for (;;) {
+		e = &b->names[i];
+		if (e->owner == 0 || (e->hash == h && e->len == len && memequal(e->name, name, len)))
+			return i;
+		i = (i + 1) & b->names_mask;
+	}
+}
+
+/* Backward shift deletion, as in name_remove. */
+static void bus_name_delete(bus * b, uint64 i)
+{
+	uint64 j = i, k, mask = b->names_mask;
+
+	for (;;) {
+		j = (j + 1) & mask;
+		if (b->names[j].owner == 0)
+			break;
+
+		k = b->names[j].hash & mask;
+		if ((i < j) ? (k <= i || k > j) : (k <= i && k > j)) {
+			b->names[i] = b->names[j];
+			i = j;
+		}
+	}
+	b->names[i].owner = 0;
+	b->names_used--;
+}
+
+/* Takes the name for the client in all workers. Returns 1 if the name
+ * is taken.
+ */
+static int name_claim(client * c, server * serv)
+{
+	bus *b = serv->bus;
+	bus_name *e;
+	uint64 i;
+	int taken = 0;
+
+	if (b != nil) {
+		bus_names_lock(serv);
+		e = &b->names[bus_name_slot(b, c->name, c->name_used, name_hash(c->name, c->name_used))];
+		if (e->owner != 0 || (uint64) b->names_used > b->names_mask / 2)
+			taken = 1;
+		else {
+			e->owner = serv->worker + 1;
+			e->len = c->name_used;
+			e->hash = name_hash(c->name, c->name_used);
+			memcpy(e->name, c->name, c->name_used);
+			b->names_used++;
+		}
+		bus_names_unlock(serv);
+	}
+
+	if (taken == 0 && name_insert(&serv->names, c) != 0) {
+		taken = 1;
+		if (b != nil) {
+			/* Give the registry entry back, or no worker could take the name. */
+			bus_names_lock(serv);
+			i = bus_name_slot(b, c->name, c->name_used, c->name_hash);
+			if (b->names[i].owner == serv->worker + 1)
+				bus_name_delete(b, i);
+			bus_names_unlock(serv);
+		}
+	}
+	return taken;
+}
+
+static void name_release(client * c, server * serv)
+{
+	bus *b = serv->bus;
+	uint64 i;
+
+	name_remove(&serv->names, c);
+	if (b == nil)
+		return;
+
+	bus_names_lock(serv);
+	i = bus_name_slot(b, c->name, c->name_used, c->name_hash);
+	if (b->names[i].owner == serv->worker + 1)
+		bus_name_delete(b, i);
+	bus_names_unlock(serv);
+}
+
+/* Is the name known in some other worker? */
+static int name_elsewhere(server * serv, const char *name, int len)
+{
+	bus *b = serv->bus;
+	uint64 i;
+	int found;
+
+	if (b == nil)
+		return false;
+
+	bus_names_lock(serv);
+	i = bus_name_slot(b, name, len, name_hash(name, len));
+	found = b->names[i].owner != 0 && b->names[i].owner != serv->worker + 1;
+	bus_names_unlock(serv);
+	return found;
+}
+
+/* Cleans up after a dead worker: its lock, its names and the record it
+ * may have been writing.
+ */
+static void bus_forget(server * serv, int w)
+{
+	bus *b = serv->bus;
+	bus_cell *cell;
+	uint64 i, n;
+	uint32 held = w + 1;
+
+	__atomic_compare_exchange_n(&b->names_lock, &held, 0, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+
+	bus_names_lock(serv);
+	i = 0;
+	while (i <= b->names_mask) {
+		/* A shifted entry lands in i, look at it again. */
+		if (b->names[i].owner == w + 1)
+			bus_name_delete(b, i);
+		else
+			i++;
+	}
+	bus_names_unlock(serv);
+
+	n = __atomic_load_n(&b->claim[w], __ATOMIC_ACQUIRE);
+	if (n != 0) {
+		cell = &b->cells[(n - 1) % bus_cells];
+		cell->type = bus_none;
+		cell->len = 0;
+		cell->key_len = 0;
+		__atomic_store_n(&cell->seq, n, __ATOMIC_RELEASE);
+		b->claim[w] = 0;
+	}
+}
+
+static int worker_spawn(server * serv, int w)
+{
+	const error *err;
+	int pid;
+
+	pid = sys_fork(&err);
+	if (err != nil) {
+		fmt_fprintf(stderr, "worker_spawn: sys_fork failed: %s\n", err->msg);
+		return 1;
+	}
+
+	if (pid == 0) {
+		/* Workers talk to clients, only the master writes the log. */
+		serv->worker = w;
+		serv->ls = serv->bus->ls[w];
+		serv->bus_pos = __atomic_load_n(&serv->bus->head, __ATOMIC_SEQ_CST);
+		/* Ids of clients are unique across the workers. */
+		serv->next_id = (uint32) (w + 1) << 24;
+		if (serv->log.fd != -1)
+			sys_close(serv->log.fd);
+		if (serv->log.prev_fd != -1)
+			sys_close(serv->log.prev_fd);
+		serv->log.fd = -1;
+		serv->log.prev_fd = -1;
+		serv->log.sync_at = 0;
+		/* Threads don't survive fork, the executor is the master's. */
+		serv->log.ex = nil;
+		serv->exec = nil;
+
+		sys_close(serv->epfd);
+		serv->epfd = sys_epoll_create1(epoll_cloexec, &err);
+		if (err != nil) {
+			fmt_fprintf(stderr, "worker_spawn: sys_epoll_create1 failed: %s\n", err->msg);
+			sys_exit_group(1);
+		}
+		sys_prctl(pr_set_pdeathsig, sigterm);
+		sys_exit_group(server_go(serv));
+	}
+
+	serv->bus->pid[w] = pid;
+	return 0;
+}
+
+/* Restarts workers that have died, their clients are gone with them. */
+static void master_reap(server * serv)
+{
+	bus *b = serv->bus;
+	const error *err;
+	int pid, status, w;
+
+	for (;;) {
+		pid = sys_wait4(-1, &status, wnohang, &err);
+		if (err != nil || pid <= 0)
+			return;
+
+		for (w = 0; w < b->n_workers; w++)
+			if (b->pid[w] == pid)
+				break;
+		if (w == b->n_workers)
+			continue;
+
+		if (serv->drain.on) {
+			b->pid[w] = 0;
+			continue;
+		}
+		fmt_fprintf(stderr, "master_reap: worker %d (pid %d) exited with status %d, restarting\n", w, pid, status);
+		bus_forget(serv, w);
+		worker_spawn(serv, w);
+	}
+}
+
+static int server_init(server * serv, uint16 port);
+
+/* Maps the bus and binds a listener for each worker. The kernel spreads
+ * connections over the listeners, a restarted worker takes over the
+ * listener and the queued connections of the dead one.
+ */
+static int master_init(server * serv, int n_workers, uint16 port)
+{
+	const error *err;
+	bus *b;
+	int i;
+
+	b = sys_mmap((uintptr) nil, sizeof(bus) + serv->lim.bus_name_slots * sizeof(bus_name), prot_read | prot_write,
+				 map_shared | map_anonymous, -1, 0, &err);
+	if (err != nil) {
+		fmt_fprintf(stderr, "master_init: sys_mmap failed: %s\n", err->msg);
+		return 1;
+	}
+	b->n_workers = n_workers;
+	b->names_mask = serv->lim.bus_name_slots - 1;
+
+	for (i = 0; i <= n_workers; i++) {
+		b->efd[i] = sys_eventfd(0, efd_nonblock | efd_cloexec, &err);
+		if (err != nil) {
+			fmt_fprintf(stderr, "master_init: sys_eventfd failed: %s\n", err->msg);
+			return 2;
+		}
+	}
+
+	serv->bus = b;
+	serv->worker = n_workers;
+	serv->bus_pos = 0;
+
+	for (i = 0; i < n_workers; i++) {
+		if (server_init(serv, port) != 0)
+			return 3;
+		b->ls[i] = serv->ls;
+	}
+	/* The master itself doesn't accept. */
+	serv->ls = -1;
+	return 0;
+}
+
+static int master_spawn(server * serv)
+{
+	int i;
+
+	for (i = 0; i < serv->bus->n_workers; i++)
+		if (worker_spawn(serv, i) != 0)
+			return 1;
+	return 0;
+}
+
+/* =========== flow control =========== */
+
+/* Edge triggered epoll reports what is pending when a descriptor is
+ * armed again, nothing is lost while paused.
+ */
+static void flow_set(server * serv, int paused)
+{
+	struct epoll_event ev;
+	const error *err;
+	client *c;
+	int i;
+
+	serv->flow.paused = paused;
+	for (i = 0; i < serv->n_pls; i++)
+		for (c = serv->first_clp[i]->client; c != nil; c = c->next) {
+			if (c->closing)
+				continue;
+			ev.events = paused ? EPOLLOUT | EPOLLET : EPOLLIN | EPOLLOUT | EPOLLET;
+			ev.data.ptr = c;
+			err = sys_epoll_ctl(serv->epfd, epoll_ctl_mod, c->fd, &ev);
+			if (err != nil)
+				fmt_fprintf(stderr, "flow_set: sys_epoll_ctl failed: %s\n", err->msg);
+		}
+
+	ev.events = EPOLLIN | EPOLLET;
+	if (serv->ls != -1) {
+		ev.data.ptr = serv;
+		err = sys_epoll_ctl(serv->epfd, paused ? epoll_ctl_del : epoll_ctl_add, serv->ls, &ev);
+		if (err != nil)
+			fmt_fprintf(stderr, "flow_set: sys_epoll_ctl (listener) failed: %s\n", err->msg);
+	}
+	if (serv->uls != -1 && !is_master(serv)) {
+		ev.data.ptr = &serv->uls;
+		err = sys_epoll_ctl(serv->epfd, paused ? epoll_ctl_del : epoll_ctl_add, serv->uls, &ev);
+		if (err != nil)
+			fmt_fprintf(stderr, "flow_set: sys_epoll_ctl (unix) failed: %s\n", err->msg);
+	}
+}
+
+/* Returns true while senders have to wait for the output to drain. */
+static int flow_check(server * serv)
+{
+	/* Draining, the server reads no more. */
+	if (serv->drain.on)
+		return true;
+	if (!serv->flow.paused && serv->flow.segs >= serv->flow.pause_at) {
+		serv->flow.pauses++;
+		flow_set(serv, true);
+	} else if (serv->flow.paused && serv->flow.segs <= serv->flow.resume_at)
+		flow_set(serv, false);
+	return serv->flow.paused;
+}
+
+/* =========== ready list =========== */
+
+static void ready_push(client * c, server * serv)
+{
+	c->ready = true;
+	c->ready_next = nil;
+	c->ready_prev = serv->ready_tail;
+	if (serv->ready_tail != nil)
+		serv->ready_tail->ready_next = c;
+	else
+		serv->ready_head = c;
+	serv->ready_tail = c;
+	serv->n_ready++;
+}
+
+static void ready_remove(client * c, server * serv)
+{
+	if (c->ready_prev != nil)
+		c->ready_prev->ready_next = c->ready_next;
+	else
+		serv->ready_head = c->ready_next;
+	if (c->ready_next != nil)
+		c->ready_next->ready_prev = c->ready_prev;
+	else
+		serv->ready_tail = c->ready_prev;
+	c->ready = false;
+	c->ready_prev = nil;
+	c->ready_next = nil;
+	serv->n_ready--;
+}
+
+/* =========== commands =========== */
+
+static int is_space(char ch)
+{
+	return ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n';
+}
+
+/* Returns the next space separated word of line starting at *pos. */
+static string next_word(const char *line, int len, int *pos)
+{
+	int start;
+
+	while (*pos < len && is_space(line[*pos]))
+		(*pos)++;
+	start = *pos;
+	while (*pos < len && !is_space(line[*pos]))
+		(*pos)++;
+
+	return unsafe_string(line + start, *pos - start);
+}
+
+static int is_room_name(string name)
+{
+	return name.len > 1 && name.len < max_room_name_len && name.base[0] == '#';
+}
+
+static void command_join(client * c, string name, server * serv)
+{
+	room *r;
+	int slot;
+
+	if (!is_room_name(name)) {
+		session_write(c, bad_room_msg, sizeof(bad_room_msg) - 1, serv);
+		return;
+	}
+
+	r = room_find(serv, name.base, name.len);
+	if (r != nil) {
+		slot = room_slot(c, r);
+		if (slot != -1) {
+			/* Already there, just talk to it. */
+			c->cur_room = r;
+			return;
+		}
+	}
+
+	if (c->n_rooms == max_joined_rooms) {
+		session_write(c, too_many_rooms_msg, sizeof(too_many_rooms_msg) - 1, serv);
+		return;
+	}
+
+	if (r == nil) {
+		r = room_new(serv, name.base, name.len);
+		if (r == nil) {
+			session_write(c, room_limit_msg, sizeof(room_limit_msg) - 1, serv);
+			return;
+		}
+	}
+
+	if (room_join(c, r) != 0) {
+		if (r->n_members == 0)
+			room_free(r);
+		session_write(c, room_limit_msg, sizeof(room_limit_msg) - 1, serv);
+		return;
+	}
+
+	room_notify(r, c, joined_msg, sizeof(joined_msg) - 1, serv);
+}
+
+static void command_part(client * c, string name, server * serv)
+{
+	room *r;
+	int slot = -1;
+
+	if (name.len == 0)
+		r = c->cur_room;
+	else
+		r = room_find(serv, name.base, name.len);
+
+	if (r != nil)
+		slot = room_slot(c, r);
+
+	if (slot == -1) {
+		session_write(c, not_member_msg, sizeof(not_member_msg) - 1, serv);
+		return;
+	}
+
+	/* Notify before leaving, the room may be freed. */
+	room_notify(r, c, parted_msg, sizeof(parted_msg) - 1, serv);
+	room_leave(c, slot, serv);
+}
+
+/* The lookup touches only the probe chain of the name, not the roster. */
+static void command_msg(client * c, string name, string text, server * serv)
+{
+	char *msg = serv->lines.msg;
+	slice s;
+	client *to;
+	uint64 n;
+
+	if (name.len == 0 || text.len == 0) {
+		session_write(c, msg_usage_msg, sizeof(msg_usage_msg) - 1, serv);
+		return;
+	}
+
+	to = name_find(&serv->names, name.base, name.len);
+	if (to == nil && !name_elsewhere(serv, name.base, name.len)) {
+		session_write(c, no_user_msg, sizeof(no_user_msg) - 1, serv);
+		return;
+	}
+
+	s = unsafe_slice(msg, serv->lines.msg_size);
+	n = c_nstring_in_slice(s, private_msg, sizeof(private_msg) - 1);
+	n += line_header_in_slice(slice_left(s, n), c->name, c->name_used, unix_us());
+	n += string_in_slice(slice_left(s, n), text);
+	if (to != nil)
+		session_write(to, msg, n, serv);
+	else
+		/* The worker that has the name delivers it. */
+		bus_publish(serv, bus_private, name.base, name.len, msg, n);
+}
+
+/* Streams the name index in chunks. The next chunk is produced only
+ * when the previous one has left the output queue, so a long listing
+ * never sits in memory. Names that move while the listing is paused
+ * may be shown twice or skipped. With workers the shared registry is
+ * listed, so everyone is there.
+ */
+static void command_who(client * c, server * serv)
+{
+	char buf[who_chunk];
+	name_index *ni = &serv->names;
+	bus *b = serv->bus;
+	bus_name *e;
+	client *t;
+	slice s;
+	uint64 n, mask = b != nil ? b->names_mask : ni->mask;
+	int used;
+
+	buf[0] = '\0';
+	s = unsafe_slice(buf, sizeof(buf));
+	while (c->who_pos != -1 && c->out_head == nil && c->closing == false) {
+		n = 0;
+		if (b != nil)
+			bus_names_lock(serv);
+		while (c->who_pos <= mask && n + max_name_len + 1 <= sizeof(buf)) {
+			if (b != nil) {
+				e = &b->names[c->who_pos++];
+				if (e->owner != 0) {
+					n += c_nstring_in_slice(slice_left(s, n), e->name, e->len);
+					n += c_nstring_in_slice(slice_left(s, n), "\n", 1);
+				}
+				continue;
+			}
+
+			t = ni->slots[c->who_pos++];
+			if (t != nil) {
+				n += c_nstring_in_slice(slice_left(s, n), t->name, t->name_used);
+				n += c_nstring_in_slice(slice_left(s, n), "\n", 1);
+			}
+		}
+		used = b != nil ? b->names_used : ni->used;
+		if (b != nil)
+			bus_names_unlock(serv);
+
+		if (c->who_pos > mask) {
+			n += c_nstring_in_slice(slice_left(s, n), who_end_msg, sizeof(who_end_msg) - 1);
+			n += int_in_slice(slice_left(s, n), used);
+			n += c_nstring_in_slice(slice_left(s, n), "\n", 1);
+			c->who_pos = -1;
+		}
+
+		session_write(c, buf, n, serv);
+	}
+}
+
+/* Returns 0 if s is a decimal number, stored in *v. */
+static int string_to_uint(string s, uint64 * v)
+{
+	uint64 i;
+
+	*v = 0;
+	if (s.len == 0 || s.len > 19)
+		return 1;
+	for (i = 0; i < s.len; i++) {
+		if (s.base[i] < '0' || s.base[i] > '9')
+			return 1;
+		*v = *v * 10 + s.base[i] - '0';
+	}
+	return 0;
+}
+
+/* Queues a piece of the log, binary clients get it in a bin_text frame
+ * of its own, so it still goes out with sendfile.
+ */
+static int history_queue_file(client * c, int fd, uint64 off, uint64 len, server * serv)
+{
+	bin_hdr h;
+
+	if (c->binary) {
+		bin_hdr_set(&h, bin_text, len);
+		if (session_queue(c, (char *) &h, sizeof(h), serv) != 0)
+			return 1;
+	}
+	return session_queue_file(c, fd, off, len, serv);
+}
+
+/* Queues the log from offset from to end and the end of replay line. */
+static int history_queue(client * c, uint64 from, uint64 end, server * serv)
+{
+	char buf[sizeof(history_end_msg) + 24];
+	msg_log *l = &serv->log;
+	bin_hdr h;
+	string f;
+	slice s;
+	uint64 n;
+
+	if (from < l->seg_base) {
+		if (history_queue_file(c, l->prev_fd, from - l->prev_base, l->seg_base - from, serv) != 0)
+			return 1;
+		from = l->seg_base;
+	}
+	if (from < end && history_queue_file(c, l->fd, from - l->seg_base, end - from, serv) != 0)
+		return 1;
+
+	memcpy(buf, history_end_msg, sizeof(history_end_msg) - 1);
+	s = unsafe_slice(buf, sizeof(buf));
+	n = sizeof(history_end_msg) - 1;
+	n += int_in_slice(slice_left(s, n), end);
+	n += c_nstring_in_slice(slice_left(s, n), "\n", 1);
+	if (c->compress) {
+		f = zframe_make(serv, buf, n);
+		return session_queue(c, f.base, f.len, serv);
+	}
+	if (c->binary) {
+		bin_hdr_set(&h, bin_text, n);
+		if (session_queue(c, (char *) &h, sizeof(h), serv) != 0)
+			return 1;
+	}
+	return session_queue(c, buf, n, serv);
+}
+
+/* Replays the log from an offset, or its last lines, straight
+ * from the segment files with sendfile. Only the master of the log has
+ * the index, so workers can't replay.
+ */
+static void command_history(client * c, string how, string arg, server * serv)
+{
+	msg_log *l = &serv->log;
+	uint64 v, k, from, end;
+	int bad, since;
+
+	if (l->fd == -1 || serv->bus != nil) {
+		session_write(c, history_off_msg, sizeof(history_off_msg) - 1, serv);
+		return;
+	}
+
+	since = how.len == 5 && memequal(how.base, "since", 5);
+	if (since)
+		bad = string_to_uint(arg, &v);
+	else if (how.len == 0) {
+		bad = 0;
+		v = history_len;
+	} else
+		bad = string_to_uint(how, &v) || arg.len > 0;
+	if (bad) {
+		session_write(c, history_usage_msg, sizeof(history_usage_msg) - 1, serv);
+		return;
+	}
+
+	/* One replay at a time, each keeps the segment files open. */
+	if (c->out_head != nil) {
+		session_write(c, history_busy_msg, sizeof(history_busy_msg) - 1, serv);
+		return;
+	}
+
+	log_flush(l);
+	end = l->seg_base + l->seg_len;
+
+	if (since)
+		k = log_index_find(l, v);
+	else {
+		k = log_index_find(l, 0);
+		if (l->idx_count - k > v)
+			k = l->idx_count - v;
+	}
+	from = k < l->idx_count ? l->idx[k % log_index_len] : end;
+
+	if (history_queue(c, from, end, serv) != 0) {
+		fmt_fprintf(stderr, "command_history: out of output segments, dropping client\n");
+		session_kill(c, serv);
+		return;
+	}
+	session_flush(c, serv);
+}
+
+/* The rest of the stream goes in frames, see zframe_make. */
+static void command_compress(client * c, server * serv)
+{
+	if (c->binary) {
+		session_write(c, compress_bin_msg, sizeof(compress_bin_msg) - 1, serv);
+		return;
+	}
+	if (c->compress)
+		return;
+	session_write(c, compress_msg, sizeof(compress_msg) - 1, serv);
+	c->compress = true;
+}
+
+/* Everything after the first word of the line, without the line ending. */
+static string rest_of_line(const char *line, int len, int pos)
+{
+	while (pos < len && is_space(line[pos]))
+		pos++;
+	while (len > pos && is_space(line[len - 1]))
+		len--;
+	return unsafe_string(line + pos, len - pos);
+}
+
+static void session_command(client * c, const char *line, int len, server * serv)
+{
+	string cmd, arg;
+	int pos = 0;
+
+	cmd = next_word(line, len, &pos);
+	arg = next_word(line, len, &pos);
+
+	if (cmd.len == 5 && memequal(cmd.base, "/join", 5))
+		command_join(c, arg, serv);
+	else if (cmd.len == 5 && memequal(cmd.base, "/part", 5))
+		command_part(c, arg, serv);
+	else if (cmd.len == 4 && memequal(cmd.base, "/msg", 4)) {
+		string text = rest_of_line(line, len, pos);
+		/* keep the line ending */
+		if (text.len > 0)
+			text.len = line + len - text.base;
+		command_msg(c, arg, text, serv);
+	} else if (cmd.len == 4 && memequal(cmd.base, "/who", 4)) {
+		c->who_pos = 0;
+		command_who(c, serv);
+	} else if (cmd.len == 8 && memequal(cmd.base, "/history", 8)) {
+		string since = next_word(line, len, &pos);
+		command_history(c, arg, since, serv);
+	} else if (cmd.len == 9 && memequal(cmd.base, "/compress", 9))
+		command_compress(c, serv);
+	else
+		session_write(c, unknown_cmd_msg, sizeof(unknown_cmd_msg) - 1, serv);
+}
+
+static void session_line(client * c, const char *line, int len, server * serv)
+{
+	char *frame = serv->lines.frame, *msg = serv->lines.msg;
+	room *r = c->cur_room;
+	uint64 f, n;
+
+	if (line[0] == '/') {
+		session_command(c, line, len, serv);
+		return;
+	}
+
+	if (r == nil) {
+		session_write(c, no_room_msg, sizeof(no_room_msg) - 1, serv);
+		return;
+	}
+
+	/* The line ending is the renderer's business. */
+	len--;
+	if (len > 0 && line[len - 1] == '\r')
+		len--;
+
+	/* Whoever hears the line should have heard of its author. */
+	if (serv->pres.joined + serv->pres.left > 0)
+		presence_tick(serv, now_ms());
+
+	f = line_frame(frame, r, c, line, len);
+	n = line_in_slice(unsafe_slice(msg, serv->lines.msg_size), frame, r == &serv->rooms[0]);
+
+	room_send(r, unsafe_string(msg, n), unsafe_string(frame, f), c, serv);
+	if (r == &serv->rooms[0])
+		history_add(&serv->hist, msg, n);
+	log_append(&serv->log, msg, n);
+	bus_publish(serv, bus_line, r->name, r->name_len, frame, f);
+}
+
+static void session_close(client * c, server * serv)
+{
+	client **pcur;
+	client_pool *clp;
+	client *t;
+	const error *err;
+	int i = 0;
+
+	if (c->name_ok == true)
+		presence_add(serv, c, false);
+	while (c->n_rooms > 0)
+		room_leave(c, c->n_rooms - 1, serv);
+	if (c->name_ok == true)
+		name_release(c, serv);
+	session_drop_output(c, serv);
+	if (c->ready)
+		ready_remove(c, serv);
+	sys_close(c->fd);
+
+	for (i = 0; i < serv->n_pls; i++) {
+		clp = serv->first_clp[i];
+		pcur = &(clp->client);
+		while (*pcur != nil) {
+			if (*pcur == c) {
+				t = *pcur;
+				*pcur = (*pcur)->next;
+				clp->free_ch++;
+				clp->used_ch--;
+				if (serv->n_pls > 1 && clp->used_ch == 0) {
+					err = sys_munmap((uintptr) clp, clp->map_len);
+					if (err != nil) {
+						fmt_fprintf(stderr, "session_close: sys_munmap failed: %s\n", err->msg);
+					}
+					serv->mem.clp_unmaps++;
+#ifdef DEBUG_PRINT
+					int n;
+					for (n = 0; n < serv->n_pls; n++)
+						fmt_fprintf(stdout, "before: serv->first_clp[%d]: %p\n", n, serv->first_clp[n]);
+#endif
+
+					/* shift pools in the left after delete one */
+					serv->n_pls--;
+					while (i < serv->n_pls) {
+						serv->first_clp[i] = serv->first_clp[i + 1];
+						i++;
+					}
+					serv->first_clp[i] = nil;
+
+#ifdef DEBUG_PRINT
+					for (n = 0; n < serv->n_pls + 1; n++)
+						fmt_fprintf(stdout, "after: serv->first_clp[%d]: %p\n", n, serv->first_clp[n]);
+#endif
+					return;
+				}
+				pool_put(&clp->p, t);
+
+#ifdef DEBUG_PRINT
+				fmt_fprintf(stdout, "free client chunk address: %p\n", t);
+#endif
+				return;
+			} else {
+				pcur = &(*pcur)->next;
+			}
+		}
+	}
+}
+
+/* Welcome and the recent lobby lines, the rest hear of it in a digest. */
+static void session_welcome(client * c, server * serv)
+{
+	char msg[sizeof(welcome_msg) + max_name_len];
+	slice s;
+	iovec iov[3];
+	int n;
+
+	s = unsafe_slice(msg, sizeof(msg));
+
+	n = c_nstring_in_slice(s, welcome_msg, sizeof(welcome_msg) - 1);
+	n += c_nstring_in_slice(slice_left(s, n), c->name, c->name_used);
+	n += c_nstring_in_slice(slice_left(s, n), "\n", 1);
+
+	/* Welcome and the recent lobby lines in one syscall. */
+	iov[0].iov_base = s.base;
+	iov[0].iov_len = n;
+	session_writev(c, iov, 1 + history_in_iovec(&serv->hist, iov + 1), serv);
+
+	presence_add(serv, c, true);
+
+	if (room_join(c, &serv->rooms[0]) != 0)
+		fmt_fprintf(stderr, "session_welcome: can't join the lobby\n");
+}
+
+/* Takes the name of a binary client, it may try again after an error. */
+static void session_bin_hello(client * c, const char *name, uint64 len, server * serv)
+{
+	iovec iov[2];
+	bin_hdr h;
+	uint64 i;
+
+	if (c->name_ok == true) {
+		session_bin_write(c, bin_error, named_msg, sizeof(named_msg) - 1, serv);
+		return;
+	}
+
+	for (i = 0; i < len; i++)
+		if (name[i] == '\n' || name[i] == '\r' || name[i] == '\0')
+			break;
+	if (len == 0 || len >= max_name_len || i < len || name[0] == '#') {
+		session_bin_write(c, bin_error, bad_hello_msg, sizeof(bad_hello_msg) - 1, serv);
+		return;
+	}
+
+	memcpy(c->name, name, len);
+	c->name_used = len;
+	if (name_claim(c, serv) != 0) {
+		c->name_used = 0;
+		session_bin_write(c, bin_error, name_taken_msg, sizeof(name_taken_msg) - 1, serv);
+		return;
+	}
+	c->name_ok = true;
+
+	bin_hdr_set(&h, bin_welcome, c->name_used);
+	h.sender = c->id;
+	iov[0].iov_base = &h;
+	iov[0].iov_len = sizeof(h);
+	iov[1].iov_base = c->name;
+	iov[1].iov_len = c->name_used;
+	session_outv(c, iov, 2, serv);
+
+	session_welcome(c, serv);
+}
+
+/* Returns 1 if the client has to go. */
+static int session_bin_frame(client * c, bin_hdr * h, const char *p, server * serv)
+{
+	char *line = serv->lines.text;
+	uint64 i;
+
+	switch (h->type) {
+	case bin_hello:
+		session_bin_hello(c, p, h->len, serv);
+		return 0;
+	case bin_line:
+		if (c->name_ok == false) {
+			session_bin_write(c, bin_error, hello_first_msg, sizeof(hello_first_msg) - 1, serv);
+			return 0;
+		}
+		/* A line break would split the line in the log. */
+		for (i = 0; i < h->len; i++)
+			line[i] = p[i] == '\n' || p[i] == '\r' ? ' ' : p[i];
+		line[i] = '\n';
+		session_line(c, line, h->len + 1, serv);
+		return 0;
+	}
+
+	session_bin_write(c, bin_error, bad_frame_msg, sizeof(bad_frame_msg) - 1, serv);
+	return 1;
+}
+
+/* Handles the complete frames in buf. The length comes first, so there
+ * is nothing to scan for, and a frame never outgrows buf.
+ */
+static int session_bin_frames(client * c, server * serv)
+{
+	bin_hdr h;
+	int off = 0;
+
+	while (c->buf_used - off >= (int) sizeof(h)) {
+		memcpy(&h, c->buf + off, sizeof(h));
+		/* Frames of binary clients fit in their line buffer. */
+		if (h.len > serv->lim.line_len - sizeof(bin_hdr)) {
+			session_bin_write(c, bin_error, bad_frame_msg, sizeof(bad_frame_msg) - 1, serv);
+			return 1;
+		}
+		if (c->buf_used - off < (int) (sizeof(h) + h.len))
+			break;
+
+		if (session_bin_frame(c, &h, c->buf + off + sizeof(h), serv) != 0)
+			return 1;
+		off += sizeof(h) + h.len;
+	}
+
+	c->buf_used -= off;
+	memmove(c->buf, c->buf + off, c->buf_used);
+	return 0;
+}
+
+/* Takes the name line, the client may try again after an error. */
+static void session_name(client * c, const char *name, int len, server * serv)
+{
+	if (len > 0 && name[len - 1] == '\r')
+		len--;
+
+	if (len == 0 || name[0] == '#') {
+		session_write(c, bad_name_msg, sizeof(bad_name_msg) - 1, serv);
+		return;
+	}
+
+	memcpy(c->name, name, len);
+	c->name_used = len;
+	if (name_claim(c, serv) != 0) {
+		c->name_used = 0;
+		session_write(c, name_taken_msg, sizeof(name_taken_msg) - 1, serv);
+		return;
+	}
+	c->name_ok = true;
+
+	session_welcome(c, serv);
+}
+
+/* Input state machine: a client sends its name line and chat lines, or
+ * bin_magic and frames. Everything complete in buf is handled, whatever
+ * the state was, so the name, the first lines or the first frames may
+ * all come in one packet. Returns 1 if the client has to go.
+ */
+static int session_input(client * c, server * serv)
+{
+	const char *p;
+	int off = 0, len, pos, name_len;
+
+	while (off < c->buf_used && c->binary == false && c->closing == false) {
+		p = c->buf + off;
+		len = c->buf_used - off;
+
+		/* No name starts with a NUL, bin_magic does. */
+		if (c->name_ok == false && p[0] == '\0') {
+			if (len < (int) sizeof(bin_magic))
+				break;
+			if (!memequal(p, bin_magic, sizeof(bin_magic)))
+				return 1;
+			/* Everything before it is the prompt, the client skips it. */
+			session_out(c, bin_magic, sizeof(bin_magic), serv);
+			c->binary = true;
+			off += sizeof(bin_magic);
+			break;
+		}
+
+		for (pos = 0; pos < len && p[pos] != '\n'; pos++) ;
+		/* The name goes without the '\r' of a CRLF, see session_name. */
+		name_len = pos > 0 && p[pos - 1] == '\r' ? pos - 1 : pos;
+		if (c->name_ok == false && name_len >= max_name_len) {
+			sys_write(c->fd, too_long_name, sizeof(too_long_name) - 1, nil);
+			return 1;
+		}
+		if (pos == len)
+			break;
+
+		if (c->name_ok == false)
+			session_name(c, p, pos, serv);
+		else
+			session_line(c, p, pos + 1, serv);
+		off += pos + 1;
+	}
+
+	c->buf_used -= off;
+	memmove(c->buf, c->buf + off, c->buf_used);
+
+	if (c->binary)
+		return session_bin_frames(c, serv);
+
+	/* A full buffer without a line ending is a line too long. */
+	if (c->buf_used == serv->lim.line_len) {
+		sys_write(c->fd, too_long_msg, sizeof(too_long_msg) - 1, nil);
+		return 1;
+	}
+	return 0;
+}
+
+/* Reads until the socket is drained or the budget is spent, buf always
+ * has room, see above. Epoll is edge triggered and won't report what is
+ * left, so a client cut short goes on the ready list.
+ */
+static void session_read(client * c, server * serv)
+{
+	const error *err;
+	int budget = read_budget_lines * serv->lim.line_len, n;
+
+	for (;;) {
+		if (session_input(c, serv) != 0) {
+			session_close(c, serv);
+			return;
+		}
+		if (budget <= 0) {
+			serv->stats.deferred++;
+			ready_push(c, serv);
+			return;
+		}
+		/* EPOLLIN is off, it reports the rest on resume. */
+		if (flow_check(serv))
+			return;
+
+		n = sys_read(c->fd, c->buf + c->buf_used, serv->lim.line_len - c->buf_used, &err);
+		if (err != nil) {
+			if (err->code == EAGAIN)
+				return;
+			else if (err->code == EINTR)
+				continue;
+			fmt_fprintf(stderr, "session_read: sys_read failed: %s\n", err->msg);
+			session_close(c, serv);
+			return;
+		} else if (n == 0) {
+			session_close(c, serv);
+			return;
+		}
+		c->buf_used += n;
+		budget -= n;
+	}
+}
+
+/* One more turn for those on the ready list when the iteration started,
+ * a client cut short again goes to the back.
+ */
+static void session_read_ready(server * serv)
+{
+	int n = serv->n_ready;
+	client *c;
+
+	while (n-- > 0 && serv->ready_head != nil) {
+		c = serv->ready_head;
+		ready_remove(c, serv);
+		session_read(c, serv);
+	}
+}
+
+static void session_new_clp(server * serv)
+{
+	uint64 pool_size = serv->lim.client_size * serv->lim.pool_clients;
+	arena a;
+	byte *pbuf;
+	client_pool *clp_new;
+
+	arena_create_flags(&a, pool_size + sizeof(client_pool), serv->map_flags);
+
+	clp_new = (client_pool *) arena_alloc(&a, sizeof(client_pool));
+	if (clp_new == nil) {
+		fmt_fprintf(stderr, "session_new_clp: arena_alloc (client_pool) failed\n");
+		sys_exit_group(1);
+	}
+
+	pbuf = (byte *) arena_alloc(&a, pool_size);
+	if (pbuf == nil) {
+		fmt_fprintf(stderr, "session_new_clp: arena_alloc (pool) failed\n");
+		sys_exit_group(2);
+	}
+
+	pool_init(&clp_new->p, pbuf, pool_size, serv->lim.client_size, default_alignment);
+	clp_new->used_ch = 0;
+	clp_new->free_ch = clp_new->p.buf_len / clp_new->p.chunk_size;
+	clp_new->client = nil;
+	clp_new->map_len = a.buf_len;
+
+	serv->first_clp[serv->n_pls] = clp_new;
+	serv->n_pls++;
+	serv->mem.clp_maps++;
+}
+
+static void session_init(client * c, int fd)
+{
+	c->fd = fd;
+	c->buf = (char *) (c + 1);
+	c->buf_used = 0;
+	c->name_used = 0;
+	c->name_ok = false;
+	c->n_rooms = 0;
+	c->cur_room = nil;
+	c->out_head = nil;
+	c->out_tail = nil;
+	c->out_len = 0;
+	c->who_pos = -1;
+	c->closing = false;
+	c->compress = false;
+	c->binary = false;
+	c->id = 0;
+	c->ready = false;
+	c->ready_prev = nil;
+	c->ready_next = nil;
+}
+
+static client *session_new(int epfd, server * serv)
+{
+	client *c = nil;
+	client_pool *clp;
+	int i;
+
+	for (i = 0; i < serv->n_pls; i++) {
+		clp = serv->first_clp[i];
+		if (clp->free_ch > 0) {
+			c = pool_get(&clp->p);
+			clp->free_ch--;
+			clp->used_ch++;
+			c->next = clp->client;
+			clp->client = c;
+
+#ifdef DEBUG_PRINT
+			fmt_fprintf(stdout, "new client chunk address: %p\n", c);
+#endif
 
 			return c;
 		}
 	}
 
 	if (c == nil) {
-		if (serv->n_pls == max_pools)
+		if (serv->n_pls == serv->lim.pools)
 			return nil;
 
 		session_new_clp(serv);
 		clp = serv->first_clp[serv->n_pls - 1];
 		c = pool_get(&clp->p);
+		c->next = nil;
 		clp->client = c;
 		clp->free_ch--;
 		clp->used_ch++;
 	}
-#ifdef DEBUG_PRINT
-	fmt_fprintf(stdout, "new client chunk address: %p\n", c);
-#endif
+#ifdef DEBUG_PRINT
+	fmt_fprintf(stdout, "new client chunk address: %p\n", c);
+#endif
+
+	return c;
+}
+
+/* =========== drain =========== */
+
+static void drain_bye(client * c, server * serv)
+{
+	char buf[sizeof(bye_msg) + 24];
+	iovec v[2];
+	bin_hdr h;
+	uint32 retry;
+	slice s;
+	uint64 n;
+
+	/* By id, so the clients don't all come back at once. */
+	retry = drain_retry_s + c->id * 2654435761U % drain_spread_s;
+	memcpy(buf, bye_msg, sizeof(bye_msg) - 1);
+	s = unsafe_slice(buf, sizeof(buf));
+	n = sizeof(bye_msg) - 1;
+	n += int_in_slice(slice_left(s, n), retry);
+	n += c_nstring_in_slice(slice_left(s, n), " s\n", 3);
+	c->who_pos = -1;
+	if (!c->binary) {
+		session_write(c, buf, n, serv);
+		return;
+	}
+	bin_hdr_set(&h, bin_bye, n);
+	h.sender = retry;
+	v[0].iov_base = &h;
+	v[0].iov_len = sizeof(h);
+	v[1].iov_base = buf;
+	v[1].iov_len = n;
+	session_outv(c, v, 2, serv);
+}
+
+/* Stops accepting and reading, says goodbye and lets the output drain.
+ * The master passes the signal on to the workers and waits for them.
+ */
+static void drain_start(server * serv)
+{
+	client *c;
+	int i;
+
+	if (serv->drain.on)
+		return;
+	fmt_fprintf(stderr, "drain_start: going down, %d ms to flush\n", drain_ms);
+	if (!serv->flow.paused)
+		flow_set(serv, true);
+	serv->drain.on = true;
+	serv->drain.deadline = now_ms() + drain_ms;
+	serv->drain.next_batch = 0;
+	serv->drain.closed = 0;
+
+	/* Connections coming meanwhile are refused rather than left waiting. */
+	if (serv->ls != -1)
+		sys_close(serv->ls);
+	serv->ls = -1;
+	if (serv->uls != -1)
+		sys_close(serv->uls);
+	serv->uls = -1;
+
+	if (is_master(serv)) {
+		for (i = 0; i < serv->bus->n_workers; i++) {
+			sys_close(serv->bus->ls[i]);
+			if (serv->bus->pid[i] != 0)
+				sys_kill(serv->bus->pid[i], sigterm);
+		}
+		return;
+	}
+
+	for (i = 0; i < serv->n_pls; i++)
+		for (c = serv->first_clp[i]->client; c != nil; c = c->next)
+			if (c->closing == false)
+				drain_bye(c, serv);
+}
+
+/* Closes the next batch of clients. Returns true once everyone is gone. */
+static int drain_tick(server * serv, int64 now)
+{
+	client *batch[drain_batch], *c;
+	int late = now >= serv->drain.deadline, n, i;
+
+	if (now < serv->drain.next_batch)
+		return false;
+	serv->drain.next_batch = now + drain_batch_ms;
+
+	if (is_master(serv)) {
+		for (i = 0; i < serv->bus->n_workers; i++)
+			if (serv->bus->pid[i] != 0) {
+				if (now >= serv->drain.deadline + drain_kill_ms)
+					sys_kill(serv->bus->pid[i], sigkill);
+				return false;
+			}
+		return true;
+	}
+
+	/* Picked first, closing may unmap a pool. After the deadline all go,
+	 * whatever they have pending.
+	 */
+	do {
+		n = 0;
+		for (i = 0; i < serv->n_pls && n < drain_batch; i++)
+			for (c = serv->first_clp[i]->client; c != nil && n < drain_batch; c = c->next)
+				if (late || c->out_head == nil || c->closing)
+					batch[n++] = c;
+		for (i = 0; i < n; i++)
+			session_close(batch[i], serv);
+		serv->drain.closed += n;
+	} while (late && n > 0);
+
+	for (i = 0; i < serv->n_pls; i++)
+		if (serv->first_clp[i]->used_ch > 0)
+			return false;
+	return true;
+}
+
+/* =========== hot restart =========== */
+
+static int handoff_send(int sock, iovec * iov, int iovcnt, int fd)
+{
+	uint64 cbuf[CMSG_SPACE(sizeof(int)) / sizeof(uint64)];
+	struct cmsghdr *cm = (struct cmsghdr *) cbuf;
+	struct msghdr m;
+	const error *err;
+
+	m.msg_name = nil;
+	m.msg_namelen = 0;
+	m.msg_iov = iov;
+	m.msg_iovlen = iovcnt;
+	m.msg_control = nil;
+	m.msg_controllen = 0;
+	m.msg_flags = 0;
+
+	if (fd != -1) {
+		cm->cmsg_len = CMSG_LEN(sizeof(int));
+		cm->cmsg_level = sol_socket;
+		cm->cmsg_type = scm_rights;
+		memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+		m.msg_control = cbuf;
+		m.msg_controllen = sizeof(cbuf);
+	}
+
+	for (;;) {
+		sys_sendmsg(sock, &m, 0, &err);
+		if (err == nil)
+			return 0;
+		if (err->code != EINTR) {
+			fmt_fprintf(stderr, "handoff_send: sys_sendmsg failed: %s\n", err->msg);
+			return 1;
+		}
+	}
+}
+
+/* Receives one message, returns its length, 0 on EOF or -1. The fd
+ * attached to the message is stored in *fd, -1 if there is none.
+ */
+static int64 handoff_recv(int sock, iovec * iov, int iovcnt, int *fd)
+{
+	uint64 cbuf[CMSG_SPACE(sizeof(int)) / sizeof(uint64)];
+	struct cmsghdr *cm = (struct cmsghdr *) cbuf;
+	struct msghdr m;
+	const error *err;
+	int64 n;
+
+	m.msg_name = nil;
+	m.msg_namelen = 0;
+	m.msg_iov = iov;
+	m.msg_iovlen = iovcnt;
+	m.msg_control = cbuf;
+	m.msg_controllen = sizeof(cbuf);
+	m.msg_flags = 0;
+	*fd = -1;
+
+	for (;;) {
+		n = sys_recvmsg(sock, &m, msg_cmsg_cloexec, &err);
+		if (err == nil)
+			break;
+		if (err->code != EINTR) {
+			fmt_fprintf(stderr, "handoff_recv: sys_recvmsg failed: %s\n", err->msg);
+			return -1;
+		}
+	}
+
+	if (m.msg_controllen >= CMSG_LEN(sizeof(int)) && cm->cmsg_level == sol_socket && cm->cmsg_type == scm_rights)
+		memcpy(fd, CMSG_DATA(cm), sizeof(int));
+
+	if (m.msg_flags & (msg_trunc | msg_ctrunc))
+		return -1;
+	return n;
+}
+
+static int handoff_send_client(int sock, client * c)
+{
+	handoff_client hc;
+	handoff_file hf;
+	out_seg *seg;
+	iovec iov[2];
+	int i;
+
+	hc.buf_used = c->buf_used;
+	hc.name_used = c->name_used;
+	hc.name_ok = c->name_ok;
+	hc.n_rooms = c->n_rooms;
+	hc.cur_room = -1;
+	hc.compress = c->compress;
+	hc.binary = c->binary;
+	hc.id = c->id;
+	hc.out_len = c->out_len;
+	memcpy(hc.name, c->name, max_name_len);
+	for (i = 0; i < c->n_rooms; i++) {
+		memcpy(hc.rooms[i], c->rooms[i].r->name, c->rooms[i].r->name_len);
+		hc.room_len[i] = c->rooms[i].r->name_len;
+		if (c->rooms[i].r == c->cur_room)
+			hc.cur_room = i;
+	}
+
+	iov[0].iov_base = &hc;
+	iov[0].iov_len = sizeof(hc);
+	iov[1].iov_base = c->buf;
+	iov[1].iov_len = c->buf_used;
+	if (handoff_send(sock, iov, 2, c->fd) != 0)
+		return 1;
+
+	for (seg = c->out_head; seg != nil; seg = seg->next) {
+		if (seg->fd != -1) {
+			hf.off = seg->file_off + seg->head;
+			hf.len = seg->tail - seg->head;
+			iov[0].iov_base = &hf;
+			iov[0].iov_len = sizeof(hf);
+			if (handoff_send(sock, iov, 1, seg->fd) != 0)
+				return 1;
+			continue;
+		}
+		iov[0].iov_base = seg->data + seg->head;
+		iov[0].iov_len = seg->tail - seg->head;
+		if (iov[0].iov_len > 0 && handoff_send(sock, iov, 1, -1) != 0)
+			return 1;
+	}
+	return 0;
+}
+
+/* Sends everything to the successor and waits until it has taken it.
+ * Returns the number of clients handed over or -1.
+ */
+static int handoff_out(server * serv, int sock)
+{
+	handoff_hdr h;
+	iovec iov[3];
+	const error *err;
+	client *c;
+	char ack;
+	int i, n;
+
+	h.magic = handoff_magic;
+	h.version = handoff_version;
+	h.client_size = sizeof(handoff_client);
+	h.n_clients = 0;
+	for (i = 0; i < serv->n_pls; i++)
+		for (c = serv->first_clp[i]->client; c != nil; c = c->next)
+			if (c->closing == false)
+				h.n_clients++;
+
+	/* The history is at most history_size bytes, it goes with the header. */
+	n = history_in_iovec(&serv->hist, iov + 1);
+	h.hist_len = 0;
+	for (i = 1; i <= n; i++)
+		h.hist_len += iov[i].iov_len;
+	h.has_unix = serv->uls != -1;
+	iov[0].iov_base = &h;
+	iov[0].iov_len = sizeof(h);
+	if (handoff_send(sock, iov, 1 + n, serv->ls) != 0)
+		return -1;
+
+	if (h.has_unix) {
+		iov[0].iov_base = "u";
+		iov[0].iov_len = 1;
+		if (handoff_send(sock, iov, 1, serv->uls) != 0)
+			return -1;
+	}
+
+	for (i = 0; i < serv->n_pls; i++)
+		for (c = serv->first_clp[i]->client; c != nil; c = c->next)
+			if (c->closing == false && handoff_send_client(sock, c) != 0)
+				return -1;
+
+	for (;;) {
+		n = sys_read(sock, &ack, 1, &err);
+		if (err == nil)
+			break;
+		if (err->code != EINTR) {
+			fmt_fprintf(stderr, "handoff_out: no answer from the successor: %s\n", err->msg);
+			return -1;
+		}
+	}
+	return n == 1 ? h.n_clients : -1;
+}
+
+/* Reads past left bytes of pending output. Returns 1 on a bad message. */
+static int handoff_skip(int sock, uint64 left, char *buf, uint64 size)
+{
+	iovec iov[1];
+	handoff_file hf;
+	int64 n;
+	int fd;
+
+	for (; left > 0; left -= n) {
+		iov[0].iov_base = buf;
+		iov[0].iov_len = size;
+		n = handoff_recv(sock, iov, 1, &fd);
+		if (fd != -1) {
+			sys_close(fd);
+			memcpy(&hf, buf, sizeof(hf));
+			if (n != sizeof(hf) || hf.len == 0 || hf.len > left)
+				return 1;
+			n = hf.len;
+		} else if (n <= 0 || (uint64) n > left)
+			return 1;
+	}
+	return 0;
+}
+
+/* Takes the listener and the clients from the process that exec'd us. */
+static int handoff_in(server * serv, int sock)
+{
+	struct epoll_event ev;
+	handoff_hdr h;
+	handoff_client hc;
+	handoff_file hf;
+	char buf[history_size];
+	iovec iov[2];
+	const error *err;
+	uint64 left;
+	uint32 k;
+	client *c;
+	room *r;
+	int64 n;
+	int i, fd, bad;
+
+	iov[0].iov_base = &h;
+	iov[0].iov_len = sizeof(h);
+	iov[1].iov_base = buf;
+	iov[1].iov_len = sizeof(buf);
+	n = handoff_recv(sock, iov, 2, &serv->ls);
+	if (n < (int64) sizeof(h) || serv->ls == -1 || h.magic != handoff_magic || h.version != handoff_version
+		|| h.client_size != sizeof(handoff_client) || n - sizeof(h) != h.hist_len) {
+		fmt_fprintf(stderr, "handoff_in: bad header\n");
+		return 1;
+	}
+	log_replay(&serv->hist, buf, 0, h.hist_len);
+
+	if (h.has_unix) {
+		iov[0].iov_base = buf;
+		iov[0].iov_len = 1;
+		if (handoff_recv(sock, iov, 1, &serv->uls) != 1 || serv->uls == -1) {
+			fmt_fprintf(stderr, "handoff_in: no UNIX listener\n");
+			return 1;
+		}
+	}
+
+	for (k = 0; k < h.n_clients; k++) {
+		iov[0].iov_base = &hc;
+		iov[0].iov_len = sizeof(hc);
+		iov[1].iov_base = buf;
+		iov[1].iov_len = serv->lim.line_len;
+		n = handoff_recv(sock, iov, 2, &fd);
+		if (n < (int64) sizeof(hc)) {
+			fmt_fprintf(stderr, "handoff_in: short client record\n");
+			return 1;
+		}
+		bad = fd == -1 || hc.buf_used < 0 || hc.buf_used > serv->lim.line_len
+			|| n - sizeof(hc) != (uint64) hc.buf_used || hc.name_used < 0 || hc.name_used > max_name_len
+			|| (hc.name_ok && hc.name_used == 0) || hc.n_rooms < 0 || hc.n_rooms > max_joined_rooms
+			|| hc.cur_room < -1 || hc.cur_room >= hc.n_rooms;
+		for (i = 0; !bad && i < hc.n_rooms; i++)
+			bad = hc.room_len[i] < 1 || hc.room_len[i] > max_room_name_len;
+		if (bad) {
+			/* The client is dropped, its pending output is read past. */
+			fmt_fprintf(stderr, "handoff_in: bad client record, client dropped\n");
+			if (fd != -1)
+				sys_close(fd);
+			if (handoff_skip(sock, hc.out_len, buf, sizeof(buf)) != 0) {
+				fmt_fprintf(stderr, "handoff_in: can't skip pending output\n");
+				return 1;
+			}
+			continue;
+		}
+
+		c = session_new(serv->epfd, serv);
+		if (c == nil) {
+			fmt_fprintf(stderr, "handoff_in: connection limit reached\n");
+			return 1;
+		}
+		session_init(c, fd);
+		c->buf_used = hc.buf_used;
+		c->name_used = hc.name_used;
+		memcpy(c->buf, buf, hc.buf_used);
+		memcpy(c->name, hc.name, max_name_len);
+		if (hc.name_ok == true) {
+			if (name_insert(&serv->names, c) != 0) {
+				fmt_fprintf(stderr, "handoff_in: duplicate name\n");
+				return 1;
+			}
+			c->name_ok = true;
+		}
+
+		for (i = 0; i < hc.n_rooms; i++) {
+			r = room_find(serv, hc.rooms[i], hc.room_len[i]);
+			if (r == nil)
+				r = room_new(serv, hc.rooms[i], hc.room_len[i]);
+			if (r == nil || room_join(c, r) != 0) {
+				fmt_fprintf(stderr, "handoff_in: can't restore rooms\n");
+				return 1;
+			}
+		}
+		c->cur_room = hc.cur_room == -1 ? nil : c->rooms[hc.cur_room].r;
+
+		c->compress = hc.compress;
+		c->binary = hc.binary;
+		c->id = hc.id;
+		if (c->id >= serv->next_id)
+			serv->next_id = c->id + 1;
+
+		for (left = hc.out_len; left > 0; left -= n) {
+			iov[0].iov_base = buf;
+			iov[0].iov_len = sizeof(buf);
+			n = handoff_recv(sock, iov, 1, &fd);
+			if (fd != -1) {
+				/* A /history replay still to send from a log segment. */
+				memcpy(&hf, buf, sizeof(hf));
+				bad = n != sizeof(hf) || hf.len > left || session_queue_file(c, fd, hf.off, hf.len, serv) != 0;
+				sys_close(fd);
+				n = hf.len;
+			} else
+				bad = n <= 0 || n > left || session_queue(c, buf, n, serv) != 0;
+			if (bad) {
+				fmt_fprintf(stderr, "handoff_in: can't restore pending output\n");
+				return 1;
+			}
+		}
+
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+		ev.data.ptr = c;
+		err = sys_epoll_ctl(serv->epfd, epoll_ctl_add, c->fd, &ev);
+		if (err != nil) {
+			fmt_fprintf(stderr, "handoff_in: sys_epoll_ctl failed: %s\n", err->msg);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Starts the binary found at argv[0] and hands the listener and all
+ * clients over to it, the clients see nothing but a short pause. If
+ * the successor fails to take them we go on serving.
+ */
+static void server_restart(server * serv)
+{
+	struct timeval tv;
+	const error *err;
+	char fd_buf[16];
+	char *args[max_restart_args];
+	int sv[2], pid, fd, n, i, k;
+
+	/* The successor reopens the log after us. */
+	presence_flush(serv, now_ms());
+	zbatch_flush(serv);
+	log_flush(&serv->log);
+	if (serv->log.unsynced > 0)
+		log_sync_now(&serv->log);
+
+	err = sys_socketpair(af_unix, sock_seqpacket | sock_cloexec, 0, sv);
+	if (err != nil) {
+		fmt_fprintf(stderr, "server_restart: sys_socketpair failed: %s\n", err->msg);
+		return;
+	}
+
+	/* A stuck successor must not stop us for long. */
+	tv.tv_sec = handoff_timeout_s;
+	tv.tv_usec = 0;
+	sys_setsockopt(sv[0], sol_socket, so_sndtimeo, &tv, sizeof(tv));
+	sys_setsockopt(sv[0], sol_socket, so_rcvtimeo, &tv, sizeof(tv));
+
+	pid = sys_fork(&err);
+	if (err != nil) {
+		fmt_fprintf(stderr, "server_restart: sys_fork failed: %s\n", err->msg);
+		sys_close(sv[0]);
+		sys_close(sv[1]);
+		return;
+	}
+
+	if (pid == 0) {
+		/* All our descriptors are close-on-exec, the dup is not. */
+		fd = sys_dup(sv[1], &err);
+		if (err != nil)
+			sys_exit_group(127);
+		n = int_in_slice(unsafe_slice(fd_buf, sizeof(fd_buf) - 1), fd);
+		fd_buf[n] = '\0';
+
+		args[0] = serv->argv[0];
+		args[1] = (char *) handoff_arg;
+		args[2] = fd_buf;
+		/* The rest of our flags, the limits must stay the same. */
+		for (i = 1, k = 3; serv->argv[i] != nil; i++) {
+			if (is_arg(serv->argv[i], handoff_arg, sizeof(handoff_arg) - 1) && serv->argv[i + 1] != nil) {
+				i++;
+				continue;
+			}
+			if (k == max_restart_args - 1) {
+				fmt_fprintf(stderr, "server_restart: more than %d arguments\n", max_restart_args - 4);
+				sys_exit_group(127);
+			}
+			args[k++] = serv->argv[i];
+		}
+		args[k] = nil;
+		sys_execve(args[0], args, serv->envp);
+		/* argv[0] may be a bare name found through PATH. */
+		err = sys_execve(self_exe, args, serv->envp);
+		fmt_fprintf(stderr, "server_restart: sys_execve failed: %s\n", err->msg);
+		sys_exit_group(127);
+	}
+	sys_close(sv[1]);
 
-	return c;
+	n = handoff_out(serv, sv[0]);
+	if (n >= 0) {
+		fmt_fprintf(stderr, "server_restart: %d clients handed over to pid %d\n", n, pid);
+		sys_exit_group(0);
+	}
+
+	fmt_fprintf(stderr, "server_restart: handoff failed, still serving\n");
+	sys_close(sv[0]);
+	sys_kill(pid, sigkill);
+	sys_wait4(pid, nil, 0, nil);
 }
 
 /* =========== server =========== */
 
-static void server_handle(int epfd, server * serv)
+/* Accepts from the TCP or the UNIX listener, both lead to the same roster. */
+static void server_handle(int epfd, int ls, server * serv)
 {
 	struct epoll_event ev;
 	const error *err;
@@ -354,7 +3910,10 @@ static void server_handle(int epfd, server * serv)
 	client *c;
 
 	for (;;) {
-		conn_sock = sys_accept4(serv->ls, nil, nil, sock_nonblock, &err);
+		/* The listener is off, the backlog waits for resume. */
+		if (flow_check(serv))
+			break;
+		conn_sock = sys_accept4(ls, nil, nil, sock_nonblock | sock_cloexec, &err);
 		if (err != nil) {
 			if (err->code == EAGAIN)
 				break;
@@ -371,7 +3930,18 @@ static void server_handle(int epfd, server * serv)
 			continue;
 		}
 
-		ev.events = EPOLLIN | EPOLLET;
+		session_init(c, conn_sock);
+		c->id = serv->next_id++;
+
+		if (serv->busy_poll_us > 0 && ls == serv->ls) {
+			err = sys_setsockopt(conn_sock, sol_socket, so_busy_poll, &serv->busy_poll_us, sizeof(int));
+			if (err != nil) {
+				fmt_fprintf(stderr, "server_handle: SO_BUSY_POLL failed: %s, turning it off\n", err->msg);
+				serv->busy_poll_us = 0;
+			}
+		}
+
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
 		ev.data.ptr = c;
 		err = sys_epoll_ctl(epfd, epoll_ctl_add, conn_sock, &ev);
 		if (err != nil) {
@@ -380,69 +3950,481 @@ static void server_handle(int epfd, server * serv)
 			continue;
 		}
 
-		c->fd = conn_sock;
-		c->buf_used = 0;
-		c->name_used = 0;
-		c->name_ok = false;
-
 		sys_write(conn_sock, "Your name please (max 29): ", 27, nil);
 	}
 }
 
+/* Milliseconds until the nearest deadline, -1 - none. */
+static int server_timeout(server * serv)
+{
+	int64 t = -1, p;
+
+	if (serv->log.sync_at != 0)
+		t = serv->log.sync_at;
+	p = serv->pres.last + serv->pres.interval_ms;
+	if (serv->pres.joined + serv->pres.left > 0 && (t == -1 || p < t))
+		t = p;
+	if (serv->drain.on && (t == -1 || serv->drain.next_batch < t))
+		t = serv->drain.next_batch;
+	if (t == -1)
+		return -1;
+
+	t -= now_ms();
+	return t > 0 ? t : 0;
+}
+
+/* In clients and segments rather than bytes, the pools hand out one
+ * size only. Free is what the mappings hold and nobody uses.
+ */
+static void server_report_pools(server * serv)
+{
+	alloc_stats *st;
+	uint64 in_use = 0, committed = 0, allocs = 0, n;
+	int i;
+
+	fmt_fprintf(stderr, "server_report: limits port %d, backlog %d, lines %d bytes, %d events, %d bytes a client\n",
+				serv->lim.port, serv->lim.backlog, serv->lim.line_len, serv->lim.events, (int) serv->lim.client_size);
+	fmt_fprintf(stderr, "server_report: client pools %d of %d, mapped %l, unmapped %l\n", serv->n_pls, serv->lim.pools,
+				serv->mem.clp_maps, serv->mem.clp_unmaps);
+	for (i = 0; i < serv->n_pls; i++) {
+		st = &serv->first_clp[i]->p.st;
+		n = serv->first_clp[i]->p.chunk_size;
+		fmt_fprintf(stderr, "server_report: client pool %d: %l of %d clients, high %l, allocs %l, frees %l\n", i,
+					st->in_use / n, serv->lim.pool_clients, st->high / n, st->allocs, st->frees);
+	}
+
+	for (i = 0; i < serv->n_seg_pls; i++) {
+		st = &serv->seg_pls[i]->p.st;
+		in_use += st->in_use;
+		committed += st->committed;
+		allocs += st->allocs;
+	}
+	if (serv->n_seg_pls > 0)
+		fmt_fprintf(stderr, "server_report: segment pools %d of %d, %l segments in use, allocs %l, %l KiB free\n",
+					serv->n_seg_pls, serv->lim.seg_pools, in_use / sizeof(out_seg), allocs, (committed - in_use) / 1024);
+	fmt_fprintf(stderr, "server_report: output flow %l segments queued, high %l, pause at %l, resume at %l, pauses %l%s\n",
+				serv->flow.segs, serv->flow.high, serv->flow.pause_at, serv->flow.resume_at, serv->flow.pauses,
+				serv->flow.paused ? ", paused now" : "");
+}
+
+static void server_report_exec(server * serv)
+{
+	executor *ex = serv->exec;
+	uint64 steals = 0, parks = 0;
+	int i;
+
+	if (ex == nil)
+		return;
+	for (i = 0; i < ex->n; i++) {
+		steals += ex->w[i].steals;
+		parks += ex->w[i].parks;
+	}
+	fmt_fprintf(stderr, "server_report: executor %d threads, tasks %l, run inline %l, steals %l, parks %l\n", ex->n,
+				ex->submitted, ex->inline_runs, steals, parks);
+}
+
+static void server_report(server * serv)
+{
+	loop_stats *st = &serv->stats;
+	z_stats *zs = &serv->zstats;
+	presence *p = &serv->pres;
+	struct rusage ru;
+
+	fmt_fprintf(stderr, "server_report: waits %l, blocking %l, empty %l, events %l, full batches %l, events array %d\n",
+				st->waits, st->blocking, st->empty, st->events, st->full, serv->n_evt);
+	fmt_fprintf(stderr, "server_report: reads cut short %l, clients on the ready list %d\n", st->deferred,
+				serv->n_ready);
+
+	if (zs->frames > 0)
+		fmt_fprintf(stderr, "server_report: compressed frames %l, %l -> %l bytes (%l%%), cpu %l us\n",
+					zs->frames, zs->in, zs->out, zs->out * 100 / zs->in, zs->cpu_ns / 1000);
+
+	if (p->digests > 0)
+		fmt_fprintf(stderr, "server_report: presence digests %l for %l joins and leaves, interval %l ms\n",
+					p->digests, p->events, p->interval_ms);
+
+	server_report_pools(serv);
+	server_report_exec(serv);
+
+	if (sys_getrusage(rusage_self, &ru) != nil)
+		return;
+	fmt_fprintf(stderr, "server_report: cpu user %l ms, sys %l ms, wall %l ms, context switches %l/%l\n",
+				ru.ru_utime.tv_sec * 1000 + ru.ru_utime.tv_usec / 1000,
+				ru.ru_stime.tv_sec * 1000 + ru.ru_stime.tv_usec / 1000, now_ms() - st->start_ms,
+				ru.ru_nvcsw, ru.ru_nivcsw);
+}
+
+/* Doubles the events array after a batch has filled it. */
+static void server_grow_events(server * serv)
+{
+	struct epoll_event *evt;
+	const error *err;
+	int n = serv->n_evt == 0 ? serv->lim.events : serv->n_evt * 2;
+
+	evt = sys_mmap((uintptr) nil, n * sizeof(struct epoll_event), prot_read | prot_write, map_private | map_anonymous,
+				   -1, 0, &err);
+	if (err != nil) {
+		fmt_fprintf(stderr, "server_grow_events: sys_mmap failed: %s\n", err->msg);
+		return;
+	}
+
+	if (serv->evt != nil) {
+		err = sys_munmap((uintptr) serv->evt, serv->n_evt * sizeof(struct epoll_event));
+		if (err != nil)
+			fmt_fprintf(stderr, "server_grow_events: sys_munmap failed: %s\n", err->msg);
+	}
+	serv->evt = evt;
+	serv->n_evt = n;
+}
+
+static void server_signal(server * serv)
+{
+	struct signalfd_siginfo si;
+	const error *err;
+
+	for (;;) {
+		sys_read(serv->sfd, (char *) &si, sizeof(si), &err);
+		if (err != nil) {
+			if (err->code == EINTR)
+				continue;
+			if (err->code != EAGAIN)
+				fmt_fprintf(stderr, "server_signal: sys_read failed: %s\n", err->msg);
+			return;
+		}
+
+		if (si.ssi_signo == sigchld && is_master(serv))
+			master_reap(serv);
+		else if (si.ssi_signo == sigterm || si.ssi_signo == sigint)
+			drain_start(serv);
+		else if (si.ssi_signo == sigusr2 && serv->drain.on)
+			fmt_fprintf(stderr, "server_signal: going down, no hot restart\n");
+		else if (si.ssi_signo == sigusr2 && serv->bus != nil)
+			fmt_fprintf(stderr, "server_signal: hot restart is not supported with workers\n");
+		else if (si.ssi_signo == sigusr2)
+			server_restart(serv);
+		else if (si.ssi_signo == sigusr1)
+			server_report(serv);
+	}
+}
+
 static int server_go(server * serv)
 {
-	struct epoll_event ev, evt[max_events];
-	int epfd, i;
+	struct epoll_event ev, *evt;
+	int epfd = serv->epfd, i, timeout, ev_count;
+	int64 now, busy_at = 0, tick;
+	uint64 wakeups;
 	client *c;
 	const error *err;
 
-	epfd = sys_epoll_create1(0, &err);
-	if (err != nil) {
-		fmt_fprintf(stderr, "server_go: sys_epoll_create1 failed: %s\n", err->msg);
-		sys_close(serv->ls);
+	if (serv->evt == nil)
+		server_grow_events(serv);
+	if (serv->evt == nil)
 		return 1;
+
+	serv->stats.start_ms = now_ms();
+	serv->stats.waits = 0;
+	serv->stats.blocking = 0;
+	serv->stats.empty = 0;
+	serv->stats.events = 0;
+	serv->stats.full = 0;
+	serv->stats.deferred = 0;
+	serv->zstats.frames = 0;
+	serv->zstats.in = 0;
+	serv->zstats.out = 0;
+	serv->zstats.cpu_ns = 0;
+	serv->pres.digests = 0;
+	serv->pres.events = 0;
+
+	if (serv->ls != -1) {
+		ev.events = EPOLLIN | EPOLLET;
+		ev.data.ptr = serv;
+		err = sys_epoll_ctl(epfd, epoll_ctl_add, serv->ls, &ev);
+		if (err != nil) {
+			fmt_fprintf(stderr, "server_go: sys_epoll_ctl failed: %s\n", err->msg);
+			sys_close(epfd);
+			sys_close(serv->ls);
+			return 2;
+		}
 	}
 
-	ev.events = EPOLLIN | EPOLLET;
-	ev.data.ptr = serv;
-	err = sys_epoll_ctl(epfd, epoll_ctl_add, serv->ls, &ev);
+	/* With workers everyone accepts from the one UNIX listener. */
+	if (serv->uls != -1 && !is_master(serv)) {
+		ev.events = EPOLLIN | EPOLLET;
+		ev.data.ptr = &serv->uls;
+		err = sys_epoll_ctl(epfd, epoll_ctl_add, serv->uls, &ev);
+		if (err != nil) {
+			fmt_fprintf(stderr, "server_go: sys_epoll_ctl (unix) failed: %s\n", err->msg);
+			return 5;
+		}
+	}
+
+	if (serv->bus != nil) {
+		ev.events = EPOLLIN;
+		ev.data.ptr = serv->bus;
+		err = sys_epoll_ctl(epfd, epoll_ctl_add, serv->bus->efd[serv->worker], &ev);
+		if (err != nil) {
+			fmt_fprintf(stderr, "server_go: sys_epoll_ctl (eventfd) failed: %s\n", err->msg);
+			return 4;
+		}
+	}
+
+	if (serv->exec != nil) {
+		ev.events = EPOLLIN;
+		ev.data.ptr = serv->exec;
+		err = sys_epoll_ctl(epfd, epoll_ctl_add, serv->exec->efd, &ev);
+		if (err != nil) {
+			fmt_fprintf(stderr, "server_go: sys_epoll_ctl (executor) failed: %s\n", err->msg);
+			return 6;
+		}
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = &serv->sfd;
+	err = sys_epoll_ctl(epfd, epoll_ctl_add, serv->sfd, &ev);
 	if (err != nil) {
-		fmt_fprintf(stderr, "server_go: sys_epoll_ctl failed: %s\n", err->msg);
-		sys_close(epfd);
-		sys_close(serv->ls);
-		return 2;
+		fmt_fprintf(stderr, "server_go: sys_epoll_ctl (signalfd) failed: %s\n", err->msg);
+		return 3;
 	}
 
 	for (;;) {
-		int ev_count = sys_epoll_wait(epfd, evt, max_events, -1, &err);
+		/* In spin mode we keep polling for spin_us after the last
+		 * event instead of going to sleep, the bus is polled as well.
+		 */
+		now = serv->spin_us > 0 ? now_us() : 0;
+		if (now != 0 && now - busy_at < serv->spin_us)
+			timeout = 0;
+		else {
+			timeout = server_timeout(serv);
+			if (serv->bus != nil && !bus_sleep(serv))
+				timeout = 0;
+		}
+		/* Input is waiting, just pick up new events. */
+		if (serv->ready_head != nil)
+			timeout = 0;
+
+		evt = serv->evt;
+		ev_count = sys_epoll_wait(epfd, evt, serv->n_evt, timeout, &err);
 		if (err != nil) {
 			if (err->code != EINTR)
 				fmt_fprintf(stderr, "server_go: sys_epoll_wait failed: %s\n", err->msg);
 			continue;
 		}
 
+		serv->stats.waits++;
+		if (timeout != 0)
+			serv->stats.blocking++;
+		if (ev_count == 0)
+			serv->stats.empty++;
+		else if (now != 0)
+			busy_at = now;
+		serv->stats.events += ev_count;
+
 		for (i = 0; i < ev_count; i++) {
 			if (evt[i].data.ptr == serv)
-				server_handle(epfd, serv);
+				server_handle(epfd, serv->ls, serv);
+			else if (evt[i].data.ptr == &serv->uls)
+				server_handle(epfd, serv->uls, serv);
+			else if (evt[i].data.ptr == &serv->sfd)
+				server_signal(serv);
+			else if (evt[i].data.ptr == serv->bus)
+				/* Records are read after the batch. */
+				sys_read(serv->bus->efd[serv->worker], (char *) &wakeups, sizeof(wakeups), nil);
+			else if (serv->exec != nil && evt[i].data.ptr == serv->exec)
+				executor_complete(serv->exec);
 			else {
 				c = (client *) evt[i].data.ptr;
-				if (c->name_ok == false)
-					session_name_read(c, serv);
-				else
-					session_line_read(c, serv);
+				if (c->closing == true) {
+					session_close(c, serv);
+					continue;
+				}
+
+				if (evt[i].events & EPOLLOUT)
+					session_flush(c, serv);
+
+				if ((evt[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) == 0)
+					continue;
+
+				/* Its turn is on the ready list. */
+				if (c->ready)
+					continue;
+				session_read(c, serv);
 			}
 		}
+		session_read_ready(serv);
+
+		if (serv->bus != nil) {
+			bus_poll(serv);
+			bus_wake(serv);
+		}
+		tick = now_ms();
+		/* Nobody cares who leaves a server going down. */
+		if (!serv->drain.on)
+			presence_tick(serv, tick);
+		zbatch_flush(serv);
+		log_flush(&serv->log);
+		log_tick(&serv->log, tick);
+		flow_check(serv);
+		if (serv->drain.on && drain_tick(serv, tick))
+			break;
+
+		if (ev_count == serv->n_evt) {
+			serv->stats.full++;
+			if (serv->n_evt < max_events_cap)
+				server_grow_events(serv);
+		}
+	}
+
+	/* Drained, what the log has is made durable. */
+	log_flush(&serv->log);
+	if (serv->exec != nil) {
+		serv->log.syncer.again = false;
+		executor_stop(serv->exec);
+		serv->log.ex = nil;
+	}
+	if (serv->log.fd != -1)
+		log_sync_now(&serv->log);
+	fmt_fprintf(stderr, "server_go: drained, %l clients closed\n", serv->drain.closed);
+	return 0;
+}
+
+static void server_new_rooms(server * serv)
+{
+	arena a;
+
+	arena_create_flags(&a, rooms_size, serv->map_flags);
+
+	serv->rooms = (room *) arena_alloc(&a, rooms_size);
+	if (serv->rooms == nil) {
+		fmt_fprintf(stderr, "server_new_rooms: arena_alloc failed\n");
+		sys_exit_group(1);
+	}
+	serv->n_rooms = 0;
+
+	if (room_new(serv, lobby_name, sizeof(lobby_name) - 1) == nil)
+		sys_exit_group(1);
+}
+
+static void server_new_names(server * serv)
+{
+	arena a;
+
+	arena_create_flags(&a, serv->lim.name_slots * sizeof(client *), serv->map_flags);
+
+	serv->names.slots = (client **) arena_alloc(&a, serv->lim.name_slots * sizeof(client *));
+	if (serv->names.slots == nil) {
+		fmt_fprintf(stderr, "server_new_names: arena_alloc failed\n");
+		sys_exit_group(1);
+	}
+	serv->names.mask = serv->lim.name_slots - 1;
+	serv->names.used = 0;
+}
+
+/* Tables of the client and segment pools, mapped as they are needed. */
+static void server_new_pools(server * serv)
+{
+	arena a;
+
+	arena_create(&a, (serv->lim.pools + serv->lim.seg_pools) * sizeof(void *));
+
+	serv->first_clp = (client_pool **) arena_alloc(&a, serv->lim.pools * sizeof(client_pool *));
+	serv->seg_pls = (seg_pool **) arena_alloc(&a, serv->lim.seg_pools * sizeof(seg_pool *));
+	if (serv->first_clp == nil || serv->seg_pls == nil) {
+		fmt_fprintf(stderr, "server_new_pools: arena_alloc failed\n");
+		sys_exit_group(1);
+	}
+	serv->n_pls = 0;
+	serv->n_seg_pls = 0;
+}
+
+static void server_new_history(server * serv)
+{
+	arena a;
+
+	arena_create_flags(&a, history_size, serv->map_flags);
+
+	serv->hist.buf = (char *) arena_alloc(&a, history_size);
+	if (serv->hist.buf == nil) {
+		fmt_fprintf(stderr, "server_new_history: arena_alloc failed\n");
+		sys_exit_group(1);
+	}
+	serv->hist.head = 0;
+	serv->hist.count = 0;
+}
+
+/* The line buffers. A rendered line has the room, a space, the name,
+ * 17 bytes of time and brackets and the text, a private message has
+ * private_msg in place of the room.
+ */
+static void server_new_lines(server * serv)
+{
+	uint64 frame_size = align_forward(sizeof(bin_hdr) + max_room_name_len + max_name_len + serv->lim.line_len,
+									  default_alignment);
+	uint64 msg_size = align_forward(max_room_name_len + 1 + sizeof(private_msg) + max_name_len + 17
+									+ serv->lim.line_len, default_alignment);
+	arena a;
+
+	arena_create_flags(&a, frame_size + msg_size + serv->lim.line_len, serv->map_flags);
+
+	serv->lines.frame = (char *) arena_alloc(&a, frame_size);
+	serv->lines.msg = (char *) arena_alloc(&a, msg_size);
+	serv->lines.text = (char *) arena_alloc(&a, serv->lim.line_len);
+	if (serv->lines.frame == nil || serv->lines.msg == nil || serv->lines.text == nil) {
+		fmt_fprintf(stderr, "server_new_lines: arena_alloc failed\n");
+		sys_exit_group(1);
 	}
+	serv->lines.msg_size = msg_size;
+}
+
+/* The executor is shared with its threads, it lives in a mapping of its
+ * own.
+ */
+static int server_new_exec(server * serv, int threads)
+{
+	const error *err;
+	arena a;
+
+	arena_create(&a, sizeof(executor));
+	serv->exec = arena_alloc(&a, sizeof(executor));
+	if (serv->exec == nil) {
+		fmt_fprintf(stderr, "server_new_exec: arena_alloc failed\n");
+		return 1;
+	}
+	err = executor_start(serv->exec, threads);
+	if (err != nil) {
+		fmt_fprintf(stderr, "server_new_exec: executor_start failed: %s\n", err->msg);
+		return 1;
+	}
+	serv->log.ex = serv->exec;
 	return 0;
 }
 
+static void server_new_zbatches(server * serv)
+{
+	uint64 frame_size = zframe_header + lz_bound(zblock_size);
+	arena a;
+	int i;
+
+	arena_create_flags(&a, sizeof(lz_table) + frame_size + max_zbatches * zblock_size, serv->map_flags);
+
+	serv->lzt = (lz_table *) arena_alloc(&a, sizeof(lz_table));
+	serv->zframe = (byte *) arena_alloc(&a, frame_size);
+	for (i = 0; i < max_zbatches; i++)
+		serv->zb[i].buf = (char *) arena_alloc(&a, zblock_size);
+	if (serv->lzt == nil || serv->zframe == nil || serv->zb[max_zbatches - 1].buf == nil) {
+		fmt_fprintf(stderr, "server_new_zbatches: arena_alloc failed\n");
+		sys_exit_group(1);
+	}
+	lz_init(serv->lzt);
+	serv->n_zb = 0;
+}
+
 static int server_init(server * serv, uint16 port)
 {
 	struct sockaddr_in addr;
 	int enable = 1;
 	const error *err;
 
-	serv->ls = sys_socket(af_inet, sock_stream | sock_nonblock, 0, &err);
+	serv->ls = sys_socket(af_inet, sock_stream | sock_nonblock | sock_cloexec, 0, &err);
 	if (err != nil) {
 		fmt_fprintf(stderr, "server_init: sys_socket failed: %s\n", err->msg);
 		return 1;
@@ -455,6 +4437,15 @@ static int server_init(server * serv, uint16 port)
 		return 2;
 	}
 
+	/* Workers bind the port once each. */
+	if (serv->bus != nil) {
+		err = sys_setsockopt(serv->ls, sol_socket, so_reuseport, &enable, sizeof(enable));
+		if (err != nil) {
+			fmt_fprintf(stderr, "server_init: sys_setsockopt (reuseport) failed: %s\n", err->msg);
+			return 2;
+		}
+	}
+
 	addr.sin_family = af_inet;
 	addr.sin_addr.s_addr = INADDR_ANY;
 	addr.sin_port = hton(port);
@@ -465,7 +4456,7 @@ static int server_init(server * serv, uint16 port)
 		return 3;
 	}
 
-	err = sys_listen(serv->ls, backlog);
+	err = sys_listen(serv->ls, serv->lim.backlog);
 	if (err != nil) {
 		fmt_fprintf(stderr, "server_init: sys_listen failed: %s\n", err->msg);
 		return 4;
@@ -474,18 +4465,366 @@ static int server_init(server * serv, uint16 port)
 	return 0;
 }
 
-void _start(void)
+/* Local bots and bridges skip the TCP stack through this one. */
+static int server_init_unix(server * serv, const char *path)
+{
+	struct sockaddr_un addr;
+	const error *err;
+	uint64 len = c_strlen(path);
+
+	if (len == 0 || len >= sizeof(addr.sun_path)) {
+		fmt_fprintf(stderr, "server_init_unix: bad path %s\n", path);
+		return 1;
+	}
+
+	serv->uls = sys_socket(af_unix, sock_stream | sock_nonblock | sock_cloexec, 0, &err);
+	if (err != nil) {
+		fmt_fprintf(stderr, "server_init_unix: sys_socket failed: %s\n", err->msg);
+		serv->uls = -1;
+		return 2;
+	}
+
+	/* A socket file left by an earlier run would fail the bind. */
+	err = sys_unlink(path);
+	if (err != nil && err->code != ENOENT) {
+		fmt_fprintf(stderr, "server_init_unix: sys_unlink failed: %s\n", err->msg);
+		return 3;
+	}
+
+	addr.sun_family = af_unix;
+	memcpy(addr.sun_path, path, len + 1);
+	err = sys_bind(serv->uls, (struct sockaddr *) &addr, sizeof(addr.sun_family) + len + 1);
+	if (err != nil) {
+		fmt_fprintf(stderr, "server_init_unix: sys_bind failed: %s\n", err->msg);
+		return 4;
+	}
+
+	err = sys_listen(serv->uls, serv->lim.backlog);
+	if (err != nil) {
+		fmt_fprintf(stderr, "server_init_unix: sys_listen failed: %s\n", err->msg);
+		return 5;
+	}
+
+	return 0;
+}
+
+static int parse_uint(const char *s)
+{
+	int n = 0;
+
+	if (s == nil || *s == '\0')
+		return -1;
+	for (; *s != '\0'; s++) {
+		if (*s < '0' || *s > '9' || n > 1 << 20)
+			return -1;
+		n = n * 10 + *s - '0';
+	}
+	return n;
+}
+
+static int is_arg(const char *arg, const char *name, uint64 len)
+{
+	return c_strlen(arg) == len && memequal(arg, name, len);
+}
+
+/* =========== limits =========== */
+
+enum { lim_port, lim_backlog, lim_line_len, lim_events, lim_pool_clients, lim_pools, lim_out_mb, lim_mem_mb, n_limits };
+
+/* A flag wins over the environment, both over the default. */
+typedef struct limit_opt_t {
+	const char *arg;
+	const char *env;
+	int def;
+	int min;
+	int max;
+} limit_opt;
+
+static const limit_opt limit_opts[n_limits] = {
+	{port_arg, "CHAT_PORT", default_port, 1, 65535},
+	{backlog_arg, "CHAT_BACKLOG", default_backlog, 1, 65535},
+	{line_len_arg, "CHAT_LINE_LEN", default_line_len, min_line_len, max_line_len},
+	{events_arg, "CHAT_EVENTS", default_events, 1, max_events_cap},
+	{pool_clients_arg, "CHAT_POOL_CLIENTS", default_pool_clients, 1, max_pool_clients},
+	{pools_arg, "CHAT_POOLS", default_pools, 1, max_pools},
+	{out_mb_arg, "CHAT_OUT_MB", default_out_mb, 1, max_mem_mb},
+	/* 0 - no budget, the pools and segments are what the flags say. */
+	{mem_mb_arg, "CHAT_MEM_MB", 0, 1, max_mem_mb}
+};
+
+/* Returns the limit flag arg is, or -1. */
+static int limit_arg(const char *arg)
+{
+	int k;
+
+	for (k = 0; k < n_limits; k++)
+		if (is_arg(arg, limit_opts[k].arg, c_strlen(limit_opts[k].arg)))
+			return k;
+	return -1;
+}
+
+static const char *env_get(char **envp, const char *name)
+{
+	uint64 len = c_strlen(name);
+
+	for (; *envp != nil; envp++)
+		if (memequal(*envp, name, len) && (*envp)[len] == '=')
+			return *envp + len + 1;
+	return nil;
+}
+
+/* Fills v from the flags given and the environment. Returns a mask of
+ * the limits that were set, or -1.
+ */
+static int limits_parse(int *v, const char **given, char **envp)
+{
+	const char *s;
+	int k, set = 0;
+
+	for (k = 0; k < n_limits; k++) {
+		s = given[k] != nil ? given[k] : env_get(envp, limit_opts[k].env);
+		if (s == nil) {
+			v[k] = limit_opts[k].def;
+			continue;
+		}
+		v[k] = parse_uint(s);
+		if (v[k] < limit_opts[k].min || v[k] > limit_opts[k].max) {
+			fmt_fprintf(stderr, "server_main: %s (%s) takes %d to %d\n", limit_opts[k].arg, limit_opts[k].env,
+						limit_opts[k].min, limit_opts[k].max);
+			return -1;
+		}
+		set |= 1 << k;
+	}
+	return set;
+}
+
+/* Sizes the pools. A memory budget goes a quarter to output segments
+ * and the rest to client pools, unless their number was set as well.
+ * A client costs its chunk and two slots of the name index.
+ */
+static int limits_size(limits * lim, const int *v, int set, int workers)
+{
+	uint64 mem = (uint64) v[lim_mem_mb] * 1024 * 1024, per_pool;
+	uint64 procs = workers > 0 ? workers : 1;
+
+	lim->port = v[lim_port];
+	lim->backlog = v[lim_backlog];
+	lim->line_len = v[lim_line_len];
+	lim->events = v[lim_events];
+	lim->pool_clients = v[lim_pool_clients];
+	lim->pools = v[lim_pools];
+	lim->seg_pools = (uint64) v[lim_out_mb] * 1024 * 1024 / seg_pool_size;
+	lim->client_size = align_forward(sizeof(client) + lim->line_len, default_alignment);
+
+	if (workers > 0 && lim->line_len > bus_max_line) {
+		fmt_fprintf(stderr, "server_main: %s takes at most %d with %s\n", line_len_arg, (int) bus_max_line,
+					workers_arg);
+		return 1;
+	}
+
+	if (set & 1 << lim_mem_mb) {
+		if (!(set & 1 << lim_out_mb))
+			lim->seg_pools = mem / 4 / seg_pool_size;
+		if (lim->seg_pools < 1)
+			lim->seg_pools = 1;
+		per_pool = lim->pool_clients * (lim->client_size + 2 * sizeof(client *));
+		if (!(set & 1 << lim_pools))
+			lim->pools = mem > (uint64) lim->seg_pools * seg_pool_size
+				? (mem - (uint64) lim->seg_pools * seg_pool_size) / per_pool : 0;
+		if (lim->pools < 1)
+			lim->pools = 1;
+		if (lim->pools > max_pools)
+			lim->pools = max_pools;
+		if (lim->pools * procs * lim->pool_clients > max_clients)
+			lim->pools = max_clients / procs / lim->pool_clients;
+		if (lim->pools < 1)
+			lim->pools = 1;
+	}
+
+	if (lim->pools * procs * lim->pool_clients > max_clients) {
+		fmt_fprintf(stderr, "server_main: %s times %s%s%s takes at most %d clients\n", pools_arg, pool_clients_arg,
+					workers > 0 ? " times " : "", workers > 0 ? workers_arg : "", (int) max_clients);
+		return 1;
+	}
+
+	lim->name_slots = min_name_slots;
+	while (lim->name_slots < 2 * (uint64) lim->pools * lim->pool_clients)
+		lim->name_slots *= 2;
+	lim->bus_name_slots = 0;
+	if (workers > 0) {
+		lim->bus_name_slots = min_name_slots;
+		while (lim->bus_name_slots < 2 * procs * lim->pools * lim->pool_clients)
+			lim->bus_name_slots *= 2;
+	}
+	return 0;
+}
+
+/* The kernel starts us with argc, argv and envp on the stack, _start
+ * passes their address on and keeps the stack aligned as the ABI wants.
+ */
+__asm__(".text\n"
+		".global _start\n"
+		"_start:\n"
+		"\txor %ebp, %ebp\n"
+		"\tmov %rsp, %rdi\n"
+		"\tand $-16, %rsp\n"
+		"\tcall server_main\n"
+		"\thlt\n");
+
+void server_main(uint64 * sp)
 {
 	server serv;
-	client_pool *p[max_pools];
+	const error *err;
+	sigset mask;
+	int argc = sp[0], handoff = -1, workers = 0, exec_threads = 0, i, k, set;
+	const char *unix_path = nil;
+	const char *given[n_limits];
+	int v[n_limits];
+
+	serv.spin_us = 0;
+	serv.busy_poll_us = 0;
+	serv.map_flags = 0;
+	serv.exec = nil;
+	serv.evt = nil;
+	serv.ready_head = nil;
+	serv.ready_tail = nil;
+	serv.n_ready = 0;
+	serv.n_evt = 0;
+	serv.argv = (char **) (sp + 1);
+	serv.envp = serv.argv + argc + 1;
+	for (k = 0; k < n_limits; k++)
+		given[k] = nil;
+	for (i = 1; i < argc; i++) {
+		if (is_arg(serv.argv[i], handoff_arg, sizeof(handoff_arg) - 1))
+			handoff = parse_uint(serv.argv[++i]);
+		else if (is_arg(serv.argv[i], workers_arg, sizeof(workers_arg) - 1)) {
+			workers = parse_uint(serv.argv[++i]);
+			if (workers < 1 || workers > max_workers) {
+				fmt_fprintf(stderr, "server_main: %s takes 1 to %d\n", workers_arg, max_workers);
+				sys_exit_group(1);
+			}
+		} else if (is_arg(serv.argv[i], spin_arg, sizeof(spin_arg) - 1)) {
+			serv.spin_us = parse_uint(serv.argv[++i]);
+			if (serv.spin_us < 0)
+				sys_exit_group(1);
+		} else if (is_arg(serv.argv[i], busy_poll_arg, sizeof(busy_poll_arg) - 1)) {
+			serv.busy_poll_us = parse_uint(serv.argv[++i]);
+			if (serv.busy_poll_us < 0)
+				sys_exit_group(1);
+		} else if (is_arg(serv.argv[i], unix_arg, sizeof(unix_arg) - 1) && i + 1 < argc)
+			unix_path = serv.argv[++i];
+		/* Pools and tables on huge pages, faulted in and locked before
+		 * the first client comes.
+		 */
+		else if (is_arg(serv.argv[i], huge_pages_arg, sizeof(huge_pages_arg) - 1))
+			serv.map_flags |= arena_huge;
+		else if (is_arg(serv.argv[i], prefault_arg, sizeof(prefault_arg) - 1))
+			serv.map_flags |= arena_prefault;
+		else if (is_arg(serv.argv[i], mlock_arg, sizeof(mlock_arg) - 1))
+			serv.map_flags |= arena_lock;
+		else if (is_arg(serv.argv[i], exec_arg, sizeof(exec_arg) - 1)) {
+			exec_threads = parse_uint(serv.argv[++i]);
+			if (exec_threads < 1 || exec_threads > exec_max_workers) {
+				fmt_fprintf(stderr, "server_main: %s takes 1 to %d\n", exec_arg, exec_max_workers);
+				sys_exit_group(1);
+			}
+		} else if ((k = limit_arg(serv.argv[i])) != -1 && i + 1 < argc)
+			given[k] = serv.argv[++i];
+		else {
+			fmt_fprintf(stderr, "usage: %s [%s n] [%s us] [%s us] [%s path] [%s] [%s] [%s] [%s n]", serv.argv[0],
+						workers_arg, spin_arg, busy_poll_arg, unix_arg, huge_pages_arg, prefault_arg, mlock_arg,
+						exec_arg);
+			for (k = 0; k < n_limits; k++)
+				fmt_fprintf(stderr, " [%s n]", limit_opts[k].arg);
+			fmt_fprintf(stderr, "\n");
+			sys_exit_group(1);
+		}
+	}
+
+	set = limits_parse(v, given, serv.envp);
+	if (set == -1 || limits_size(&serv.lim, v, set, workers) != 0)
+		sys_exit_group(1);
 
-	serv.first_clp = p;
-	serv.n_pls = 0;
+	serv.ls = -1;
+	serv.uls = -1;
+	serv.bus = nil;
+	serv.worker = 0;
+	serv.bus_dirty = false;
+	serv.next_id = 1;
+	serv.mem.clp_maps = 0;
+	serv.mem.clp_unmaps = 0;
+	serv.pres.joined = 0;
+	serv.pres.left = 0;
+	serv.pres.buf_used = 0;
+	serv.pres.last = 0;
+	serv.pres.interval_ms = 0;
+	server_new_pools(&serv);
 	/* create pool for clients */
 	session_new_clp(&serv);
+	server_new_rooms(&serv);
+	server_new_names(&serv);
+	server_new_history(&serv);
+	server_new_lines(&serv);
+	server_new_zbatches(&serv);
+	serv.flow.segs = 0;
+	serv.flow.high = 0;
+	serv.flow.pause_at = (uint64) serv.lim.seg_pools * segs_in_pool * 3 / 4;
+	serv.flow.resume_at = (uint64) serv.lim.seg_pools * segs_in_pool / 2;
+	serv.flow.pauses = 0;
+	serv.flow.paused = false;
+	serv.drain.on = false;
+	serv.drain.closed = 0;
+
+	/* Writes to a peer that has gone return EPIPE instead of killing us,
+	 * SIGUSR1 (report), SIGUSR2 (hot restart), SIGCHLD (a worker died),
+	 * SIGTERM and SIGINT (drain and exit) are read from the signalfd.
+	 */
+	mask = (sigset) 1 << (sigpipe - 1) | (sigset) 1 << (sigusr1 - 1) | (sigset) 1 << (sigusr2 - 1)
+		| (sigset) 1 << (sigchld - 1) | (sigset) 1 << (sigterm - 1) | (sigset) 1 << (sigint - 1);
+	if (sys_rt_sigprocmask(sig_block, &mask, nil) != nil)
+		sys_exit_group(1);
+
+	mask = (sigset) 1 << (sigusr1 - 1) | (sigset) 1 << (sigusr2 - 1) | (sigset) 1 << (sigchld - 1)
+		| (sigset) 1 << (sigterm - 1) | (sigset) 1 << (sigint - 1);
+	serv.sfd = sys_signalfd(-1, &mask, sfd_nonblock | sfd_cloexec, &err);
+	if (err != nil) {
+		fmt_fprintf(stderr, "server_main: sys_signalfd failed: %s\n", err->msg);
+		sys_exit_group(1);
+	}
+
+	serv.epfd = sys_epoll_create1(epoll_cloexec, &err);
+	if (err != nil) {
+		fmt_fprintf(stderr, "server_main: sys_epoll_create1 failed: %s\n", err->msg);
+		sys_exit_group(1);
+	}
+
+	if (handoff != -1) {
+		if (handoff_in(&serv, handoff) != 0)
+			sys_exit_group(1);
+	} else if (workers > 0) {
+		if (master_init(&serv, workers, serv.lim.port) != 0)
+			sys_exit_group(1);
+	} else if (server_init(&serv, serv.lim.port))
+		sys_exit_group(1);
+
+	if (unix_path != nil && handoff == -1 && server_init_unix(&serv, unix_path) != 0)
+		sys_exit_group(1);
+
+	log_init(&serv.log, &serv.hist);
+
+	if (handoff != -1) {
+		/* Everything is in place, the old process may go. */
+		sys_write(handoff, "k", 1, nil);
+		sys_close(handoff);
+	}
+
+	/* Workers start with the history the log gave us. */
+	if (is_master(&serv) && master_spawn(&serv) != 0)
+		sys_exit_group(1);
 
-	if (server_init(&serv, 7070))
-		sys_exit(1);
+	/* After the workers are forked, threads don't survive it. */
+	if (exec_threads > 0 && server_new_exec(&serv, exec_threads) != 0)
+		sys_exit_group(1);
 
 #ifdef DEBUG_PRINT
 	fmt_fprintf(stdout, "serv.first_clp: %p\n", serv.first_clp);
@@ -496,5 +4835,5 @@ void _start(void)
 	fmt_fprintf(stdout, "serv.first_clp[0]->p.head: %p\n", serv.first_clp[0]->p.head);
 #endif
 
-	sys_exit(server_go(&serv));
+	sys_exit_group(server_go(&serv));
 }